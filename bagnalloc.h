@@ -0,0 +1,322 @@
+/**
+ * @file bagnalloc.h
+ * @author Alexander Bagnall
+ * @brief Functions provided by the allocator on top of malloc(), free(), calloc() and realloc().
+ */
+
+#ifndef BAGNALLOC_H
+#define BAGNALLOC_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BAGNALLOC_WALK_BUCKETS 16 // # of buckets of bagnalloc_arena_stats::walks
+#define BAGNALLOC_RESERVE_POPULATE 1 // bagnalloc_reserve() flag: fault the pages in as well
+
+/** @struct bagnalloc_stats
+ *  @brief A snapshot of the allocator's counters.
+ *  @var bagnalloc_stats::engine
+ *  Name of the engine managing the heap (the BAGNALLOC_ENGINE environment variable).
+ *  @var bagnalloc_stats::heap_size
+ *  Number of bytes between the start and the end of the heap.
+ *  @var bagnalloc_stats::transfer_hits
+ *  Number of times an empty cache was refilled with a batch from the transfer cache.
+ *  @var bagnalloc_stats::transfer_misses
+ *  Number of times an empty cache found no batch in the transfer cache and went to the heap.
+ *  @var bagnalloc_stats::transfer_inserts
+ *  Number of batches given up by caches that the transfer cache took in.
+ *  @var bagnalloc_stats::transfer_overflows
+ *  Number of batches given up by caches that went to the heap because the transfer cache was full.
+ *  @var bagnalloc_stats::transfer_cached_bytes
+ *  Number of bytes currently held by the transfer cache.
+ *  @var bagnalloc_stats::medium_hits
+ *  Number of medium blocks handed out by the central free lists.
+ *  @var bagnalloc_stats::medium_misses
+ *  Number of times the central free lists of a medium size class were all empty.
+ *  @var bagnalloc_stats::medium_cached_bytes
+ *  Approximate number of bytes currently held by the central free lists.
+ *  @var bagnalloc_stats::tiny_runs
+ *  Number of runs of tiny slots (BAGNALLOC_TINY), each taking 4 kB. With the page heap, empty runs
+ *  go back to it and are no longer counted.
+ *  @var bagnalloc_stats::tiny_objects
+ *  Number of tiny slots currently allocated.
+ *  @var bagnalloc_stats::page_heap_size
+ *  Number of bytes of the page heap (BAGNALLOC_PAGEHEAP) covered by spans, free or not.
+ *  @var bagnalloc_stats::page_free_bytes
+ *  Number of those bytes in free spans.
+ *  @var bagnalloc_stats::page_released_bytes
+ *  Number of the free bytes that have been given back to the system.
+ *  @var bagnalloc_stats::page_large_spans
+ *  Number of large allocations currently served by spans of the page heap.
+ *  @var bagnalloc_stats::page_filled_huge_pages
+ *  Number of huge pages (2 MiB) the huge page filler (BAGNALLOC_HUGEPAGE) packs spans into.
+ *  @var bagnalloc_stats::page_filled_bytes
+ *  Number of bytes of spans in those huge pages; divided by their size, how densely they are used.
+ *  @var bagnalloc_stats::page_huge_backed_bytes
+ *  Number of bytes of the page heap backed by transparent huge pages, as the kernel reports it.
+ *  @var bagnalloc_stats::arenas
+ *  Number of arenas. Threads start on the arena with the fewest threads and move to a less
+ *  contended arena, creating one if needed, when they find its lock taken too often.
+ *  @var bagnalloc_stats::arena_limit
+ *  Maximum number of arenas (a few per cpu by default, or the BAGNALLOC_ARENAS environment variable).
+ *  @var bagnalloc_stats::arena_migrations
+ *  Number of times a thread moved to another arena because of contention.
+ *  @var bagnalloc_stats::thread_arena
+ *  Index of the arena of the calling thread, -1 if it hasn't allocated from an arena yet.
+ *  @var bagnalloc_stats::numa_nodes
+ *  Number of NUMA nodes the arenas are spread over (1 on a uniform machine, or the
+ *  BAGNALLOC_NUMA_FAKE environment variable). Threads only use arenas of their node.
+ *  @var bagnalloc_stats::numa_remote_frees
+ *  Number of blocks freed by a thread on another node, which went straight back to their arena.
+ *  @var bagnalloc_stats::clones
+ *  Number of blocks cloned by bagnalloc_clone() by mapping them again, copy-on-write.
+ *  @var bagnalloc_stats::clone_copied_bytes
+ *  Number of bytes bagnalloc_clone() copied: the pages a block wrote to since it was last
+ *  cloned, blocks put in a memfd by their first clone, and blocks that can't be mapped again.
+ *  @var bagnalloc_stats::reserved_bytes
+ *  Number of bytes the heaps were grown by ahead of time with bagnalloc_reserve().
+ *  @var bagnalloc_stats::prefaulted_bytes
+ *  Number of those bytes whose pages were faulted in (BAGNALLOC_RESERVE_POPULATE).
+ */
+struct bagnalloc_stats {
+    const char *engine;
+    size_t heap_size;
+    size_t transfer_hits;
+    size_t transfer_misses;
+    size_t transfer_inserts;
+    size_t transfer_overflows;
+    size_t transfer_cached_bytes;
+    size_t medium_hits;
+    size_t medium_misses;
+    size_t medium_cached_bytes;
+    size_t tiny_runs;
+    size_t tiny_objects;
+    size_t page_heap_size;
+    size_t page_free_bytes;
+    size_t page_released_bytes;
+    size_t page_large_spans;
+    size_t page_filled_huge_pages;
+    size_t page_filled_bytes;
+    size_t page_huge_backed_bytes;
+    size_t arenas;
+    size_t arena_limit;
+    size_t arena_migrations;
+    long thread_arena;
+    size_t numa_nodes;
+    size_t numa_remote_frees;
+    size_t clones;
+    size_t clone_copied_bytes;
+    size_t reserved_bytes;
+    size_t prefaulted_bytes;
+};
+
+/** @struct bagnalloc_arena_stats
+ *  @brief A snapshot of the counters of one arena.
+ *  @var bagnalloc_arena_stats::size
+ *  Number of bytes between the start and the end of the arena's heap.
+ *  @var bagnalloc_arena_stats::node
+ *  The NUMA node the arena belongs to.
+ *  @var bagnalloc_arena_stats::threads
+ *  Number of threads currently assigned to the arena.
+ *  @var bagnalloc_arena_stats::acquisitions
+ *  Number of times the arena's lock was taken to allocate.
+ *  @var bagnalloc_arena_stats::contention
+ *  Number of those times the lock was already taken by another thread.
+ *  @var bagnalloc_arena_stats::pressure
+ *  Contention seen by the last thread that checked: failed attempts to take the lock out of its last 256.
+ *  @var bagnalloc_arena_stats::walks
+ *  Number of free list searches by the number of free blocks they passed over: walks[0] counts
+ *  searches that took the first block they looked at, walks[i] those that passed over 2^(i-1) to
+ *  2^i - 1 blocks, and the last bucket everything longer. Only the first-fit, next-fit and
+ *  best-fit engines search a free list.
+ */
+struct bagnalloc_arena_stats {
+    size_t size;
+    size_t node;
+    size_t threads;
+    size_t acquisitions;
+    size_t contention;
+    size_t pressure;
+    size_t walks[BAGNALLOC_WALK_BUCKETS];
+};
+
+/**
+ * @brief Take a snapshot of the allocator's counters.
+ * @param stats The structure to fill in.
+ */
+void bagnalloc_get_stats(struct bagnalloc_stats *stats);
+
+/**
+ * @brief Take a snapshot of the counters of one arena.
+ * @param index The index of the arena, from 0 to bagnalloc_stats::arenas - 1.
+ * @param stats The structure to fill in.
+ * @return Returns 1 on success, 0 if there is no such arena.
+ */
+int bagnalloc_get_arena_stats(size_t index, struct bagnalloc_arena_stats *stats);
+
+/**
+ * @brief Print the allocator's counters in a human readable form.
+ * @param file The stream to print to.
+ */
+void bagnalloc_print_stats(FILE *file);
+
+/**
+ * @brief Make a copy of a block allocated by malloc(). A block large enough to have a mapping of
+ * its own is cloned copy-on-write through a memfd, so that the clone costs page tables rather
+ * than a copy of the data; set BAGNALLOC_CLONE=1 for its first clone to be as cheap. Other blocks
+ * are copied.
+ * @param ptr The block, which must not be written while it is cloned.
+ * @return Returns the clone, to be freed with free(), or NULL if \p ptr is NULL or there isn't
+ * enough memory.
+ */
+void *bagnalloc_clone(void *ptr);
+
+/**
+ * @brief Grow the heap of the calling thread's arena ahead of time, so that the first requests
+ * after startup don't pay for growing it. The space stays reserved for the thread's arena, so
+ * call it from the threads that will allocate (the main thread for the main arena).
+ * @param bytes The number of bytes to reserve; 0 does nothing.
+ * @param flags 0, or BAGNALLOC_RESERVE_POPULATE to fault the pages in as well, so that the
+ * first requests don't take page faults either.
+ * @return Returns 0 on success, -1 if the heap couldn't be grown by that much.
+ */
+int bagnalloc_reserve(size_t bytes, int flags);
+
+/**
+ * @brief Fill the calling thread's front-end caches (BAGNALLOC_CACHE) with blocks of a size, so
+ * that its first requests of that size are served from them.
+ * @param size The size of the blocks.
+ * @param count The number of blocks; the caches keep what they have room for.
+ * @return Returns the number of blocks put through the caches.
+ */
+size_t bagnalloc_reserve_cache(size_t size, size_t count);
+
+/**
+ * @brief A heap in a file, mapped at a fixed address, that keeps its blocks from one run of a
+ * program to the next (see persist.c).
+ */
+struct bagnalloc_persist;
+
+/**
+ * @brief Open a persistent heap, creating it if the file is empty or doesn't exist. A heap that
+ * wasn't closed with bagnalloc_persist_close() (because the process died) is recovered: its
+ * free lists are rebuilt from its blocks.
+ * @param path The file holding the heap.
+ * @param base The address to map the file at (page aligned), the same every time.
+ * @param size The largest size the file may grow to.
+ * @param recovered If not NULL, set to whether the heap had to be recovered.
+ * @return Returns the heap, or NULL with errno set if the file can't be opened, is open in
+ * another process (EBUSY), can't be mapped at \p base (EEXIST) or holds something else (EINVAL).
+ */
+struct bagnalloc_persist *bagnalloc_persist_open(const char *path, void *base, size_t size, int *recovered);
+
+/**
+ * @brief Allocate a block of a persistent heap. Free it with bagnalloc_persist_free(), not free().
+ * @return Returns a pointer to the block, or NULL if \p size is 0 or the heap is full or can't
+ * hold a block that large.
+ */
+void *bagnalloc_persist_alloc(struct bagnalloc_persist *heap, size_t size);
+
+/**
+ * @brief Free a block of a persistent heap.
+ */
+void bagnalloc_persist_free(struct bagnalloc_persist *heap, void *ptr);
+
+/**
+ * @brief Get the root pointer of a persistent heap, NULL until one is set.
+ */
+void *bagnalloc_persist_root(struct bagnalloc_persist *heap);
+
+/**
+ * @brief Set the root pointer of a persistent heap, through which its data is found again.
+ */
+void bagnalloc_persist_set_root(struct bagnalloc_persist *heap, void *root);
+
+/**
+ * @brief Write a persistent heap back to its file, mark it clean and unmap it.
+ * @return Returns 0 on success, -1 if writing failed.
+ */
+int bagnalloc_persist_close(struct bagnalloc_persist *heap);
+
+/**
+ * @brief A pool of shared memory that several processes allocate from and exchange blocks
+ * through by their offsets (see shared.c).
+ */
+struct bagnalloc_shared;
+
+/** @struct bagnalloc_shared_stats
+ *  @brief A snapshot of the counters of a shared pool.
+ *  @var bagnalloc_shared_stats::size
+ *  Number of bytes in the pool.
+ *  @var bagnalloc_shared_stats::used
+ *  Number of bytes in allocated blocks, headers included.
+ *  @var bagnalloc_shared_stats::recoveries
+ *  Number of times a process found the pool's lock left by a dead process and rebuilt the pool.
+ */
+struct bagnalloc_shared_stats {
+    size_t size;
+    size_t used;
+    size_t recoveries;
+};
+
+/**
+ * @brief Create a shared pool.
+ * @param fd The file to hold the pool, such as one from shm_open(), or -1 for a new memfd.
+ * @param size The size of the pool, which it keeps (rounded up to whole pages).
+ * @return Returns the pool, or NULL with errno set. Pass bagnalloc_shared_fd() to the other
+ * processes (through fork() or a unix socket) for them to attach to it.
+ */
+struct bagnalloc_shared *bagnalloc_shared_create(int fd, size_t size);
+
+/**
+ * @brief Attach to a shared pool created by another process. It may be mapped at another address.
+ * @return Returns the pool, or NULL with errno set (EINVAL if the file holds no pool).
+ */
+struct bagnalloc_shared *bagnalloc_shared_attach(int fd);
+
+/**
+ * @brief Unmap a shared pool from the calling process; the pool lives on in the others. The file
+ * descriptor isn't closed.
+ */
+void bagnalloc_shared_detach(struct bagnalloc_shared *pool);
+
+/**
+ * @brief Get the file descriptor of a shared pool in the calling process.
+ */
+int bagnalloc_shared_fd(struct bagnalloc_shared *pool);
+
+/**
+ * @brief Allocate a block of a shared pool. Any process attached to the pool may free it.
+ * @return Returns a pointer to the block, or NULL if \p size is 0 or the pool is full.
+ */
+void *bagnalloc_shared_alloc(struct bagnalloc_shared *pool, size_t size);
+
+/**
+ * @brief Free a block of a shared pool.
+ */
+void bagnalloc_shared_free(struct bagnalloc_shared *pool, void *ptr);
+
+/**
+ * @brief Get the offset of a block in a shared pool, which is the same in every process.
+ */
+size_t bagnalloc_shared_offset(struct bagnalloc_shared *pool, void *ptr);
+
+/**
+ * @brief Get the address in the calling process of an offset in a shared pool.
+ */
+void *bagnalloc_shared_pointer(struct bagnalloc_shared *pool, size_t offset);
+
+/**
+ * @brief Take a snapshot of the counters of a shared pool.
+ */
+void bagnalloc_shared_get_stats(struct bagnalloc_shared *pool, struct bagnalloc_shared_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,299 @@
+/**
+ * @file bagnalloc_internal.h
+ * @author Alexander Bagnall
+ * @brief Declarations shared between the heap in malloc.c, the buddy engine in buddy.c, the segregated
+ * fit and TLSF engines in fits.c, the front-end caches in cache.c, the central free lists in medium.c,
+ * the tiny slots in tiny.c, the bitmap kernels in bitmap.c, the page heap in pageheap.c, the NUMA
+ * topology in numa.c, the persistent heaps in persist.c and the shared pools in shared.c.
+ */
+
+#ifndef BAGNALLOC_INTERNAL_H
+#define BAGNALLOC_INTERNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct block_meta;
+
+#ifdef COMPRESSED_LINKS
+/**
+ * @brief A link to another block of the same heap: its offset from the base of the heap in units
+ * of 8 bytes, plus one so that 0 can stand for NULL. Halves the size of the links on 64-bit
+ * systems, at the price of a heap spanning at most LINK_SPAN bytes from its base.
+ */
+typedef uint32_t heap_link;
+#ifndef LINK_SPAN
+#define LINK_SPAN (((size_t)UINT32_MAX - 1) * 8) // # of bytes a heap may span from its base (just under 32 GiB)
+#endif
+#else
+typedef struct block_meta *heap_link;
+#endif
+
+/** @struct block_meta
+ *  @brief The structure at the beginning of every block node in the heap (whether free or allocated).
+ *  @var block_meta::length
+ *  Length of the data portion of the block (doesn't include sizeof this structure).
+ *  @var block_meta::prev
+ *  A link to the previous block. NULL if the current block is the first block.
+ *  @var block_meta::next
+ *  A link to the next block. NULL if the current block has been allocated (not free).
+ *  If the current block is free, next points to either the next free block or end_brk if the current block is the last free block.
+ *  @var block_meta::tag
+ *  Either the index + 1 of the thread cache that owns an allocated block (0 if none), or MMAP_TAG
+ *  (~0u, see malloc.c) for a block with a mapping of its own, whose mapping_meta header sits in
+ *  front of this one. Also required for the struct to be long word aligned on a 32-bit system.
+ *  @note The links are plain pointers unless built with -DCOMPRESSED_LINKS (see heap_link); they
+ *  are read and written with link_get() and link_make().
+ */
+typedef struct block_meta {
+  size_t length;
+  heap_link prev;
+  heap_link next;
+  unsigned int tag;
+} block_meta;
+
+/**
+ * @brief Follow a link.
+ * @param base The base of the heap holding the block the link is stored in.
+ * @param link The link.
+ * @return Returns the block linked to, or NULL.
+ */
+static inline block_meta* link_get(const void *base, heap_link link)
+{
+#ifdef COMPRESSED_LINKS
+    return link ? (block_meta*)((char*)base + ((size_t)link - 1) * 8) : NULL;
+#else
+    (void)base;
+    return link;
+#endif
+}
+
+/**
+ * @brief Make a link to a block.
+ * @param base The base of the heap holding the block the link will be stored in.
+ * @param block The block, which must lie within LINK_SPAN bytes of \p base, or NULL.
+ */
+static inline heap_link link_make(const void *base, const block_meta *block)
+{
+#ifdef COMPRESSED_LINKS
+    return block ? (heap_link)(((const char*)block - (const char*)base) / 8 + 1) : 0;
+#else
+    (void)base;
+    return (block_meta*)block;
+#endif
+}
+
+/**
+ * @brief Get the marker ending the free lists whose last block must not look allocated (have a
+ * NULL next link). It is not the address of any block.
+ * @param base The base of the heap.
+ */
+static inline block_meta* link_end(const void *base)
+{
+#ifdef COMPRESSED_LINKS
+    return (block_meta*)((char*)base + LINK_SPAN);
+#else
+    (void)base;
+    return (block_meta*)1;
+#endif
+}
+
+#define SMALL_MAX 256 // largest request (in bytes) served by the front-end caches
+#define NUM_CLASSES (SMALL_MAX / 8) // one size class per multiple of 8 up to SMALL_MAX
+#define MEDIUM_MAX 4096 // largest request (in bytes) served by the central free lists in medium.c
+#define TINY_MAX 16 // largest request (in bytes) served by the header-free slots in tiny.c
+#define HEAP_PAGE_SIZE 4096 // # of bytes in a page of the page heap in pageheap.c
+
+enum page_kind { PAGE_NONE, PAGE_FREE, PAGE_SLAB, PAGE_LARGE }; // what a span of the page heap is for
+
+/**
+ * @brief Get the size class of a small block.
+ * @param size The length of the block (a nonzero multiple of 8 no larger than SMALL_MAX).
+ * @return Returns the index of the size class.
+ */
+static inline size_t size_class(size_t size)
+{
+    return size / 8 - 1;
+}
+
+/**
+ * @brief Get the block length of a size class.
+ * @param c The index of the size class.
+ * @return Returns the number of bytes in the data section of blocks of class \p c.
+ */
+static inline size_t class_size(size_t c)
+{
+    return (c + 1) * 8;
+}
+
+#define BUDDY_MIN_ORDER 6 // smallest buddy block: 64 bytes, header included
+#define BUDDY_MAX_ORDER (sizeof(void*) == 8 ? 40 : 28) // largest buddy block
+#define BUDDY_ORDERS (BUDDY_MAX_ORDER - BUDDY_MIN_ORDER + 1)
+#define BUDDY_ALIGNMENT (sizeof(block_meta) & -sizeof(block_meta)) // alignment of the data section of every buddy block
+
+/** @struct buddy_heap
+ *  @brief The state of the buddy engine in buddy.c for one arena.
+ *  @var buddy_heap::base
+ *  Start of the heap. Block offsets are taken from here.
+ *  @var buddy_heap::end
+ *  End of the part of the heap covered by blocks.
+ *  @var buddy_heap::orders
+ *  Bit i is set if the free list of order BUDDY_MIN_ORDER + i isn't empty.
+ *  @var buddy_heap::free_lists
+ *  The first free block of each order, NULL if the list is empty.
+ */
+typedef struct buddy_heap {
+    char *base;
+    char *end;
+    size_t orders;
+    block_meta *free_lists[BUDDY_ORDERS];
+} buddy_heap;
+
+#define FIT_SMALL 256 // free blocks shorter than this have one fit list per multiple of 8
+#define FIT_SMALL_SHIFT 8 // log2(FIT_SMALL)
+#define FIT_SL_SHIFT 4 // TLSF splits every power of two into 2^FIT_SL_SHIFT lists
+#define FIT_SL (1 << FIT_SL_SHIFT)
+#define FIT_MAX_SHIFT (sizeof(void*) == 8 ? 40 : 31) // log2 of the largest block with lists of its own
+#define FIT_MAX_SIZE ((size_t)1 << FIT_MAX_SHIFT) // largest request served by the fit engines
+#define FIT_LISTS (FIT_SMALL / 8 + (FIT_MAX_SHIFT - FIT_SMALL_SHIFT + 1) * FIT_SL)
+#define FIT_WORDS ((FIT_LISTS + 63) / 64)
+
+enum fit_kind { FIT_SEGREGATED, FIT_TLSF };
+
+/** @struct fit_heap
+ *  @brief The state of the segregated fit or TLSF engine in fits.c for one arena.
+ *  @var fit_heap::kind
+ *  FIT_SEGREGATED or FIT_TLSF.
+ *  @var fit_heap::base
+ *  Start of the heap. The links of its blocks are relative to it.
+ *  @var fit_heap::end
+ *  End of the heap.
+ *  @var fit_heap::top
+ *  The last block of the heap, which grows when the heap does if it is free.
+ *  @var fit_heap::bitmap
+ *  Bit i is set if list i isn't empty.
+ *  @var fit_heap::lists
+ *  The first free block of each list, NULL if the list is empty.
+ */
+typedef struct fit_heap {
+    int kind;
+    char *base;
+    char *end;
+    block_meta *top;
+    uint64_t bitmap[FIT_WORDS];
+    block_meta *lists[FIT_LISTS];
+} fit_heap;
+
+/** @struct bitmap_kernel
+ *  @brief A way to search bitmaps (see bitmap.c). Bit i of a bitmap is bit i % 64 of word i / 64.
+ *  @var bitmap_kernel::name
+ *  The value of BAGNALLOC_BITMAP that selects the kernel.
+ *  @var bitmap_kernel::supported
+ *  Check whether the cpu can run the kernel.
+ *  @var bitmap_kernel::find_set
+ *  Find the first set bit at or after a bit in an array of words, or the number of bits if there is none.
+ *  @var bitmap_kernel::find_clear
+ *  Find the first clear bit at or after a bit in an array of words, or the number of bits if there is none.
+ */
+typedef struct bitmap_kernel {
+    const char *name;
+    int (*supported)(void);
+    size_t (*find_set)(const uint64_t *words, size_t n, size_t from);
+    size_t (*find_clear)(const uint64_t *words, size_t n, size_t from);
+} bitmap_kernel;
+
+/* bitmap.c */
+extern const bitmap_kernel bitmap_kernels[];
+extern const bitmap_kernel *bitmap_search;
+const bitmap_kernel *bitmap_kernel_named(const char *name);
+void bitmap_init(void);
+
+/**
+ * @brief Find the first set bit at or after bit \p from of the \p n words at \p words.
+ * @return Returns the index of the bit, or n * 64 if there is none.
+ */
+static inline size_t bitmap_find_set(const uint64_t *words, size_t n, size_t from)
+{
+    return bitmap_search->find_set(words, n, from);
+}
+
+/**
+ * @brief Find the first clear bit at or after bit \p from of the \p n words at \p words.
+ * @return Returns the index of the bit, or n * 64 if there is none.
+ */
+static inline size_t bitmap_find_clear(const uint64_t *words, size_t n, size_t from)
+{
+    return bitmap_search->find_clear(words, n, from);
+}
+
+/* malloc.c */
+size_t heap_alloc_batch(size_t size, void **ptrs, size_t n);
+void heap_free_batch(void **ptrs, size_t n);
+unsigned int heap_thread_node(void);
+unsigned int heap_block_node(void *ptr);
+
+/* cache.c */
+struct bagnalloc_stats;
+void cache_init(void);
+void cache_stats(struct bagnalloc_stats *stats);
+void *cache_alloc(size_t size);
+int cache_free(void *ptr, size_t length);
+void cache_fork_prepare(void);
+void cache_fork_parent(void);
+void cache_fork_child(void);
+
+/* buddy.c */
+void buddy_init(buddy_heap *h, void *start, void *end);
+void buddy_grow(buddy_heap *h, void *end);
+size_t buddy_shortfall(buddy_heap *h, size_t alignment, size_t size);
+void *buddy_alloc(buddy_heap *h, size_t alignment, size_t size);
+void buddy_free(buddy_heap *h, void *ptr);
+size_t buddy_block_length(size_t size);
+void buddy_trim(buddy_heap *h, size_t min, size_t page_size);
+
+/* fits.c */
+void fits_init(fit_heap *h, int kind, void *start, void *end);
+void fits_grow(fit_heap *h, void *end);
+size_t fits_shortfall(fit_heap *h, size_t size);
+void *fits_alloc(fit_heap *h, size_t size);
+void fits_free(fit_heap *h, void *ptr);
+block_meta *fits_split(fit_heap *h, block_meta *block, size_t size);
+void fits_trim(fit_heap *h, size_t min, size_t page_size);
+size_t fits_rebuild(fit_heap *h);
+
+/* medium.c */
+void medium_init(void);
+void medium_stats(struct bagnalloc_stats *stats);
+void *medium_alloc(size_t size);
+int medium_free(void *ptr, size_t length);
+
+/* pageheap.c */
+void page_heap_init(void);
+int page_heap_enabled(void);
+void page_heap_stats(struct bagnalloc_stats *stats);
+void *page_alloc(size_t pages, int kind);
+void page_free(void *ptr);
+int page_kind(void *ptr);
+size_t page_length(void *ptr);
+void page_fork_prepare(void);
+void page_fork_parent(void);
+void page_fork_child(void);
+
+/* numa.c */
+#define NUMA_MAX_NODES 8 // # of nodes told apart; higher node numbers share the lists of lower ones
+extern unsigned int numa_nodes;
+void numa_init(void);
+unsigned int numa_node(void);
+void numa_bind(void *start, size_t length, unsigned int node);
+
+/* tiny.c */
+void tiny_init(void);
+void tiny_stats(struct bagnalloc_stats *stats);
+void *tiny_alloc(size_t size);
+int tiny_free(void *ptr);
+size_t tiny_length(void *ptr);
+void tiny_fork_prepare(void);
+void tiny_fork_parent(void);
+void tiny_fork_child(void);
+
+#endif
@@ -0,0 +1,235 @@
+/**
+ * @file bitmap.c
+ * @author Alexander Bagnall
+ * @brief Bitmap search kernels, picked for the cpu when the heap is initialized.
+ *
+ * The fit engines find their non-empty lists and the tiny slots their free slots by looking for
+ * the first set (or clear) bit at or after some index in an array of 64-bit words. Past the word
+ * the search starts in, most of the words are usually empty (or full), so the vector kernels
+ * test several of them at once and only look at single words once one of them has a bit of
+ * interest:
+ *  - "avx2" tests four words per step with VPTEST,
+ *  - "sse4.2" tests two words per step with PTEST,
+ *  - "scalar" checks one word at a time, as portable C with __builtin_ctzll().
+ * The best kernel the cpu supports (as told by CPUID) is used unless the BAGNALLOC_BITMAP
+ * environment variable names another one. The vector kernels are compiled with target attributes,
+ * so the rest of the allocator doesn't need to be built for those instruction sets.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86
+#endif
+
+#include "bagnalloc_internal.h"
+
+/**
+ * @brief Find the first set bit at or after bit \p from, one word at a time.
+ */
+static size_t scalar_find_set(const uint64_t *words, size_t n, size_t from)
+{
+    size_t w = from / 64;
+    if (w >= n)
+        return n * 64;
+
+    uint64_t bits = words[w] & (~(uint64_t)0 << (from % 64));
+    while (!bits)
+    {
+        if (++w == n)
+            return n * 64;
+        bits = words[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+/**
+ * @brief Find the first clear bit at or after bit \p from, one word at a time.
+ */
+static size_t scalar_find_clear(const uint64_t *words, size_t n, size_t from)
+{
+    size_t w = from / 64;
+    if (w >= n)
+        return n * 64;
+
+    uint64_t bits = ~words[w] & (~(uint64_t)0 << (from % 64));
+    while (!bits)
+    {
+        if (++w == n)
+            return n * 64;
+        bits = ~words[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+static int always_supported()
+{
+    return 1;
+}
+
+#ifdef BITMAP_X86
+
+/*
+ * The vector kernels handle the word the search starts in on its own, since only part of it
+ * counts, then step over whole vectors and finish the last few words one at a time. A vector
+ * with a bit of interest is searched word by word.
+ */
+
+__attribute__((target("sse4.2")))
+static size_t sse42_find_set(const uint64_t *words, size_t n, size_t from)
+{
+    size_t w = from / 64;
+    if (w >= n)
+        return n * 64;
+
+    uint64_t bits = words[w] & (~(uint64_t)0 << (from % 64));
+    if (bits)
+        return w * 64 + __builtin_ctzll(bits);
+
+    for (++w; w + 2 <= n; w += 2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(words + w));
+        if (!_mm_testz_si128(v, v))
+            break;
+    }
+    for (; w < n; ++w)
+        if (words[w])
+            return w * 64 + __builtin_ctzll(words[w]);
+    return n * 64;
+}
+
+__attribute__((target("sse4.2")))
+static size_t sse42_find_clear(const uint64_t *words, size_t n, size_t from)
+{
+    size_t w = from / 64;
+    if (w >= n)
+        return n * 64;
+
+    uint64_t bits = ~words[w] & (~(uint64_t)0 << (from % 64));
+    if (bits)
+        return w * 64 + __builtin_ctzll(bits);
+
+    const __m128i ones = _mm_set1_epi32(-1);
+    for (++w; w + 2 <= n; w += 2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(words + w));
+        if (!_mm_testc_si128(v, ones))
+            break;
+    }
+    for (; w < n; ++w)
+        if (~words[w])
+            return w * 64 + __builtin_ctzll(~words[w]);
+    return n * 64;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_set(const uint64_t *words, size_t n, size_t from)
+{
+    size_t w = from / 64;
+    if (w >= n)
+        return n * 64;
+
+    uint64_t bits = words[w] & (~(uint64_t)0 << (from % 64));
+    if (bits)
+        return w * 64 + __builtin_ctzll(bits);
+
+    for (++w; w + 4 <= n; w += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(words + w));
+        if (!_mm256_testz_si256(v, v))
+            break;
+    }
+    for (; w < n; ++w)
+        if (words[w])
+            return w * 64 + __builtin_ctzll(words[w]);
+    return n * 64;
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_clear(const uint64_t *words, size_t n, size_t from)
+{
+    size_t w = from / 64;
+    if (w >= n)
+        return n * 64;
+
+    uint64_t bits = ~words[w] & (~(uint64_t)0 << (from % 64));
+    if (bits)
+        return w * 64 + __builtin_ctzll(bits);
+
+    const __m256i ones = _mm256_set1_epi32(-1);
+    for (++w; w + 4 <= n; w += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(words + w));
+        if (!_mm256_testc_si256(v, ones))
+            break;
+    }
+    for (; w < n; ++w)
+        if (~words[w])
+            return w * 64 + __builtin_ctzll(~words[w]);
+    return n * 64;
+}
+
+static int sse42_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static int avx2_supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+// from the most to the least preferred
+const bitmap_kernel bitmap_kernels[] = {
+#ifdef BITMAP_X86
+    { .name = "avx2", .supported = avx2_supported, .find_set = avx2_find_set, .find_clear = avx2_find_clear },
+    { .name = "sse4.2", .supported = sse42_supported, .find_set = sse42_find_set, .find_clear = sse42_find_clear },
+#endif
+    { .name = "scalar", .supported = always_supported, .find_set = scalar_find_set, .find_clear = scalar_find_clear },
+    { .name = NULL }
+};
+
+const bitmap_kernel *bitmap_search = &bitmap_kernels[sizeof(bitmap_kernels) / sizeof(bitmap_kernels[0]) - 2];
+
+/**
+ * @brief Look up a kernel by name.
+ * @return Returns the kernel, or NULL if there is no such kernel or the cpu doesn't support it.
+ */
+const bitmap_kernel* bitmap_kernel_named(const char *name)
+{
+    const bitmap_kernel *k;
+
+    for (k = bitmap_kernels; k->name != NULL; ++k)
+        if (!strcmp(k->name, name))
+            return k->supported() ? k : NULL;
+    return NULL;
+}
+
+/**
+ * @brief Pick the kernel named by BAGNALLOC_BITMAP, or else the best one the cpu supports.
+ * Called once while the heap is initialized.
+ */
+void bitmap_init()
+{
+    const char *name = getenv("BAGNALLOC_BITMAP");
+    const bitmap_kernel *k;
+
+    if (name != NULL && (k = bitmap_kernel_named(name)) != NULL)
+    {
+        bitmap_search = k;
+        return;
+    }
+
+    for (k = bitmap_kernels; k->name != NULL; ++k)
+        if (k->supported())
+        {
+            bitmap_search = k;
+            return;
+        }
+}
@@ -0,0 +1,299 @@
+/**
+ * @file buddy.c
+ * @author Alexander Bagnall
+ * @brief Binary buddy engine, an alternative to the first-fit free list in malloc.c.
+ *
+ * Every block is a power of two bytes long (header included) and starts at an offset from the
+ * base of the heap that is a multiple of its size. Splitting a block gives two halves that are
+ * each other's buddy, and the buddy of any block is found by flipping the bit of its size in its
+ * offset, so freeing only has to look at one address per level to coalesce instead of walking
+ * the free list. Free blocks are kept on one list per size (order); a bitmap of the non-empty
+ * lists finds the smallest block to split in a single instruction.
+ *
+ * The price is internal fragmentation: a request is rounded up to the next power of two, so
+ * it suits power-of-two sizes (hash tables, ring buffers) best. Blocks carry the usual header,
+ * whose length is the whole block less the header, so the caches and realloc() work unchanged.
+ *
+ * The heap is grown by the arena (see grow_heap() in malloc.c); each new range is tiled with the
+ * largest aligned blocks that fit and freed into the lists, where it merges with free blocks
+ * before it. Selected with the BAGNALLOC_ENGINE environment variable (see malloc.c).
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "bagnalloc_internal.h"
+
+#define ORDER_SIZE(order) ((size_t)1 << (order))
+
+/*
+ * The header links are relative to the base of the heap (see heap_link), so they are read and
+ * written through these.
+ */
+
+static inline block_meta* next_of(buddy_heap *h, block_meta *block)
+{
+    return link_get(h->base, block->next);
+}
+
+static inline block_meta* prev_of(buddy_heap *h, block_meta *block)
+{
+    return link_get(h->base, block->prev);
+}
+
+static inline void set_next(buddy_heap *h, block_meta *block, block_meta *next)
+{
+    block->next = link_make(h->base, next);
+}
+
+static inline void set_prev(buddy_heap *h, block_meta *block, block_meta *prev)
+{
+    block->prev = link_make(h->base, prev);
+}
+
+/**
+ * @brief Get the next link of the last block on a list; free blocks need a non-NULL next.
+ */
+static inline block_meta* buddy_end(buddy_heap *h)
+{
+    return link_end(h->base);
+}
+
+/**
+ * @brief Get the order of the smallest block holding \p bytes bytes, header included.
+ */
+static inline size_t order_of(size_t bytes)
+{
+    if (bytes <= ORDER_SIZE(BUDDY_MIN_ORDER))
+        return BUDDY_MIN_ORDER;
+    return sizeof(unsigned long) * 8 - __builtin_clzl(bytes - 1);
+}
+
+/**
+ * @brief Get the number of bytes (header included) a request needs from the lists. A data section
+ * aligned more strictly than a block header allows gets a second header in front of it, pointing
+ * back to the real one (see buddy_alloc()).
+ */
+static inline size_t request_bytes(size_t alignment, size_t size)
+{
+    if (alignment <= BUDDY_ALIGNMENT)
+        return size + sizeof(block_meta);
+    return size + alignment + 2 * sizeof(block_meta);
+}
+
+/**
+ * @brief Put a free block on the list of its order.
+ */
+static void list_push(buddy_heap *h, block_meta *block, size_t order)
+{
+    block_meta **head = &h->free_lists[order - BUDDY_MIN_ORDER];
+
+    block->length = ORDER_SIZE(order) - sizeof(block_meta);
+    block->tag = 0;
+    set_prev(h, block, NULL);
+    set_next(h, block, *head != NULL ? *head : buddy_end(h));
+    if (*head != NULL)
+        set_prev(h, *head, block);
+    *head = block;
+
+    h->orders |= ORDER_SIZE(order - BUDDY_MIN_ORDER);
+}
+
+/**
+ * @brief Take a free block off the list of its order.
+ */
+static void list_remove(buddy_heap *h, block_meta *block, size_t order)
+{
+    block_meta *prev = prev_of(h, block);
+    block_meta *next = next_of(h, block) != buddy_end(h) ? next_of(h, block) : NULL;
+
+    if (prev != NULL)
+        prev->next = block->next;
+    else if ((h->free_lists[order - BUDDY_MIN_ORDER] = next) == NULL)
+        h->orders &= ~ORDER_SIZE(order - BUDDY_MIN_ORDER);
+    if (next != NULL)
+        next->prev = block->prev;
+}
+
+/**
+ * @brief Free a block, merging it with its buddy for as long as the buddy is free and whole.
+ * @param h The heap.
+ * @param block The block.
+ * @param order The order of the block.
+ */
+static void release(buddy_heap *h, block_meta *block, size_t order)
+{
+    while (order < BUDDY_MAX_ORDER)
+    {
+        size_t offset = (char*)block - h->base;
+        block_meta *buddy = (block_meta*)(h->base + (offset ^ ORDER_SIZE(order)));
+
+        // a buddy past the end of the heap doesn't exist yet; allocated blocks have no next
+        // link and a free buddy that has been split is shorter
+        if ((char*)buddy + ORDER_SIZE(order) > h->end || !buddy->next ||
+            buddy->length != ORDER_SIZE(order) - sizeof(block_meta))
+            break;
+
+        list_remove(h, buddy, order);
+        if (buddy < block)
+            block = buddy;
+        order++;
+    }
+
+    list_push(h, block, order);
+}
+
+/**
+ * @brief Start an empty buddy heap and give it the range [\p start, \p end).
+ */
+void buddy_init(buddy_heap *h, void *start, void *end)
+{
+    size_t i;
+
+    // blocks are aligned relative to the base, so a line aligned base makes every block fill
+    // whole cache lines
+    h->base = h->end = (char*)(((uintptr_t)start + ORDER_SIZE(BUDDY_MIN_ORDER) - 1) & ~(uintptr_t)(ORDER_SIZE(BUDDY_MIN_ORDER) - 1));
+    h->orders = 0;
+    for (i = 0; i < BUDDY_ORDERS; ++i)
+        h->free_lists[i] = NULL;
+
+    buddy_grow(h, end);
+}
+
+/**
+ * @brief Hand the range from the current end of a heap to \p end over to it.
+ */
+void buddy_grow(buddy_heap *h, void *end)
+{
+    size_t offset = h->end - h->base;
+    size_t new_end = ((char*)end - h->base) & ~(ORDER_SIZE(BUDDY_MIN_ORDER) - 1);
+
+    while (offset < new_end)
+    {
+        // the largest block aligned at offset that fits
+        size_t order = offset ? (size_t)__builtin_ctzl(offset) : BUDDY_MAX_ORDER;
+        if (order > BUDDY_MAX_ORDER)
+            order = BUDDY_MAX_ORDER;
+        while (offset + ORDER_SIZE(order) > new_end)
+            order--;
+
+        // moving the end one block at a time keeps the merging away from the rest of the range
+        h->end = h->base + offset + ORDER_SIZE(order);
+        release(h, (block_meta*)(h->base + offset), order);
+        offset += ORDER_SIZE(order);
+    }
+}
+
+/**
+ * @brief Get the number of bytes a heap must grow by before buddy_alloc() can serve a request.
+ * @param h The heap.
+ * @param alignment The alignment of the request (a power of two).
+ * @param size The number of bytes requested.
+ * @return Returns the number of bytes, or 0 if no block can ever be large enough.
+ */
+size_t buddy_shortfall(buddy_heap *h, size_t alignment, size_t size)
+{
+    size_t order = order_of(request_bytes(alignment, size));
+    if (order > BUDDY_MAX_ORDER)
+        return 0;
+
+    // a new block must start at a multiple of its size; the gap up to it is tiled with smaller ones
+    size_t end = h->end - h->base;
+    size_t start = (end + ORDER_SIZE(order) - 1) & ~(ORDER_SIZE(order) - 1);
+    return start + ORDER_SIZE(order) - end;
+}
+
+/**
+ * @brief Allocate a block, splitting the smallest free block that is large enough.
+ * @param h The heap.
+ * @param alignment The alignment of the data section (a power of two).
+ * @param size The number of bytes requested.
+ * @return Returns a pointer to the data section, or NULL if the heap has to grow first.
+ */
+void* buddy_alloc(buddy_heap *h, size_t alignment, size_t size)
+{
+    size_t order = order_of(request_bytes(alignment, size));
+    if (order > BUDDY_MAX_ORDER)
+        return NULL;
+
+    size_t orders = h->orders >> (order - BUDDY_MIN_ORDER);
+    if (!orders)
+        return NULL;
+    size_t k = order + __builtin_ctzl(orders);
+
+    block_meta *block = h->free_lists[k - BUDDY_MIN_ORDER];
+    list_remove(h, block, k);
+
+    // hand the upper halves back until the block has the right size
+    while (k > order)
+    {
+        --k;
+        list_push(h, (block_meta*)((char*)block + ORDER_SIZE(k)), k);
+    }
+
+    block->length = ORDER_SIZE(order) - sizeof(block_meta);
+    set_prev(h, block, NULL);
+    set_next(h, block, NULL);
+    block->tag = 0;
+
+    char *data = (char*)(block + 1);
+    if (alignment <= BUDDY_ALIGNMENT)
+        return data;
+
+    // put a second header in front of the aligned data, pointing back to the real one
+    char *aligned = (char*)(((uintptr_t)data + sizeof(block_meta) + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    block_meta *inner = (block_meta*)aligned - 1;
+    inner->length = data + block->length - aligned;
+    set_prev(h, inner, block);
+    set_next(h, inner, NULL);
+    inner->tag = 0;
+    return aligned;
+}
+
+/**
+ * @brief Free a block.
+ * @param h The heap.
+ * @param ptr A pointer to the data section of the block.
+ */
+void buddy_free(buddy_heap *h, void *ptr)
+{
+    block_meta *block = (block_meta*)ptr - 1;
+
+    // aligned data sections point back to the header of their block
+    if (block->prev)
+        block = prev_of(h, block);
+
+    release(h, block, order_of(block->length + sizeof(block_meta)));
+}
+
+/**
+ * @brief Get the length of the data section of the block that serves a request.
+ * @param size The number of bytes requested.
+ */
+size_t buddy_block_length(size_t size)
+{
+    size_t order = order_of(size + sizeof(block_meta));
+    return order > BUDDY_MAX_ORDER ? size : ORDER_SIZE(order) - sizeof(block_meta);
+}
+
+/**
+ * @brief Give the pages inside free blocks of at least \p min bytes back to the system, keeping
+ * the pages holding their headers.
+ */
+void buddy_trim(buddy_heap *h, size_t min, size_t page_size)
+{
+    size_t order;
+    block_meta *block;
+
+    for (order = order_of(min); order <= BUDDY_MAX_ORDER; ++order)
+    {
+        for (block = h->free_lists[order - BUDDY_MIN_ORDER]; block != NULL && block != buddy_end(h);
+             block = next_of(h, block))
+        {
+            char *start = (char*)(((uintptr_t)(block + 1) + page_size - 1) / page_size * page_size);
+            char *end = (char*)((uintptr_t)((char*)block + ORDER_SIZE(order)) / page_size * page_size);
+            if (end > start)
+                madvise(start, end - start, MADV_DONTNEED);
+        }
+    }
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// Compares the heap engines on power-of-two and on random sizes:
+//   make buddytime && ./a.out
+//   make buddytime && BAGNALLOC_ENGINE=buddy ./a.out
+// (or segregated, tlsf, best-fit).
+// Every workload runs in a child process of its own so it starts from an empty heap. Each line
+// gives the wall time, the throughput in millions of malloc/free pairs per second and, for the
+// blocks still live at the end, the internal fragmentation (bytes handed out beyond the bytes
+// requested, as a share of the bytes handed out) and the heap size against the bytes requested.
+
+#define OPS 500000 // # of malloc/free pairs
+#define LIVE 4096 // # of live blocks
+#define MIN_SHIFT 6 // power-of-two sizes go from 2^MIN_SHIFT
+#define MAX_SHIFT 14 // to 2^MAX_SHIFT bytes
+#define MAX_SIZE 16384 // random sizes go from 1 to MAX_SIZE bytes
+
+using namespace std;
+
+static size_t power_of_two(unsigned int *seed)
+{
+    return (size_t)1 << (MIN_SHIFT + rand_r(seed) % (MAX_SHIFT - MIN_SHIFT + 1));
+}
+
+// block headers take 32 bytes on 64-bit systems; these sizes make a block and its header fill a
+// power of two exactly
+static size_t power_of_two_net(unsigned int *seed)
+{
+    return power_of_two(seed) - 32;
+}
+
+static size_t random_size(unsigned int *seed)
+{
+    return 1 + rand_r(seed) % MAX_SIZE;
+}
+
+static void run(const char *name, size_t (*size)(unsigned int*))
+{
+    static void *stuff[LIVE];
+    static size_t requested[LIVE];
+    unsigned int seed = 1;
+
+    auto start = chrono::steady_clock::now();
+
+    for (size_t i = 0; i < OPS; ++i)
+    {
+        size_t slot = rand_r(&seed) % LIVE;
+        free(stuff[slot]);
+        requested[slot] = size(&seed);
+        stuff[slot] = malloc(requested[slot]);
+        *(char*)stuff[slot] = 0;
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    size_t live = 0, usable = 0;
+    for (size_t i = 0; i < LIVE; ++i)
+        if (stuff[i] != NULL)
+        {
+            live += requested[i];
+            usable += malloc_usable_size(stuff[i]);
+        }
+
+    struct bagnalloc_stats stats;
+    bagnalloc_get_stats(&stats);
+
+    printf("%s %f %f %f %f\n", name, seconds, OPS / seconds / 1e6,
+        (double)(usable - live) / usable, (double)stats.heap_size / live);
+}
+
+int main()
+{
+    struct bagnalloc_stats stats;
+    free(malloc(1));
+    bagnalloc_get_stats(&stats);
+    printf("engine %s\n", stats.engine);
+    printf("sizes seconds mops internal_fragmentation heap_per_live_byte\n");
+    fflush(stdout);
+
+    struct { const char *name; size_t (*size)(unsigned int*); } workloads[] = {
+        { "power_of_two", power_of_two },
+        { "power_of_two_net", power_of_two_net },
+        { "random", random_size },
+    };
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            run(workloads[w].name, workloads[w].size);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,939 @@
+/**
+ * @file cache.c
+ * @author Alexander Bagnall
+ * @brief Front-end caches that serve small allocations without taking the heap mutex.
+ *
+ * Freed blocks of up to SMALL_MAX bytes are kept in per-size-class caches in front of the heap
+ * and handed out again by the next malloc() of the same class. Blocks move between a cache and
+ * the heap CACHE_BATCH at a time so the mutex is taken once per batch instead of once per call.
+ * Full batches that a cache gives up are first offered to a central transfer cache, where
+ * another cache running dry can pick them up again without going to the heap at all.
+ * Cached blocks still look allocated to the heap, so they are never coalesced.
+ *
+ * The kind of cache is chosen with the BAGNALLOC_CACHE environment variable:
+ *  - "thread" gives every thread its own set of free lists. Blocks remember which thread
+ *    cache they came from; when another thread frees one it is pushed onto a lock-free list
+ *    of its owner, who takes such blocks back in a batch the next time it runs dry. A
+ *    thread's cache is flushed to the transfer cache when the thread exits and handed to the
+ *    next thread that starts, so thread churn doesn't use up caches.
+ *  - "cpu" gives every CPU its own set of slabs, which are only touched inside restartable
+ *    sequences (rseq) so no atomics or locks are needed. Cached memory is then bounded by the
+ *    number of CPUs instead of the number of threads. If the kernel or libc does not provide
+ *    rseq, allocations go straight to the locked heap.
+ * Anything else (including leaving it unset) disables the caches. Either kind also turns on the
+ * central free lists for medium blocks in medium.c.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "bagnalloc.h"
+#include "bagnalloc_internal.h"
+#include "lock.h"
+
+#define CACHE_BATCH 16 // # of blocks moved between a cache and the heap at once
+#define THREAD_BIN_MAX 64 // max # of blocks in a thread cache bin
+#define CPU_BIN_MAX 32 // max # of blocks in a cpu cache slab
+#define TRANSFER_MAX 64 // max # of batches in a transfer cache bin
+
+enum cache_mode { CACHE_NONE, CACHE_THREAD, CACHE_CPU };
+
+static int cache_mode = CACHE_NONE;
+
+/**
+ * @brief Get the free list link stored in the first word of a cached block.
+ */
+static inline void* block_link(void *ptr)
+{
+    return *(void**)ptr;
+}
+
+/**
+ * @brief Set the free list link stored in the first word of a cached block.
+ */
+static inline void set_block_link(void *ptr, void *link)
+{
+    *(void**)ptr = link;
+}
+
+/****************************************************************
+ * Transfer cache
+ ****************************************************************/
+
+/** @struct transfer_bin
+ *  @brief Full batches of blocks of one size class, shared by all threads of a NUMA node (see
+ *  numa.c). Batches are put in the bin of the node their blocks belong to.
+ *  @var transfer_bin::lock
+ *  Protects the rest of the structure. Held just long enough to store or take one pointer.
+ *  @var transfer_bin::count
+ *  Number of batches.
+ *  @var transfer_bin::batches
+ *  The first block of each batch. The CACHE_BATCH blocks of a batch are linked through the
+ *  first word of their data sections.
+ *  @var transfer_bin::hits
+ *  Number of batches handed out.
+ *  @var transfer_bin::misses
+ *  Number of times a batch was wanted but there was none.
+ *  @var transfer_bin::inserts
+ *  Number of batches taken in.
+ *  @var transfer_bin::overflows
+ *  Number of batches that had to go to the heap because the bin was full.
+ */
+typedef struct transfer_bin {
+    malloc_lock lock;
+    size_t count;
+    void *batches[TRANSFER_MAX];
+    size_t hits;
+    size_t misses;
+    size_t inserts;
+    size_t overflows;
+} transfer_bin;
+
+static transfer_bin transfer_bins[NUMA_MAX_NODES][NUM_CLASSES];
+
+/**
+ * @brief Get CACHE_BATCH blocks of a size class, from the transfer cache if it has a batch or
+ * else from the heap.
+ * @param c The size class.
+ * @param ptrs Array receiving the data pointers of the blocks.
+ * @return Returns the number of blocks.
+ */
+static size_t central_alloc(size_t c, void **ptrs)
+{
+    transfer_bin *bin = &transfer_bins[heap_thread_node()][c];
+    void *ptr = NULL;
+    size_t i;
+
+    lock_acquire(&bin->lock);
+    if (bin->count)
+    {
+        ptr = bin->batches[--bin->count];
+        bin->hits++;
+    }
+    else
+        bin->misses++;
+    lock_release(&bin->lock);
+
+    if (ptr == NULL)
+        return heap_alloc_batch(class_size(c), ptrs, CACHE_BATCH);
+
+    for (i = 0; i < CACHE_BATCH; ++i)
+    {
+        ptrs[i] = ptr;
+        ptr = block_link(ptr);
+    }
+    return CACHE_BATCH;
+}
+
+/**
+ * @brief Give up blocks of a size class. A full batch goes to the transfer cache if there is
+ * room; anything else goes back to the heap. While the process has a single thread there is
+ * no other cache to hand batches to, so they go back to the heap where they can coalesce
+ * (cached batches pin scattered blocks and leave the heap's free list fragmented).
+ * @param c The size class.
+ * @param ptrs Array of data pointers of the blocks.
+ * @param n The number of blocks.
+ */
+static void central_free(size_t c, void **ptrs, size_t n)
+{
+    transfer_bin *bin;
+    int stored = 0;
+    size_t i;
+
+    if (n != CACHE_BATCH || !need_lock())
+    {
+        heap_free_batch(ptrs, n);
+        return;
+    }
+    bin = &transfer_bins[heap_block_node(ptrs[0])][c];
+
+    for (i = 0; i + 1 < n; ++i)
+        set_block_link(ptrs[i], ptrs[i + 1]);
+    set_block_link(ptrs[n - 1], NULL);
+
+    lock_acquire(&bin->lock);
+    if (bin->count < TRANSFER_MAX)
+    {
+        bin->batches[bin->count++] = ptrs[0];
+        bin->inserts++;
+        stored = 1;
+    }
+    else
+        bin->overflows++;
+    lock_release(&bin->lock);
+
+    if (!stored)
+        heap_free_batch(ptrs, n);
+}
+
+/****************************************************************
+ * Thread caches
+ ****************************************************************/
+
+/** @struct thread_bin
+ *  @brief A free list of cached blocks of one size class, owned by a single thread.
+ *  @var thread_bin::head
+ *  The first block in the list (linked through the first word of each data section).
+ *  @var thread_bin::count
+ *  Number of blocks in the list.
+ */
+typedef struct thread_bin {
+    void *head;
+    size_t count;
+} thread_bin;
+
+/** @struct thread_cache
+ *  @brief The cache of a single thread.
+ *  @var thread_cache::bins
+ *  One free list per size class.
+ *  @var thread_cache::polls
+ *  Number of allocations left before the remote list is looked at again.
+ *  @var thread_cache::remote_head
+ *  Lock-free list of blocks owned by this cache that other threads have freed, REMOTE_DEAD once
+ *  the owner has exited. Any thread may push to it but only the owner takes blocks off.
+ *  @var thread_cache::remote_count
+ *  Approximate number of blocks in the remote list.
+ *  @var thread_cache::in_use
+ *  1 while a thread owns the cache, 0 while it is in the pool.
+ *  @var thread_cache::next_free
+ *  Next cache in the pool of caches left behind by exited threads.
+ */
+typedef struct thread_cache {
+    thread_bin bins[NUM_CLASSES];
+    unsigned int polls;
+    int in_use;
+    struct thread_cache *next_free;
+    void *remote_head __attribute__((aligned(64)));
+    size_t remote_count;
+} thread_cache;
+
+#define MAX_THREAD_CACHES 16384 // max # of thread caches in use at once
+#define REMOTE_POLL_INTERVAL 64 // # of allocations between looks at the remote list
+#define REMOTE_DRAIN_THRESHOLD 64 // # of remote blocks that makes the owner take them back early
+#define REMOTE_DEAD ((void*)1) // remote_head of a cache whose owner has exited
+#define TCACHE_DISABLED ((thread_cache*)1) // tcache of a thread that can't have a cache
+
+static thread_cache *thread_caches; // reserved array of MAX_THREAD_CACHES caches
+static unsigned int num_thread_caches; // # of caches handed out so far
+static thread_cache *free_thread_caches; // pool of caches of exited threads, ready for reuse
+static malloc_lock thread_caches_lock = MALLOC_LOCK_INITIALIZER; // protects the two above
+static pthread_key_t thread_cache_key; // runs thread_cache_exit() when a thread exits
+static __thread thread_cache *tcache; // the calling thread's cache, NULL until first use
+
+/**
+ * @brief Get the tag that marks blocks owned by a thread cache.
+ */
+static inline unsigned int thread_cache_tag(thread_cache *tc)
+{
+    return tc - thread_caches + 1;
+}
+
+/**
+ * @brief Give the calling thread a cache, reusing one left by an exited thread if possible.
+ * @return Returns the new cache, or TCACHE_DISABLED if there are none left.
+ */
+static thread_cache* thread_cache_create()
+{
+    thread_cache *tc = NULL;
+
+    lock_acquire(&thread_caches_lock);
+    if (free_thread_caches != NULL)
+    {
+        tc = free_thread_caches;
+        free_thread_caches = tc->next_free;
+    }
+    else if (num_thread_caches < MAX_THREAD_CACHES)
+        tc = &thread_caches[num_thread_caches++];
+    lock_release(&thread_caches_lock);
+
+    if (tc == NULL)
+        return tcache = TCACHE_DISABLED;
+
+    // blocks still tagged with a reused cache are now simply taken in by its new owner
+    tc->polls = REMOTE_POLL_INTERVAL;
+    tc->in_use = 1;
+    __atomic_store_n(&tc->remote_count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&tc->remote_head, NULL, __ATOMIC_RELEASE);
+    pthread_setspecific(thread_cache_key, tc);
+    return tcache = tc;
+}
+
+/**
+ * @brief Push a block owned by another thread onto that thread's remote list.
+ * @param owner The cache owning the block.
+ * @param ptr A pointer to the data section of the block.
+ * @return Returns 1 on success, 0 if the owner has exited.
+ */
+static int remote_free(thread_cache *owner, void *ptr)
+{
+    void *head = __atomic_load_n(&owner->remote_head, __ATOMIC_RELAXED);
+    do
+    {
+        if (head == REMOTE_DEAD)
+            return 0;
+        set_block_link(ptr, head);
+    } while (!__atomic_compare_exchange_n(&owner->remote_head, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&owner->remote_count, 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/**
+ * @brief Move the blocks other threads have freed back into their owner's bins.
+ * @param tc The calling thread's cache.
+ * @return Returns the number of blocks taken off the remote list.
+ */
+static size_t remote_drain(thread_cache *tc)
+{
+    void *ptr = __atomic_exchange_n(&tc->remote_head, NULL, __ATOMIC_ACQUIRE);
+    void *overflow[CACHE_BATCH];
+    size_t n = 0, num_overflow = 0;
+
+    while (ptr != NULL)
+    {
+        void *next = block_link(ptr);
+        thread_bin *bin = &tc->bins[size_class(((block_meta*)ptr - 1)->length)];
+
+        // bins that are already full overflow to the heap
+        if (bin->count >= THREAD_BIN_MAX)
+        {
+            overflow[num_overflow++] = ptr;
+            if (num_overflow == CACHE_BATCH)
+            {
+                heap_free_batch(overflow, num_overflow);
+                num_overflow = 0;
+            }
+        }
+        else
+        {
+            set_block_link(ptr, bin->head);
+            bin->head = ptr;
+            bin->count++;
+        }
+
+        ptr = next;
+        n++;
+    }
+
+    if (num_overflow)
+        heap_free_batch(overflow, num_overflow);
+    if (n)
+        __atomic_fetch_sub(&tc->remote_count, n, __ATOMIC_RELAXED);
+
+    return n;
+}
+
+/**
+ * @brief Flush a cache whose thread is gone and put it in the pool for the next thread to reuse.
+ * @param tc The cache.
+ */
+static void thread_cache_release(thread_cache *tc)
+{
+    void *batch[CACHE_BATCH];
+    size_t c, n;
+
+    // close the remote list so other threads stop pushing to it, and sort what is on it into the bins
+    void *ptr = __atomic_exchange_n(&tc->remote_head, REMOTE_DEAD, __ATOMIC_ACQUIRE);
+    while (ptr != NULL)
+    {
+        void *next = block_link(ptr);
+        thread_bin *bin = &tc->bins[size_class(((block_meta*)ptr - 1)->length)];
+        set_block_link(ptr, bin->head);
+        bin->head = ptr;
+        bin->count++;
+        ptr = next;
+    }
+
+    // full batches can still be of use to other threads
+    for (c = 0; c < NUM_CLASSES; ++c)
+    {
+        thread_bin *bin = &tc->bins[c];
+        n = 0;
+        while (bin->head != NULL)
+        {
+            batch[n++] = bin->head;
+            bin->head = block_link(bin->head);
+            if (n == CACHE_BATCH)
+            {
+                central_free(c, batch, n);
+                n = 0;
+            }
+        }
+        if (n)
+            central_free(c, batch, n);
+        bin->count = 0;
+    }
+
+    lock_acquire(&thread_caches_lock);
+    tc->in_use = 0;
+    tc->next_free = free_thread_caches;
+    free_thread_caches = tc;
+    lock_release(&thread_caches_lock);
+}
+
+/**
+ * @brief Release the cache of an exiting thread (pthread key destructor).
+ * @param arg The exiting thread's cache.
+ */
+static void thread_cache_exit(void *arg)
+{
+    // anything freed by the thread from now on goes straight to the heap
+    tcache = TCACHE_DISABLED;
+
+    thread_cache_release(arg);
+}
+
+/**
+ * @brief Allocate a block from the calling thread's cache, refilling it if empty.
+ * @param c The size class.
+ * @return Returns a pointer to the data section of the block, or NULL to use the locked heap.
+ */
+static void* thread_cache_alloc(size_t c)
+{
+    thread_cache *tc = tcache;
+    if (tc == NULL)
+        tc = thread_cache_create();
+    if (tc == TCACHE_DISABLED)
+        return NULL;
+
+    // don't let blocks pile up on the remote list of a thread that never runs dry
+    if (--tc->polls == 0)
+    {
+        tc->polls = REMOTE_POLL_INTERVAL;
+        if (__atomic_load_n(&tc->remote_count, __ATOMIC_RELAXED) >= REMOTE_DRAIN_THRESHOLD)
+            remote_drain(tc);
+    }
+
+    thread_bin *bin = &tc->bins[c];
+    void *ptr = bin->head;
+
+    // empty, first take back the blocks other threads have freed
+    if (ptr == NULL && remote_drain(tc))
+        ptr = bin->head;
+
+    if (ptr != NULL)
+    {
+        bin->head = block_link(ptr);
+        bin->count--;
+        return ptr;
+    }
+
+    // still empty, grab a batch from the transfer cache or the heap and keep all but one
+    void *batch[CACHE_BATCH];
+    unsigned int tag = thread_cache_tag(tc);
+    size_t i, n = central_alloc(c, batch);
+    if (n == 0)
+        return NULL;
+    for (i = 0; i < n; ++i)
+        ((block_meta*)batch[i] - 1)->tag = tag;
+    for (i = 1; i < n; ++i)
+    {
+        set_block_link(batch[i], bin->head);
+        bin->head = batch[i];
+    }
+    bin->count += n - 1;
+
+    return batch[0];
+}
+
+/**
+ * @brief Return a block to the cache that owns it, flushing a batch to the heap if full.
+ * @param ptr A pointer to the data section of the block.
+ * @param c The size class.
+ * @return Returns 1 if the block was cached or freed, 0 to use the locked heap.
+ */
+static int thread_cache_free(void *ptr, size_t c)
+{
+    block_meta *block = (block_meta*)ptr - 1;
+    thread_cache *tc = tcache;
+    if (tc == NULL)
+        tc = thread_cache_create();
+
+    // blocks owned by another thread go back to it without taking any lock
+    if (block->tag && (tc == TCACHE_DISABLED || block->tag != thread_cache_tag(tc)))
+    {
+        if (remote_free(&thread_caches[block->tag - 1], ptr))
+            return 1;
+    }
+
+    if (tc == TCACHE_DISABLED)
+        return 0;
+
+    // unowned or orphaned blocks are adopted
+    block->tag = thread_cache_tag(tc);
+
+    thread_bin *bin = &tc->bins[c];
+
+    if (bin->count >= THREAD_BIN_MAX)
+    {
+        void *batch[CACHE_BATCH];
+        size_t i;
+        for (i = 0; i < CACHE_BATCH; ++i)
+        {
+            batch[i] = bin->head;
+            bin->head = block_link(bin->head);
+        }
+        bin->count -= CACHE_BATCH;
+        central_free(c, batch, CACHE_BATCH);
+    }
+
+    set_block_link(ptr, bin->head);
+    bin->head = ptr;
+    bin->count++;
+
+    return 1;
+}
+
+/****************************************************************
+ * CPU caches
+ ****************************************************************/
+
+/** @struct cpu_bin
+ *  @brief A stack of cached blocks of one size class, owned by a single CPU.
+ *  @var cpu_bin::cur
+ *  Number of blocks on the stack. Storing to it is the commit point of every operation.
+ *  @var cpu_bin::slots
+ *  The blocks. Only the first cur entries are meaningful.
+ */
+typedef struct cpu_bin {
+    uintptr_t cur;
+    void *slots[CPU_BIN_MAX];
+} cpu_bin;
+
+static cpu_bin *cpu_bins; // NUM_CLASSES bins for each possible cpu
+static unsigned int num_cpus;
+
+#if defined(__x86_64__)
+
+/** @struct rseq_abi
+ *  @brief The leading fields of the per-thread area registered with the kernel by rseq(2).
+ *  @var rseq_abi::cpu_id_start
+ *  Always holds a valid cpu number.
+ *  @var rseq_abi::cpu_id
+ *  The cpu the thread is running on, or a negative value if rseq is not registered.
+ *  @var rseq_abi::rseq_cs
+ *  Address of the descriptor of the critical section the thread is in (if any).
+ */
+struct rseq_abi {
+    uint32_t cpu_id_start;
+    uint32_t cpu_id;
+    uint64_t rseq_cs;
+};
+
+// glibc >= 2.35 registers an rseq area for every thread and tells us where it is
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+#define RSEQ_RESULT_OK 0
+#define RSEQ_RESULT_FAIL 1 // the slab was empty or full
+#define RSEQ_RESULT_ABORT 2 // preempted, migrated or signalled; try again
+
+/*
+ * Both critical sections below follow the usual rseq layout: a descriptor in the __rseq_cs
+ * section (label 3) giving the start (1), length (up to 2) and abort handler (4) of the
+ * sequence, and an abort handler in __rseq_failure preceded by the signature glibc registered.
+ * The store to cur is the last instruction of each sequence and commits it.
+ */
+#define RSEQ_CS_DESCRIPTOR \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseq_cs]\n\t"
+
+#define RSEQ_CS_ABORT \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[abort]\n\t" \
+    ".popsection\n\t"
+
+/**
+ * @brief Get the calling thread's rseq area.
+ */
+static inline struct rseq_abi* rseq_area()
+{
+    return (struct rseq_abi*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/**
+ * @brief Pop a block off a cpu slab inside a restartable sequence.
+ * @param rs The calling thread's rseq area.
+ * @param cpu The cpu that owns \p bin.
+ * @param bin The slab.
+ * @param out Location receiving the block.
+ * @return Returns RSEQ_RESULT_OK, RSEQ_RESULT_FAIL if the slab is empty, or RSEQ_RESULT_ABORT.
+ */
+static inline int rseq_pop(struct rseq_abi *rs, uint32_t cpu, cpu_bin *bin, void **out)
+{
+    __asm__ __volatile__ goto (
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movq %[cur], %%rcx\n\t"
+        "testq %%rcx, %%rcx\n\t"
+        "jz %l[fail]\n\t"
+        "movq -8(%[slots], %%rcx, 8), %%rdx\n\t"
+        "movq %%rdx, (%[out])\n\t"
+        "decq %%rcx\n\t"
+        "movq %%rcx, %[cur]\n\t"
+        "2:\n\t"
+        RSEQ_CS_ABORT
+        :
+        : [cpu_id] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs), [cpu] "r" (cpu),
+          [cur] "m" (bin->cur), [slots] "r" (bin->slots), [out] "r" (out)
+        : "memory", "cc", "rax", "rcx", "rdx"
+        : fail, abort);
+    return RSEQ_RESULT_OK;
+fail:
+    return RSEQ_RESULT_FAIL;
+abort:
+    return RSEQ_RESULT_ABORT;
+}
+
+/**
+ * @brief Push a block onto a cpu slab inside a restartable sequence.
+ * @param rs The calling thread's rseq area.
+ * @param cpu The cpu that owns \p bin.
+ * @param bin The slab.
+ * @param ptr The block.
+ * @return Returns RSEQ_RESULT_OK, RSEQ_RESULT_FAIL if the slab is full, or RSEQ_RESULT_ABORT.
+ */
+static inline int rseq_push(struct rseq_abi *rs, uint32_t cpu, cpu_bin *bin, void *ptr)
+{
+    __asm__ __volatile__ goto (
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz 4f\n\t"
+        "movq %[cur], %%rcx\n\t"
+        "cmpq %[max], %%rcx\n\t"
+        "jae %l[fail]\n\t"
+        "movq %[ptr], (%[slots], %%rcx, 8)\n\t"
+        "incq %%rcx\n\t"
+        "movq %%rcx, %[cur]\n\t"
+        "2:\n\t"
+        RSEQ_CS_ABORT
+        :
+        : [cpu_id] "m" (rs->cpu_id), [rseq_cs] "m" (rs->rseq_cs), [cpu] "r" (cpu),
+          [cur] "m" (bin->cur), [slots] "r" (bin->slots), [ptr] "r" (ptr),
+          [max] "i" (CPU_BIN_MAX)
+        : "memory", "cc", "rax", "rcx"
+        : fail, abort);
+    return RSEQ_RESULT_OK;
+fail:
+    return RSEQ_RESULT_FAIL;
+abort:
+    return RSEQ_RESULT_ABORT;
+}
+
+/**
+ * @brief Get the slab of size class \p c belonging to the cpu the calling thread runs on.
+ * @param rs The calling thread's rseq area.
+ * @param cpu Location receiving the cpu number.
+ * @return Returns the slab, or NULL if rseq is not registered for the calling thread.
+ */
+static inline cpu_bin* current_cpu_bin(struct rseq_abi *rs, uint32_t *cpu, size_t c)
+{
+    *cpu = *(volatile uint32_t*)&rs->cpu_id;
+    if (*cpu >= num_cpus)
+        return NULL;
+    return &cpu_bins[*cpu * NUM_CLASSES + c];
+}
+
+/**
+ * @brief Allocate a block from the current cpu's cache, refilling it from the heap if empty.
+ * @param c The size class.
+ * @return Returns a pointer to the data section of the block, or NULL to use the locked heap.
+ */
+static void* cpu_cache_alloc(size_t c)
+{
+    struct rseq_abi *rs = rseq_area();
+    uint32_t cpu;
+    cpu_bin *bin;
+    void *ptr;
+    int result;
+
+    do
+    {
+        if ((bin = current_cpu_bin(rs, &cpu, c)) == NULL)
+            return NULL;
+        result = rseq_pop(rs, cpu, bin, &ptr);
+    } while (result == RSEQ_RESULT_ABORT);
+
+    if (result == RSEQ_RESULT_OK)
+        return ptr;
+
+    // empty, grab a batch from the transfer cache or the heap and keep all but one
+    void *batch[CACHE_BATCH];
+    size_t i, n = central_alloc(c, batch);
+    if (n == 0)
+        return NULL;
+    for (i = 1; i < n; ++i)
+    {
+        do
+        {
+            if ((bin = current_cpu_bin(rs, &cpu, c)) == NULL)
+                break;
+            result = rseq_push(rs, cpu, bin, batch[i]);
+        } while (result == RSEQ_RESULT_ABORT);
+
+        // somebody else on this cpu filled the slab in the meantime
+        if (bin == NULL || result == RSEQ_RESULT_FAIL)
+        {
+            central_free(c, batch + i, n - i);
+            break;
+        }
+    }
+
+    return batch[0];
+}
+
+/**
+ * @brief Put a block into the current cpu's cache, flushing a batch to the heap if full.
+ * @param ptr A pointer to the data section of the block.
+ * @param c The size class.
+ * @return Returns 1 if the block was cached or freed, 0 to use the locked heap.
+ */
+static int cpu_cache_free(void *ptr, size_t c)
+{
+    struct rseq_abi *rs = rseq_area();
+    uint32_t cpu;
+    cpu_bin *bin;
+    int result;
+
+    do
+    {
+        if ((bin = current_cpu_bin(rs, &cpu, c)) == NULL)
+            return 0;
+        result = rseq_push(rs, cpu, bin, ptr);
+    } while (result == RSEQ_RESULT_ABORT);
+
+    if (result == RSEQ_RESULT_OK)
+        return 1;
+
+    // full, free this block along with a batch taken off the slab
+    void *batch[CACHE_BATCH];
+    size_t n = 0;
+    batch[n++] = ptr;
+    while (n < CACHE_BATCH)
+    {
+        do
+        {
+            if ((bin = current_cpu_bin(rs, &cpu, c)) == NULL)
+                break;
+            result = rseq_pop(rs, cpu, bin, &batch[n]);
+        } while (result == RSEQ_RESULT_ABORT);
+
+        if (bin == NULL || result == RSEQ_RESULT_FAIL)
+            break;
+        n++;
+    }
+    central_free(c, batch, n);
+
+    return 1;
+}
+
+/**
+ * @brief Check whether rseq is registered for the calling thread.
+ */
+static int rseq_available()
+{
+    if (&__rseq_size == NULL || __rseq_size == 0)
+        return 0;
+    return (int32_t)rseq_area()->cpu_id >= 0;
+}
+
+#else
+
+static void* cpu_cache_alloc(size_t c) { return NULL; }
+static int cpu_cache_free(void *ptr, size_t c) { return 0; }
+static int rseq_available() { return 0; }
+
+#endif
+
+/**
+ * @brief Get the number of possible cpus without allocating (sysconf() may call malloc).
+ * @return Returns one more than the highest cpu number listed in /sys/devices/system/cpu/possible.
+ */
+static unsigned int possible_cpus()
+{
+    char buf[256];
+    int fd = open("/sys/devices/system/cpu/possible", O_RDONLY);
+    if (fd < 0)
+        return CPU_SETSIZE;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return CPU_SETSIZE;
+    buf[n] = '\0';
+
+    // the list looks like "0-7" or "0,2-5"; the last number is the highest cpu
+    char *p = buf + n;
+    while (p > buf && (p[-1] < '0' || p[-1] > '9'))
+        --p;
+    while (p > buf && p[-1] >= '0' && p[-1] <= '9')
+        --p;
+    return strtoul(p, NULL, 10) + 1;
+}
+
+/**
+ * @brief Select the kind of cache from the environment. Called once while the heap is initialized.
+ */
+void cache_init()
+{
+    const char *mode = getenv("BAGNALLOC_CACHE");
+
+    if (mode == NULL)
+        return;
+
+    // medium blocks don't fit the caches; they get the central free lists in medium.c instead
+    if (!strcmp(mode, "thread") || !strcmp(mode, "cpu"))
+        medium_init();
+
+    if (!strcmp(mode, "thread"))
+    {
+        void *caches = mmap(NULL, MAX_THREAD_CACHES * sizeof(thread_cache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (caches == MAP_FAILED || pthread_key_create(&thread_cache_key, thread_cache_exit))
+            return;
+        thread_caches = caches;
+        cache_mode = CACHE_THREAD;
+    }
+    else if (!strcmp(mode, "cpu") && rseq_available())
+    {
+        num_cpus = possible_cpus();
+        void *bins = mmap(NULL, num_cpus * NUM_CLASSES * sizeof(cpu_bin), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (bins == MAP_FAILED)
+            return;
+        cpu_bins = bins;
+        cache_mode = CACHE_CPU;
+    }
+}
+
+/**
+ * @brief Allocate a small block from the front-end cache.
+ * @param size The number of bytes to allocate (a nonzero multiple of 8 no larger than SMALL_MAX).
+ * @return Returns a pointer to the allocated memory, or NULL if the caller should use the heap.
+ */
+void* cache_alloc(size_t size)
+{
+    switch (cache_mode)
+    {
+    case CACHE_THREAD:
+        return thread_cache_alloc(size_class(size));
+    case CACHE_CPU:
+        return cpu_cache_alloc(size_class(size));
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief Return a small block to the front-end cache.
+ * @param ptr A pointer to the data section of the block.
+ * @param length The length of the data section (no larger than SMALL_MAX).
+ * @return Returns 1 if the cache took care of the block, 0 if the caller should free it to the heap.
+ */
+int cache_free(void *ptr, size_t length)
+{
+    switch (cache_mode)
+    {
+    case CACHE_THREAD:
+        return thread_cache_free(ptr, size_class(length));
+    case CACHE_CPU:
+        return cpu_cache_free(ptr, size_class(length));
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Take every lock of the caches before fork() (see fork_prepare() in malloc.c).
+ */
+void cache_fork_prepare()
+{
+    size_t n, c;
+
+    lock_acquire(&thread_caches_lock);
+    for (n = 0; n < NUMA_MAX_NODES; ++n)
+        for (c = 0; c < NUM_CLASSES; ++c)
+            lock_acquire(&transfer_bins[n][c].lock);
+}
+
+/**
+ * @brief Release the locks taken by cache_fork_prepare() in the parent after fork().
+ */
+void cache_fork_parent()
+{
+    size_t n, c;
+
+    for (n = NUMA_MAX_NODES; n-- > 0;)
+        for (c = NUM_CLASSES; c-- > 0;)
+            lock_release(&transfer_bins[n][c].lock);
+    lock_release(&thread_caches_lock);
+}
+
+/**
+ * @brief Reset the caches in the child after fork(). Only the thread that called fork() lives on
+ * in the child, so the caches of all other threads are flushed and put in the pool: their blocks
+ * stay in the warm heap instead of being stranded.
+ */
+void cache_fork_child()
+{
+    malloc_lock unlocked = MALLOC_LOCK_INITIALIZER;
+    size_t i, c;
+
+    thread_caches_lock = unlocked;
+    for (i = 0; i < NUMA_MAX_NODES; ++i)
+        for (c = 0; c < NUM_CLASSES; ++c)
+            transfer_bins[i][c].lock = unlocked;
+
+    if (cache_mode != CACHE_THREAD)
+        return;
+
+    for (i = 0; i < num_thread_caches; ++i)
+    {
+        thread_cache *tc = &thread_caches[i];
+        if (tc->in_use && tc != tcache)
+            thread_cache_release(tc);
+    }
+}
+
+/**
+ * @brief Fill in the cache part of the allocator statistics.
+ * @param stats The structure to fill in.
+ */
+void cache_stats(struct bagnalloc_stats *stats)
+{
+    size_t n, c;
+
+    stats->transfer_hits = stats->transfer_misses = 0;
+    stats->transfer_inserts = stats->transfer_overflows = 0;
+    stats->transfer_cached_bytes = 0;
+
+    for (n = 0; n < NUMA_MAX_NODES; ++n)
+        for (c = 0; c < NUM_CLASSES; ++c)
+        {
+            transfer_bin *bin = &transfer_bins[n][c];
+
+            lock_acquire(&bin->lock);
+            stats->transfer_hits += bin->hits;
+            stats->transfer_misses += bin->misses;
+            stats->transfer_inserts += bin->inserts;
+            stats->transfer_overflows += bin->overflows;
+            stats->transfer_cached_bytes += bin->count * CACHE_BATCH * class_size(c);
+            lock_release(&bin->lock);
+        }
+}
@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <omp.h>
+
+// Compares the front-end caches at increasing thread counts. Run it once per cache kind:
+//   BAGNALLOC_CACHE=thread ./a.out
+//   BAGNALLOC_CACHE=cpu ./a.out
+// Each line gives the thread count, the wall time and how much the heap grew during the run.
+
+#define ROUNDS 2000
+#define K 64 // # of live blocks per thread
+#define MAX_SIZE 256
+
+int main()
+{
+    const char *mode = getenv("BAGNALLOC_CACHE");
+    printf("cache: %s\n", mode ? mode : "none");
+    printf("threads seconds heap_growth_kB\n");
+
+    int thread_counts[] = { 1, 8, 32, 128, 256 };
+
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+    {
+        char *heap_before = (char*)sbrk(0);
+        double start = omp_get_wtime();
+
+        #pragma omp parallel num_threads(thread_counts[t])
+        {
+            unsigned int seed = omp_get_thread_num();
+            void *stuff[K];
+
+            for (size_t r = 0; r < ROUNDS; ++r)
+            {
+                for (size_t i = 0; i < K; ++i)
+                    stuff[i] = malloc(rand_r(&seed) % MAX_SIZE + 1);
+
+                for (size_t i = 0; i < K; ++i)
+                    free(stuff[i]);
+            }
+        }
+
+        double end = omp_get_wtime();
+        printf("%d %f %ld\n", thread_counts[t], end - start, (long)((char*)sbrk(0) - heap_before) / 1024);
+    }
+
+    return 0;
+}
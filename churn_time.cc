@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// Thread churn, like a thread-per-connection server: every round starts THREADS short lived
+// threads that allocate a mix of small, medium and large blocks, free most of them and hand the
+// rest to the main thread, which frees them after the threads have exited. Run it with and
+// without a front-end cache, e.g.
+//   make churntime && BAGNALLOC_CACHE=thread ./a.out
+// The resident set size should level off instead of growing with the number of threads created.
+
+#define ROUNDS 2000
+#define THREADS 8 // # of threads per round
+#define OPS 2000 // # of allocations per thread
+#define KEPT 64 // # of blocks per thread freed by the main thread
+#define REPORT 200 // # of rounds between reports
+
+using namespace std;
+
+static void *kept[THREADS][KEPT];
+
+static size_t block_size(unsigned int *seed)
+{
+    unsigned int r = rand_r(seed) % 100;
+    if (r < 80)
+        return 8 + rand_r(seed) % 248; // small
+    if (r < 98)
+        return 256 + rand_r(seed) % 3840; // medium
+    return 4096 + rand_r(seed) % 60000; // large
+}
+
+static void connection(unsigned int id, unsigned int seed)
+{
+    void *live[32] = { 0 };
+
+    for (size_t i = 0; i < OPS; ++i)
+    {
+        size_t slot = i % 32;
+        size_t n = block_size(&seed);
+        free(live[slot]);
+        live[slot] = malloc(n);
+        memset(live[slot], 0, n < 256 ? n : 256);
+    }
+    for (size_t i = 0; i < 32; ++i)
+        free(live[i]);
+
+    for (size_t i = 0; i < KEPT; ++i)
+        kept[id][i] = malloc(block_size(&seed));
+}
+
+static long rss_kb()
+{
+    long pages = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL)
+        return 0;
+    if (fscanf(file, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main()
+{
+    auto start = chrono::steady_clock::now();
+
+    printf("threads_created seconds rss_kb heap_kb\n");
+
+    for (unsigned int r = 0; r < ROUNDS; ++r)
+    {
+        vector<thread> threads;
+        for (unsigned int t = 0; t < THREADS; ++t)
+            threads.push_back(thread(connection, t, r * THREADS + t));
+        for (unsigned int t = 0; t < THREADS; ++t)
+            threads[t].join();
+
+        for (unsigned int t = 0; t < THREADS; ++t)
+            for (size_t i = 0; i < KEPT; ++i)
+                free(kept[t][i]);
+
+        if ((r + 1) % REPORT == 0)
+        {
+            struct bagnalloc_stats stats;
+            bagnalloc_get_stats(&stats);
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            printf("%u %f %ld %zu\n", (r + 1) * THREADS, seconds, rss_kb(), stats.heap_size / 1024);
+        }
+    }
+
+    bagnalloc_print_stats(stdout);
+
+    return 0;
+}
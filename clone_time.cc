@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// Cloning large blocks with bagnalloc_clone() against malloc() and memcpy(), for blocks of 1 MB
+// to 1 GB. For each size, a block is filled and cloned CLONES times both ways, a few bytes of
+// each clone are changed, and the time per clone and the memory the clones added once every
+// page was read (the proportional set size, which counts pages mapped twice once) are printed.
+// The first clone of a block is timed apart from the others: it moves the block into a memfd
+// unless run with
+//   make clonetime && BAGNALLOC_CLONE=1 ./a.out
+// Each clone is checked to hold the block's data, to keep its changes to itself, and to see the
+// changes the block made before it was cloned. A block is also changed by a child process after
+// fork(), which the parent must not see. The program exits with status 1 on the first error.
+
+#define MIN_SIZE ((size_t)1 << 20)
+#define MAX_SIZE ((size_t)1 << 30)
+#define CLONES 4
+#define WRITES 8 // # of bytes changed in each clone, on pages of their own
+
+using namespace std;
+
+// the proportional set size of the process, in bytes
+static long pss()
+{
+    char line[256];
+    long kb = -1;
+
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "Pss: %ld kB", &kb) == 1)
+            break;
+    fclose(f);
+    return kb * 1024;
+}
+
+static double since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static char byte_at(size_t i)
+{
+    return (char)(i / 4096 * 7 + 1);
+}
+
+static void fill(char *block, size_t size)
+{
+    for (size_t i = 0; i < size; i += 4096)
+        memset(block + i, byte_at(i), 4096);
+}
+
+// a byte of every page must hold the block's data, but the bytes the clone changed
+static int check(const char *clone, size_t size, int changed)
+{
+    for (size_t i = 1; i < size; i += 4096)
+        if (clone[i] != byte_at(i))
+            return 0;
+    for (size_t w = 0; w < WRITES; ++w)
+        if ((clone[w * (size / WRITES)] == (char)0xff) != changed)
+            return 0;
+    return 1;
+}
+
+static void change(char *clone, size_t size)
+{
+    for (size_t w = 0; w < WRITES; ++w)
+        clone[w * (size / WRITES)] = (char)0xff;
+}
+
+int main()
+{
+    struct bagnalloc_stats stats;
+    char *clones[CLONES];
+
+    printf("%10s %14s %14s %14s %14s %14s\n", "size", "memcpy (ms)", "first (ms)", "clone (ms)",
+           "memcpy (kB)", "clone (kB)");
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4)
+    {
+        char *block = (char*)malloc(size);
+        if (block == NULL)
+            return 1;
+        fill(block, size);
+
+        long before = pss();
+        auto start = chrono::steady_clock::now();
+        for (size_t c = 0; c < CLONES; ++c)
+        {
+            clones[c] = (char*)malloc(size);
+            memcpy(clones[c], block, size);
+            change(clones[c], size);
+        }
+        double copy_time = since(start) / CLONES;
+        long copy_memory = pss() - before;
+        for (size_t c = 0; c < CLONES; ++c)
+            free(clones[c]);
+
+        before = pss();
+        start = chrono::steady_clock::now();
+        clones[0] = (char*)bagnalloc_clone(block);
+        double first_time = since(start);
+        start = chrono::steady_clock::now();
+        for (size_t c = 1; c < CLONES; ++c)
+            clones[c] = (char*)bagnalloc_clone(block);
+        double clone_time = since(start) / (CLONES - 1);
+        for (size_t c = 0; c < CLONES; ++c)
+            change(clones[c], size);
+
+        if (!check(block, size, 0))
+        {
+            printf("FAILED: block of %zu bytes changed by its clones\n", size);
+            return 1;
+        }
+        for (size_t c = 0; c < CLONES; ++c)
+            if (!check(clones[c], size, 1))
+            {
+                printf("FAILED: clone of %zu bytes doesn't hold the block's data\n", size);
+                return 1;
+            }
+        // measured once every page has been read, so that the pages of the memfd are counted
+        long clone_memory = pss() - before;
+
+        // a clone taken after the block changed sees the change
+        change(block, size);
+        char *late = (char*)bagnalloc_clone(block);
+        if (!check(late, size, 1))
+        {
+            printf("FAILED: clone of %zu bytes doesn't see the block's changes\n", size);
+            return 1;
+        }
+        free(late);
+
+        printf("%10zu %14.3f %14.3f %14.3f %14ld %14ld\n", size, copy_time, first_time, clone_time,
+               copy_memory / 1024, clone_memory / 1024);
+        for (size_t c = 0; c < CLONES; ++c)
+            free(clones[c]);
+        free(block);
+    }
+
+    // blocks still shared with their memfd must be private to each process after fork()
+    char *block = (char*)malloc(MIN_SIZE);
+    fill(block, MIN_SIZE);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        change(block, MIN_SIZE);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!check(block, MIN_SIZE, 0))
+    {
+        printf("FAILED: block changed by a child process\n");
+        return 1;
+    }
+    free(block);
+
+    bagnalloc_get_stats(&stats);
+    printf("%zu clones by mapping, %zu bytes copied by clones\n", stats.clones, stats.clone_copied_bytes);
+    if (stats.clones == 0)
+    {
+        printf("FAILED: no block was cloned by mapping it (large blocks of the page heap are copied)\n");
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+#ifndef COUNTERS_H
+#define COUNTERS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Hardware counters read with perf_event_open() by the *_time.cc programs, counting the calling
+// thread in user space. A counter that can't be opened (as in most virtual machines) keeps a
+// descriptor of -1 and is printed as "-".
+
+struct counter {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+    int fd;
+};
+
+// the config of a read miss counter of a cache (PERF_TYPE_HW_CACHE)
+#define CACHE_READ_MISSES(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static inline void open_counters(counter *counters, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+}
+
+static inline void start_counters(counter *counters, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (counters[i].fd >= 0)
+        {
+            ioctl(counters[i].fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+static inline void stop_counters(counter *counters, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        if (counters[i].fd >= 0)
+            ioctl(counters[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+}
+
+static inline void print_counter_names(const counter *counters, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        printf(" %s", counters[i].name);
+}
+
+// prints the value of every counter divided by per
+static inline void print_counters(const counter *counters, size_t n, double per)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        uint64_t value;
+        if (counters[i].fd >= 0 && read(counters[i].fd, &value, sizeof(value)) == sizeof(value))
+            printf(" %f", value / per);
+        else
+            printf(" -");
+    }
+}
+
+#endif
@@ -1,5 +1,7 @@
 #include <vector>
+#include <list>
 #include <stdio.h>
+#include <time.h>
 
 #define N 1000000
 
@@ -11,6 +13,9 @@ int main()
     vector<char> v2;
     vector<unsigned long long> v3;
     vector<bool> v4;
+    list<int> l5;
+    
+    clock_t start = clock();
     
     printf("v1...\n");
     for (int i = 0; i < N; ++i)
@@ -31,6 +36,14 @@ int main()
     for (int i = 0; i < N; ++i)
         v4.push_back(!(i % 2));
     v4.clear();
+    
+    // one allocation per element, unlike the vectors
+    printf("\nl5...\n");
+    for (int i = 0; i < N; ++i)
+        l5.push_back(i);
+    l5.clear();
+    
+    printf("\n%f seconds\n", (float)(clock() - start) / CLOCKS_PER_SEC);
         
     //for (int i = 0; i < 1000000; ++i)
     //    cout << v[i] << " ";
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+// False sharing between small blocks of different threads: every thread allocates a few
+// counters (all threads at once, so their blocks end up next to each other) and then keeps
+// incrementing them. Compare the default layout against blocks padded to whole cache lines:
+//   make falsesharingtime && ./a.out
+//   make falsesharingtime && BAGNALLOC_ISOLATE=1 ./a.out
+// Try it with BAGNALLOC_CACHE=thread too. Each line gives the thread count, the wall time, the
+// throughput in millions of increments per second over all threads and the number of cache
+// lines holding counters of more than one thread.
+
+#define COUNTERS 4 // # of counters per thread
+#define INCREMENTS 20000000 // # of increments per thread
+#define LINE 64
+
+using namespace std;
+
+static atomic<int> ready;
+static vector<uintptr_t> addresses;
+
+static void work(int id, int n)
+{
+    volatile long *counters[COUNTERS];
+
+    // line the threads up so their allocations interleave
+    ready++;
+    while (ready < n)
+        ;
+
+    for (int i = 0; i < COUNTERS; ++i)
+    {
+        counters[i] = (volatile long*)malloc(sizeof(long));
+        *counters[i] = 0;
+        addresses[id * COUNTERS + i] = (uintptr_t)counters[i];
+    }
+
+    for (long i = 0; i < INCREMENTS; ++i)
+        (*counters[i % COUNTERS])++;
+
+    for (int i = 0; i < COUNTERS; ++i)
+        free((void*)counters[i]);
+}
+
+// # of lines holding counters of more than one thread
+static int shared_lines(int n)
+{
+    int shared = 0;
+    for (int i = 0; i < n * COUNTERS; ++i)
+    {
+        uintptr_t line = addresses[i] / LINE;
+        int first = 1, others = 0;
+        for (int j = 0; j < n * COUNTERS; ++j)
+            if (addresses[j] / LINE == line)
+            {
+                first &= j >= i;
+                others |= j / COUNTERS != i / COUNTERS;
+            }
+        shared += first && others;
+    }
+    return shared;
+}
+
+int main()
+{
+    printf("threads seconds mops shared_lines\n");
+
+    int thread_counts[] = { 1, 2, 4, 8, 16 };
+
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+    {
+        int n = thread_counts[t];
+        ready = 0;
+        addresses.assign(n * COUNTERS, 0);
+        auto start = chrono::steady_clock::now();
+
+        vector<thread> threads;
+        for (int i = 0; i < n; ++i)
+            threads.push_back(thread(work, i, n));
+        for (int i = 0; i < n; ++i)
+            threads[i].join();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        printf("%d %f %f %d\n", n, seconds, (double)INCREMENTS * n / seconds / 1e6, shared_lines(n));
+    }
+
+    return 0;
+}
@@ -0,0 +1,453 @@
+/**
+ * @file fits.c
+ * @author Alexander Bagnall
+ * @brief Segregated fit and TLSF engines, alternatives to the first-fit free list in malloc.c.
+ *
+ * Both engines keep free blocks on many lists indexed by size instead of on a single list in
+ * address order, and find the lists that aren't empty through a bitmap, so neither has to walk
+ * past blocks that are too small:
+ *  - "segregated" has one list per size class up to FIT_SMALL bytes (any block on it fits) and
+ *    one list per power of two above. The list of the request's own power of two is searched
+ *    first fit, then the smallest block of the next non-empty list is taken.
+ *  - "tlsf" (two-level segregated fit) splits every power of two further into FIT_SL lists.
+ *    The request is rounded up to the next list boundary so that any block of the first
+ *    non-empty list at or above it fits: every allocation and free takes a bounded number of steps.
+ *
+ * Without an address ordered list, coalescing needs to find the physical neighbours of a block.
+ * The next one follows the block; the previous one is stored in the block, in the prev field of
+ * the header while the block is allocated (free() never looks at it) and in the first word of
+ * the data section while it is free (the header links are used for the list then). Free blocks
+ * are always merged with free neighbours, so the neighbours of a free block are allocated.
+ * Selected with the BAGNALLOC_ENGINE environment variable (see malloc.c).
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "bagnalloc_internal.h"
+
+#define LONG_BITS (sizeof(unsigned long) * 8)
+
+/**
+ * @brief Get the log2 of \p n rounded down.
+ */
+static inline size_t log2_floor(size_t n)
+{
+    return LONG_BITS - 1 - __builtin_clzl(n);
+}
+
+/**
+ * @brief Get the list holding free blocks of a given length.
+ */
+static inline size_t list_of(fit_heap *h, size_t length)
+{
+    if (length < FIT_SMALL)
+        return length / 8;
+
+    size_t fl = log2_floor(length);
+    if (fl > FIT_MAX_SHIFT)
+        return FIT_LISTS - 1;
+    if (h->kind == FIT_SEGREGATED)
+        return FIT_SMALL / 8 + fl - FIT_SMALL_SHIFT;
+    return FIT_SMALL / 8 + (fl - FIT_SMALL_SHIFT) * FIT_SL + ((length >> (fl - FIT_SL_SHIFT)) & (FIT_SL - 1));
+}
+
+/*
+ * The header links are relative to the base of the heap (see heap_link), so they are read and
+ * written through these. The link to the previous block kept in the data section of a free block
+ * is a plain pointer.
+ */
+
+static inline block_meta* next_of(fit_heap *h, block_meta *block)
+{
+    return link_get(h->base, block->next);
+}
+
+static inline block_meta* prev_of(fit_heap *h, block_meta *block)
+{
+    return link_get(h->base, block->prev);
+}
+
+static inline void set_next(fit_heap *h, block_meta *block, block_meta *next)
+{
+    block->next = link_make(h->base, next);
+}
+
+static inline void set_prev(fit_heap *h, block_meta *block, block_meta *prev)
+{
+    block->prev = link_make(h->base, prev);
+}
+
+/**
+ * @brief Get the next link of the last block on a list; free blocks need a non-NULL next.
+ */
+static inline block_meta* fit_end(fit_heap *h)
+{
+    return link_end(h->base);
+}
+
+/**
+ * @brief Get the address of the previous block stored in a block (NULL for the first block).
+ */
+static inline block_meta* prev_phys(fit_heap *h, block_meta *block)
+{
+    return block->next ? *(block_meta**)(block + 1) : prev_of(h, block);
+}
+
+/**
+ * @brief Store the address of the previous block in a block.
+ */
+static inline void set_prev_phys(fit_heap *h, block_meta *block, block_meta *prev)
+{
+    if (block->next)
+        *(block_meta**)(block + 1) = prev;
+    else
+        set_prev(h, block, prev);
+}
+
+/**
+ * @brief Get the block following a block, or NULL if it is the last one.
+ */
+static inline block_meta* next_phys(fit_heap *h, block_meta *block)
+{
+    char *next = (char*)(block + 1) + block->length;
+    return next < h->end ? (block_meta*)next : NULL;
+}
+
+/**
+ * @brief Put a free block on its list.
+ */
+static void list_insert(fit_heap *h, block_meta *block)
+{
+    size_t i = list_of(h, block->length);
+
+    set_prev(h, block, NULL);
+    set_next(h, block, h->lists[i] != NULL ? h->lists[i] : fit_end(h));
+    block->tag = 0;
+    if (h->lists[i] != NULL)
+        set_prev(h, h->lists[i], block);
+    h->lists[i] = block;
+
+    h->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+/**
+ * @brief Take a free block off its list.
+ */
+static void list_remove(fit_heap *h, block_meta *block)
+{
+    size_t i = list_of(h, block->length);
+    block_meta *prev = prev_of(h, block);
+    block_meta *next = next_of(h, block) != fit_end(h) ? next_of(h, block) : NULL;
+
+    if (prev != NULL)
+        prev->next = block->next;
+    else if ((h->lists[i] = next) == NULL)
+        h->bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+    if (next != NULL)
+        next->prev = block->prev;
+}
+
+/**
+ * @brief Find the first non-empty list at or after list \p i.
+ * @return Returns the index of the list, or FIT_LISTS if there is none.
+ */
+static inline size_t first_list(fit_heap *h, size_t i)
+{
+    // bits past the last list are never set
+    i = bitmap_find_set(h->bitmap, FIT_WORDS, i);
+    return i < FIT_LISTS ? i : FIT_LISTS;
+}
+
+/**
+ * @brief Find a free block of at least \p size bytes and take it off its list.
+ * @return Returns the block, or NULL if there is none.
+ */
+static block_meta* find_fit(fit_heap *h, size_t size)
+{
+    size_t i;
+
+    if (size < FIT_SMALL)
+        i = size / 8;
+    else if (h->kind == FIT_SEGREGATED)
+    {
+        // the blocks on the list of the request's power of two may be too small
+        i = list_of(h, size);
+        block_meta *block;
+        for (block = h->lists[i]; block != NULL && block != fit_end(h); block = next_of(h, block))
+            if (block->length >= size)
+            {
+                list_remove(h, block);
+                return block;
+            }
+        ++i;
+    }
+    else
+    {
+        // round up to the next list so that every block on the list found fits
+        size_t fl = log2_floor(size);
+        i = list_of(h, size + ((size_t)1 << (fl - FIT_SL_SHIFT)) - 1);
+    }
+
+    i = first_list(h, i);
+    if (i == FIT_LISTS)
+        return NULL;
+
+    block_meta *block = h->lists[i];
+    list_remove(h, block);
+    return block;
+}
+
+/**
+ * @brief Start a heap with one free block covering [\p start, \p end).
+ * @param h The heap.
+ * @param kind FIT_SEGREGATED or FIT_TLSF.
+ */
+void fits_init(fit_heap *h, int kind, void *start, void *end)
+{
+    memset(h->lists, 0, sizeof(h->lists));
+    memset(h->bitmap, 0, sizeof(h->bitmap));
+    h->kind = kind;
+    h->base = start;
+    h->end = end;
+
+    block_meta *block = start;
+    block->length = (char*)end - (char*)start - sizeof(block_meta);
+    list_insert(h, block);
+    set_prev_phys(h, block, NULL);
+    h->top = block;
+}
+
+/**
+ * @brief Hand the range from the current end of a heap to \p end over to it.
+ */
+void fits_grow(fit_heap *h, void *end)
+{
+    block_meta *top = h->top;
+    size_t added = (char*)end - h->end;
+
+    if (top->next)
+    {
+        // the last block is free, make it longer
+        list_remove(h, top);
+        top->length += added;
+        list_insert(h, top);
+    }
+    else
+    {
+        block_meta *block = (block_meta*)h->end;
+        block->length = added - sizeof(block_meta);
+        list_insert(h, block);
+        set_prev_phys(h, block, top);
+        h->top = block;
+    }
+
+    h->end = end;
+}
+
+/**
+ * @brief Get the number of bytes a heap must grow by before fits_alloc() can serve a request.
+ * @param h The heap.
+ * @param size The number of bytes requested.
+ * @return Returns the number of bytes, or 0 if no block can ever be large enough.
+ */
+size_t fits_shortfall(fit_heap *h, size_t size)
+{
+    if (size > FIT_MAX_SIZE)
+        return 0;
+
+    // TLSF only finds a block on a list past the request's own
+    if (h->kind == FIT_TLSF && size >= FIT_SMALL)
+        size += (size_t)1 << (log2_floor(size) - FIT_SL_SHIFT);
+
+    // enough for a block of its own past the last block
+    return size + 2 * sizeof(block_meta) + 8;
+}
+
+/**
+ * @brief Allocate a block, splitting the free block found if the rest can make a block of its own.
+ * @param h The heap.
+ * @param size The number of bytes to allocate (a nonzero multiple of 8).
+ * @return Returns a pointer to the data section, or NULL if the heap has to grow first.
+ */
+void* fits_alloc(fit_heap *h, size_t size)
+{
+    if (size > FIT_MAX_SIZE)
+        return NULL;
+
+    block_meta *block = find_fit(h, size);
+    if (block == NULL)
+        return NULL;
+
+    block_meta *prev = prev_phys(h, block);
+
+    if (block->length - size >= sizeof(block_meta) + 8)
+    {
+        block_meta *rest = (block_meta*)((char*)(block + 1) + size);
+        rest->length = block->length - size - sizeof(block_meta);
+        list_insert(h, rest);
+        set_prev_phys(h, rest, block);
+
+        block_meta *next = next_phys(h, rest);
+        if (next != NULL)
+            set_prev(h, next, rest);
+        if (h->top == block)
+            h->top = rest;
+
+        block->length = size;
+    }
+
+    set_prev(h, block, prev);
+    set_next(h, block, NULL);
+    block->tag = 0;
+    return block + 1;
+}
+
+/**
+ * @brief Free a block, merging it with its free neighbours.
+ * @param h The heap.
+ * @param ptr A pointer to the data section of the block.
+ */
+void fits_free(fit_heap *h, void *ptr)
+{
+    block_meta *block = (block_meta*)ptr - 1;
+    block_meta *prev = prev_of(h, block);
+    block_meta *next = next_phys(h, block);
+
+    if (next != NULL && next->next)
+    {
+        list_remove(h, next);
+        block->length += next->length + sizeof(block_meta);
+        if (h->top == next)
+            h->top = block;
+    }
+
+    if (prev != NULL && prev->next)
+    {
+        // the previous block keeps its own link to the block before it
+        list_remove(h, prev);
+        prev->length += block->length + sizeof(block_meta);
+        if (h->top == block)
+            h->top = prev;
+        block = prev;
+        list_insert(h, block);
+    }
+    else
+    {
+        list_insert(h, block);
+        set_prev_phys(h, block, prev);
+    }
+
+    next = next_phys(h, block);
+    if (next != NULL)
+        set_prev(h, next, block);
+}
+
+/**
+ * @brief Rebuild the lists of a heap from its blocks, for a heap left in an unknown state by a
+ * process that died while changing it (see persist.c). The blocks are walked from the base of
+ * the heap: free runs are merged, a header that can't be right (torn by the crash) turns the
+ * rest of the heap into a free block, and the lists, the links to previous blocks and the top
+ * block are set again. A block that was being freed may stay allocated, so it leaks, but every
+ * block that was allocated before the crash still is.
+ * @param h The heap; its base, end and kind must be intact.
+ * @return Returns the number of free blocks.
+ */
+size_t fits_rebuild(fit_heap *h)
+{
+    block_meta *block, *prev = NULL;
+    size_t free_blocks = 0;
+
+    memset(h->lists, 0, sizeof(h->lists));
+    memset(h->bitmap, 0, sizeof(h->bitmap));
+
+    // merge the free runs, so that the neighbours of a free block are allocated
+    for (block = (block_meta*)h->base; block != NULL; block = next_phys(h, block))
+    {
+        char *data = (char*)(block + 1);
+
+        if (data + 8 > h->end)
+        {
+            // too short for a block of its own, the previous one takes it
+            prev->length += h->end - (char*)block;
+            break;
+        }
+        if (block->length % 8 || block->length > (size_t)(h->end - data))
+        {
+            block->length = h->end - data;
+            set_next(h, block, fit_end(h));
+        }
+
+        if (block->next && prev != NULL && prev->next)
+        {
+            prev->length += block->length + sizeof(block_meta);
+            block = prev;
+        }
+        else
+            prev = block;
+    }
+
+    // then link them up again
+    prev = NULL;
+    for (block = (block_meta*)h->base; block != NULL; block = next_phys(h, block))
+    {
+        if (block->next)
+        {
+            list_insert(h, block);
+            free_blocks++;
+        }
+        set_prev_phys(h, block, prev);
+        prev = block;
+    }
+    h->top = prev;
+
+    return free_blocks;
+}
+
+/**
+ * @brief Cut an allocated block in two, keeping \p size bytes in the first one.
+ * @return Returns the second block (allocated), or NULL if the rest is too small to make one.
+ */
+block_meta* fits_split(fit_heap *h, block_meta *block, size_t size)
+{
+    if (block->length - size < sizeof(block_meta) + 8)
+        return NULL;
+
+    block_meta *tail = (block_meta*)((char*)(block + 1) + size);
+    tail->length = block->length - size - sizeof(block_meta);
+    set_prev(h, tail, block);
+    set_next(h, tail, NULL);
+    tail->tag = 0;
+    block->length = size;
+
+    block_meta *next = next_phys(h, tail);
+    if (next != NULL)
+        set_prev_phys(h, next, tail);
+    if (h->top == block)
+        h->top = tail;
+
+    return tail;
+}
+
+/**
+ * @brief Give the pages inside free blocks of at least \p min bytes back to the system, keeping
+ * the pages holding their headers and their link to the previous block.
+ */
+void fits_trim(fit_heap *h, size_t min, size_t page_size)
+{
+    size_t i;
+    block_meta *block;
+
+    for (i = list_of(h, min); i < FIT_LISTS; ++i)
+        for (block = h->lists[i]; block != NULL && block != fit_end(h); block = next_of(h, block))
+        {
+            if (block->length < min)
+                continue;
+
+            char *start = (char*)(((uintptr_t)(block + 1) + sizeof(block_meta*) + page_size - 1) / page_size * page_size);
+            char *end = (char*)((uintptr_t)((char*)(block + 1) + block->length) / page_size * page_size);
+            if (end > start)
+                madvise(start, end - start, MADV_DONTNEED);
+        }
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// A preforking server: worker threads keep allocating while the main thread forks children.
+// Each child must be able to allocate right away (a child that deadlocks on a lock held by a
+// thread that doesn't exist in it is killed by an alarm) and should reuse the warm heap instead
+// of growing it. Try it with each kind of cache, e.g.
+//   make fork && BAGNALLOC_CACHE=thread ./a.out
+// The program exits with status 1 if any child fails.
+
+#define WORKERS 8
+#define FORKS 200
+#define CHILD_OPS 10000 // # of malloc/free pairs in each child
+#define CHILD_TIMEOUT 10 // # of seconds before a child is considered deadlocked
+
+using namespace std;
+
+static atomic<bool> stop(false);
+
+static void work(unsigned int seed)
+{
+    void *stuff[64] = { 0 };
+
+    for (size_t i = 0; !stop; ++i)
+    {
+        size_t slot = rand_r(&seed) % 64;
+        free(stuff[slot]);
+        stuff[slot] = malloc(1 + rand_r(&seed) % 8192);
+    }
+
+    for (size_t i = 0; i < 64; ++i)
+        free(stuff[i]);
+}
+
+static int child()
+{
+    alarm(CHILD_TIMEOUT);
+
+    struct bagnalloc_stats before, after;
+    bagnalloc_get_stats(&before);
+
+    unsigned int seed = getpid();
+    void *stuff[64] = { 0 };
+    for (size_t i = 0; i < CHILD_OPS; ++i)
+    {
+        size_t slot = rand_r(&seed) % 64;
+        free(stuff[slot]);
+        size_t n = 1 + rand_r(&seed) % 8192;
+        stuff[slot] = malloc(n);
+        memset(stuff[slot], 0, n < 16 ? n : 16);
+    }
+
+    // threads can still be created in the child
+    thread t(work, seed);
+    stop = true;
+    t.join();
+
+    bagnalloc_get_stats(&after);
+    return after.heap_size > before.heap_size ? 2 : 0;
+}
+
+int main()
+{
+    vector<thread> workers;
+    for (unsigned int i = 0; i < WORKERS; ++i)
+        workers.push_back(thread(work, i));
+
+    int failed = 0, grew = 0;
+    auto start = chrono::steady_clock::now();
+
+    for (int f = 0; f < FORKS; ++f)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+            _exit(child());
+
+        int status;
+        waitpid(pid, &status, 0);
+        if (WIFSIGNALED(status))
+        {
+            printf("child %d killed by signal %d\n", f, WTERMSIG(status));
+            failed++;
+        }
+        else if (WEXITSTATUS(status) == 2)
+            grew++;
+        else if (WEXITSTATUS(status) != 0)
+            failed++;
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    stop = true;
+    for (unsigned int i = 0; i < WORKERS; ++i)
+        workers[i].join();
+
+    printf("%d forks in %f seconds, %d failed, %d children had to grow the heap\n", FORKS, seconds, failed, grew);
+    return failed ? 1 : 0;
+}
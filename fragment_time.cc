@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// A long running process in miniature: many small long lived objects are replaced now and then
+// while short lived buffers come and go, so the free list fills with small fragments. Compare
+// how far the free list engines have to walk for it:
+//   make fragmenttime && ./a.out
+//   make fragmenttime && BAGNALLOC_ENGINE=next-fit ./a.out
+// (or best-fit). Each line covers one period of the run and gives the time, the throughput in
+// millions of malloc/free pairs per second, the median, 90th and 99th percentile of the number
+// of free blocks a search passed over (the upper end of the histogram bucket it falls in, see
+// bagnalloc_arena_stats::walks), the mean, and the heap size against the bytes live at the end
+// of the period.
+
+#define PERIODS 10
+#define OPS 200000 // # of malloc/free pairs per period
+#define OBJECTS 20000 // # of long lived small objects
+#define BUFFERS 64 // # of short lived buffers live at once
+#define REPLACE 8 // one op in REPLACE replaces a long lived object
+
+using namespace std;
+
+static void *objects[OBJECTS];
+static size_t object_sizes[OBJECTS];
+static void *buffers[BUFFERS];
+static size_t buffer_sizes[BUFFERS];
+
+// upper end of the walk lengths counted in a bucket
+static size_t bucket_high(size_t b)
+{
+    return b ? ((size_t)1 << b) - 1 : 0;
+}
+
+static size_t percentile(const size_t *walks, size_t total, double p)
+{
+    size_t seen = 0;
+    for (size_t b = 0; b < BAGNALLOC_WALK_BUCKETS; ++b)
+    {
+        seen += walks[b];
+        if (seen >= p * total)
+            return bucket_high(b);
+    }
+    return bucket_high(BAGNALLOC_WALK_BUCKETS - 1);
+}
+
+int main()
+{
+    unsigned int seed = 1;
+    struct bagnalloc_stats stats;
+    struct bagnalloc_arena_stats arena_stats;
+    size_t last[BAGNALLOC_WALK_BUCKETS] = { 0 };
+
+    for (size_t i = 0; i < OBJECTS; ++i)
+    {
+        object_sizes[i] = 16 + rand_r(&seed) % 113;
+        objects[i] = malloc(object_sizes[i]);
+    }
+
+    bagnalloc_get_stats(&stats);
+    printf("engine %s\n", stats.engine);
+    printf("period seconds mops walk_p50 walk_p90 walk_p99 walk_mean heap_per_live_byte\n");
+    fflush(stdout);
+
+    for (size_t period = 0; period < PERIODS; ++period)
+    {
+        auto start = chrono::steady_clock::now();
+
+        for (size_t i = 0; i < OPS; ++i)
+        {
+            size_t slot = i % BUFFERS;
+            free(buffers[slot]);
+            buffer_sizes[slot] = 256 + rand_r(&seed) % 8192;
+            buffers[slot] = malloc(buffer_sizes[slot]);
+            *(char*)buffers[slot] = 0;
+
+            if (rand_r(&seed) % REPLACE == 0)
+            {
+                slot = rand_r(&seed) % OBJECTS;
+                free(objects[slot]);
+                object_sizes[slot] = 16 + rand_r(&seed) % 113;
+                objects[slot] = malloc(object_sizes[slot]);
+            }
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        bagnalloc_get_stats(&stats);
+        bagnalloc_get_arena_stats(0, &arena_stats);
+
+        // the walks of this period
+        size_t walks[BAGNALLOC_WALK_BUCKETS], total = 0;
+        double sum = 0;
+        for (size_t b = 0; b < BAGNALLOC_WALK_BUCKETS; ++b)
+        {
+            walks[b] = arena_stats.walks[b] - last[b];
+            last[b] = arena_stats.walks[b];
+            total += walks[b];
+            // take the middle of each bucket for the mean
+            sum += walks[b] * (b ? 1.5 * ((size_t)1 << (b - 1)) : 0);
+        }
+
+        size_t live = 0;
+        for (size_t i = 0; i < OBJECTS; ++i)
+            live += object_sizes[i];
+        for (size_t i = 0; i < BUFFERS; ++i)
+            live += buffer_sizes[i];
+
+        printf("%zu %f %f %zu %zu %zu %.1f %f\n", period, seconds, OPS / seconds / 1e6,
+            percentile(walks, total, 0.5), percentile(walks, total, 0.9), percentile(walks, total, 0.99),
+            total ? sum / total : 0.0, (double)stats.heap_size / live);
+        fflush(stdout);
+    }
+
+    return 0;
+}
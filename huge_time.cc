@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "bagnalloc.h"
+#include "counters.h"
+
+// What the huge page filler does for the TLB: keeps OBJECTS spans of MIN_SIZE to MAX_SIZE bytes
+// live in the page heap, replaces random ones REPLACE times over so that the heap gets
+// fragmented, then times random reads across all of them. Compare the page heap without and with
+// the filler:
+//   make hugetime && BAGNALLOC_PAGEHEAP=1 BAGNALLOC_MMAP_THRESHOLD=16384 ./a.out
+//   make hugetime && BAGNALLOC_PAGEHEAP=1 BAGNALLOC_MMAP_THRESHOLD=16384 BAGNALLOC_HUGEPAGE=1 ./a.out
+// The output gives the bytes live, the resident set size, the share of the unreleased spans
+// backed by transparent huge pages, how densely the filler uses its huge pages, the wall time per
+// read and, per read, the cycles and data TLB read misses counted with perf_event_open() in user
+// space ("-" where the counter isn't available, as in most virtual machines).
+
+#define OBJECTS 2048
+#define MIN_SIZE (16 * 1024)
+#define MAX_SIZE (256 * 1024)
+#define REPLACE 4 // # of times every object is replaced, on average
+#define READS 20000000
+
+using namespace std;
+
+static counter counters[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1 },
+    { "dtlb_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_DTLB), -1 },
+};
+
+#define NUM_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static char *objects[OBJECTS];
+static size_t sizes[OBJECTS];
+
+static size_t resident_bytes()
+{
+    size_t pages = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file != NULL)
+    {
+        if (fscanf(file, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(file);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void replace(size_t i, unsigned int *seed)
+{
+    free(objects[i]);
+    sizes[i] = MIN_SIZE + rand_r(seed) % (MAX_SIZE - MIN_SIZE);
+    objects[i] = (char*)malloc(sizes[i]);
+    memset(objects[i], (int)i, sizes[i]);
+}
+
+int main()
+{
+    unsigned int seed = 1;
+    size_t i, live = 0;
+
+    for (i = 0; i < OBJECTS; ++i)
+        replace(i, &seed);
+    for (i = 0; i < REPLACE * OBJECTS; ++i)
+        replace(rand_r(&seed) % OBJECTS, &seed);
+    for (i = 0; i < OBJECTS; ++i)
+        live += sizes[i];
+
+    open_counters(counters, NUM_COUNTERS);
+    start_counters(counters, NUM_COUNTERS);
+    auto start = chrono::steady_clock::now();
+
+    // xorshift, cheaper than rand_r() next to the reads
+    uint64_t x = 88172645463325252ull, sum = 0;
+    for (i = 0; i < READS; ++i)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        size_t object = x % OBJECTS;
+        sum += objects[object][(x >> 32) % sizes[object]];
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stop_counters(counters, NUM_COUNTERS);
+
+    struct bagnalloc_stats stats;
+    bagnalloc_get_stats(&stats);
+    size_t unreleased = stats.page_heap_size - stats.page_released_bytes;
+    const char *hugepage = getenv("BAGNALLOC_HUGEPAGE");
+
+    printf("filler %s (checksum %llu)\n", hugepage != NULL ? hugepage : "0", (unsigned long long)(sum & 0xff));
+    printf("live_mb rss_mb huge_backed%% filler_density%% ns");
+    print_counter_names(counters, NUM_COUNTERS);
+    printf("\n");
+    printf("%.1f %.1f %.1f %.1f %f", live / 1048576.0, resident_bytes() / 1048576.0,
+           unreleased ? 100.0 * stats.page_huge_backed_bytes / unreleased : 0.0,
+           stats.page_filled_huge_pages ? 100.0 * stats.page_filled_bytes / (stats.page_filled_huge_pages * 2097152.0) : 0.0,
+           seconds / READS * 1e9);
+    print_counters(counters, NUM_COUNTERS, READS);
+    printf("\n");
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "bagnalloc.h"
+
+// Requests at the limits of what the allocator accepts: alignments of 0, sizes that would wrap
+// around once rounded up or padded, and sizes no system can provide must fail cleanly (or, for
+// alignments of 0, be served 8-byte aligned) instead of crashing or handing out a block that is
+// too small. memalign() must round alignments that aren't powers of two up, as glibc's does, and
+// bagnalloc_reserve() must return -1 for what it can't reserve:
+//   make limitstest && ./a.out
+// The program exits with status 1 on the first error.
+
+#define LARGE ((size_t)1 << 20) // above the default mmap threshold
+#define HUGE ((size_t)1 << 50) // more than any machine can map
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// sizes come from here so the compiler neither warns about nor folds the impossible requests
+static volatile size_t huge = HUGE, near_max = SIZE_MAX - 3, large = LARGE;
+
+static int usable(void *ptr, size_t alignment, size_t size)
+{
+    if (ptr == NULL || (uintptr_t)ptr % alignment || malloc_usable_size(ptr) < size)
+        return 0;
+    memset(ptr, 1, size);
+    free(ptr);
+    return 1;
+}
+
+int main()
+{
+    void *ptr = (void*)1;
+
+    check(posix_memalign(&ptr, 64, huge) == ENOMEM && ptr == (void*)1, "posix_memalign of a huge size");
+    check(posix_memalign(&ptr, 0, 16) == EINVAL, "posix_memalign with alignment 0");
+    check(posix_memalign(&ptr, SIZE_MAX / 2 + 1, 16) == ENOMEM, "posix_memalign with a huge alignment");
+    check(usable(memalign(0, 100), 8, 100), "memalign(0, small)");
+    check(usable(memalign(0, large), 8, large), "memalign(0, large)");
+    check(usable(aligned_alloc(0, large), 8, large), "aligned_alloc(0, large)");
+    check(usable(memalign(24, 100), 32, 100), "memalign with an alignment that isn't a power of two");
+    check(usable(memalign(3 << 12, large), 4 << 12, large), "memalign(12 KB, large)");
+    check(aligned_alloc(24, 100) == NULL, "aligned_alloc with an alignment that isn't a power of two");
+
+    check(malloc(near_max) == NULL, "malloc of a size that wraps when rounded up");
+    check(calloc(SIZE_MAX / 2, huge) == NULL, "calloc of an overflowing product");
+    // volatile: a failed realloc() leaves the block alone, which the compiler can't know
+    char * volatile block = (char*)malloc(100);
+    strcpy(block, "kept");
+    check(realloc(block, huge) == NULL && !strcmp(block, "kept"), "realloc of a huge size");
+    check(realloc(block, near_max) == NULL && !strcmp(block, "kept"), "realloc of a size that wraps");
+    free(block);
+
+    // the main thread reserves in the main arena, whose program break can't move that far
+    check(bagnalloc_reserve(0, 0) == 0, "bagnalloc_reserve of 0 bytes");
+    check(bagnalloc_reserve(huge, 0) == -1, "bagnalloc_reserve of a huge size");
+    check(bagnalloc_reserve(SIZE_MAX - 0xff, 0) == -1, "bagnalloc_reserve of a size near SIZE_MAX");
+    check(bagnalloc_reserve(near_max, 0) == -1, "bagnalloc_reserve of a size that wraps when rounded up");
+    check(bagnalloc_reserve(large, BAGNALLOC_RESERVE_POPULATE) == 0, "bagnalloc_reserve after failing");
+    check(usable(malloc(100), 8, 100), "malloc after failed reserves");
+
+    if (failures)
+        return 1;
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,187 @@
+/**
+ * @file lock.h
+ * @author Alexander Bagnall
+ * @brief The lock protecting the heap.
+ *
+ * Critical sections in the heap are short, so parking a thread in the kernel as soon as the lock
+ * is taken (as pthread_mutex_lock() does) costs far more than the wait itself. By default the lock
+ * is a futex word that is spun on with exponential backoff for a bounded time before the thread
+ * sleeps. Build with -DUSE_PTHREAD_MUTEX to use a plain pthread mutex instead.
+ *
+ * Either way, locks are not touched at all until the process has a second thread (as told by
+ * glibc's __libc_single_threaded). glibc clears that flag in pthread_create() before the new
+ * thread exists, while the only thread is outside of any critical section, so a critical section
+ * that skipped the lock can't overlap with another thread. Once a second thread has been seen
+ * locking stays on for good, so every lock_release() matches its lock_acquire() even if the
+ * process later goes back to one thread. Build with -DNO_SINGLE_THREAD_ELISION to always lock.
+ */
+
+#ifndef LOCK_H
+#define LOCK_H
+
+#if !defined(NO_SINGLE_THREAD_ELISION) && defined(__has_include)
+#if __has_include(<sys/single_threaded.h>)
+#include <sys/single_threaded.h>
+#define SINGLE_THREAD_ELISION
+#endif
+#endif
+
+#ifdef SINGLE_THREAD_ELISION
+
+extern int locking_enabled; // set once the process has been seen with more than one thread, defined in malloc.c
+
+/**
+ * @brief Check whether locks must be taken, i.e.\ whether there may be more than one thread.
+ */
+static inline int need_lock()
+{
+    if (__builtin_expect(locking_enabled, 1))
+        return 1;
+    if (__libc_single_threaded)
+        return 0;
+    locking_enabled = 1;
+    return 1;
+}
+
+/**
+ * @brief Check whether lock_release() has to do anything.
+ */
+static inline int lock_taken()
+{
+    return locking_enabled;
+}
+
+/**
+ * @brief Go back to skipping locks in the child of fork(), which has a single thread. Only to be
+ * called while no lock is held; one call covers the locks of every file.
+ */
+static inline void lock_fork_child()
+{
+    locking_enabled = 0;
+}
+
+#else
+
+static inline int need_lock() { return 1; }
+static inline int lock_taken() { return 1; }
+static inline void lock_fork_child() { }
+
+#endif
+
+#ifdef USE_PTHREAD_MUTEX
+
+#include <pthread.h>
+
+typedef pthread_mutex_t malloc_lock;
+
+#define MALLOC_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+static inline void lock_acquire(malloc_lock *lock)
+{
+    if (need_lock())
+        pthread_mutex_lock(lock);
+}
+
+static inline int lock_try(malloc_lock *lock)
+{
+    return !need_lock() || !pthread_mutex_trylock(lock);
+}
+
+static inline void lock_release(malloc_lock *lock)
+{
+    if (lock_taken())
+        pthread_mutex_unlock(lock);
+}
+
+#else
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LOCK_SPIN_ROUNDS 7 // # of backoff rounds before sleeping; round i spins 2^i times
+
+/** @struct malloc_lock
+ *  @brief A futex based lock. Aligned to a cache line so nothing else bounces along with it.
+ *  @var malloc_lock::state
+ *  0 if unlocked, 1 if locked, 2 if locked and there may be threads sleeping on it.
+ */
+typedef struct malloc_lock {
+    int state;
+} __attribute__((aligned(64))) malloc_lock;
+
+#define MALLOC_LOCK_INITIALIZER { 0 }
+
+/**
+ * @brief Tell the cpu we are in a spin loop.
+ */
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__ ("yield");
+#endif
+}
+
+/**
+ * @brief Try to take \p lock without waiting.
+ * @return Returns 1 if the lock was taken, 0 otherwise.
+ */
+static inline int lock_try(malloc_lock *lock)
+{
+    if (!need_lock())
+        return 1;
+
+    int expected = 0;
+    return __atomic_compare_exchange_n(&lock->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Slow path of lock_acquire(): spin with exponential backoff, then sleep on the futex.
+ */
+static void __attribute__((noinline, unused)) lock_acquire_slow(malloc_lock *lock)
+{
+    int round, i;
+
+    for (round = 0; round < LOCK_SPIN_ROUNDS; ++round)
+    {
+        for (i = 0; i < 1 << round; ++i)
+            cpu_relax();
+
+        // only try the (cache line stealing) exchange when it looks like it could succeed
+        int expected = 0;
+        if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0 &&
+            __atomic_compare_exchange_n(&lock->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+
+    // mark the lock as having sleepers; whoever releases it will wake one of us up
+    while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0)
+        syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+}
+
+/**
+ * @brief Take \p lock, waiting if necessary.
+ */
+static inline void lock_acquire(malloc_lock *lock)
+{
+    if (!lock_try(lock))
+        lock_acquire_slow(lock);
+}
+
+/**
+ * @brief Release \p lock, waking up a sleeping thread if there is one.
+ */
+static inline void lock_release(malloc_lock *lock)
+{
+    if (!lock_taken())
+        return;
+
+    if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+// Contention on the heap lock. Sizes are above the front-end cache limit so that every call
+// takes the lock. To compare the futex lock against a pthread mutex:
+//   make clean && make locktime && ./a.out
+//   make clean && make locktime DEFINES=-DUSE_PTHREAD_MUTEX && ./a.out
+// Each line gives the thread count, the wall time and the average time per malloc/free pair.
+
+#define OPS 200000 // # of malloc/free pairs per thread
+#define K 16 // # of live blocks per thread
+#define MIN_SIZE 512
+#define MAX_SIZE 4096
+
+using namespace std;
+
+static void work(unsigned int seed)
+{
+    void *stuff[K] = { 0 };
+
+    for (size_t i = 0; i < OPS; ++i)
+    {
+        size_t slot = i % K;
+        free(stuff[slot]);
+        stuff[slot] = malloc(MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE));
+    }
+
+    for (size_t i = 0; i < K; ++i)
+        free(stuff[i]);
+}
+
+int main()
+{
+#ifdef USE_PTHREAD_MUTEX
+    printf("lock: pthread mutex\n");
+#else
+    printf("lock: futex\n");
+#endif
+    printf("threads seconds ns_per_op\n");
+
+    int thread_counts[] = { 1, 2, 8, 64 };
+
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+    {
+        int n = thread_counts[t];
+        auto start = chrono::steady_clock::now();
+
+        vector<thread> threads;
+        for (int i = 0; i < n; ++i)
+            threads.push_back(thread(work, i));
+        for (int i = 0; i < n; ++i)
+            threads[i].join();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        printf("%d %f %f\n", n, seconds, seconds * 1e9 / ((double)OPS * n));
+    }
+
+    return 0;
+}
@@ -5,40 +5,61 @@
  * @brief File containing implementations of malloc(), free(), calloc(), and realloc().
  *
  * The memory overhead for block metadata is larger than the standard implementation which is most noticeable when doing a lot of small allocations.
- * The heap size is managed via the glibc sbrk() function.
- * Thread safety is guaranteed via a pthread mutex.
+ * The heap is split into arenas. The size of the main arena is managed via the glibc sbrk() function, further arenas are created in mmap()ed address ranges when threads contend.
+ * Each arena manages its heap with the engine named by BAGNALLOC_ENGINE (see heap_policy): a first-fit (default), next-fit or best-fit address ordered free list, the segregated fit or TLSF engines in fits.c, or the buddy engine in buddy.c. -DHEAP_ENGINE=\"name\" changes the default.
+ * The free list engines can defer coalescing (BAGNALLOC_DEFER=1): short blocks wait on quick lists and are merged in batches, see list_merge_pending(). Their walks can be software pipelined (BAGNALLOC_PREFETCH=1), see walk_list().
+ * Allocation requests >= 256kB (BAGNALLOC_MMAP_THRESHOLD, 0 for never) get a mapping of their own instead of growing the heap, or a span of the page heap in pageheap.c if it is on (BAGNALLOC_PAGEHEAP=1).
+ * Requests of up to 16 bytes can get header-free slots in runs of their own (BAGNALLOC_TINY=1), see tiny.c. With the page heap on, the runs are its spans as well.
+ * Bitmaps are searched with the SIMD or scalar kernel picked for the cpu by bitmap_init() (BAGNALLOC_BITMAP), see bitmap.c.
+ * Building with -DCOMPRESSED_LINKS makes the block links 32-bit offsets from the start of each arena's heap (see heap_link); the main arena then stops growing at LINK_SPAN bytes and further requests are served by other arenas, see arena_lock_for().
+ * On machines with several NUMA nodes (or BAGNALLOC_NUMA_FAKE), arenas belong to nodes and threads only use arenas of theirs, see arena_attach() and numa.c. Blocks freed on another node than theirs skip the caches and go straight home, see free().
+ * Blocks with a mapping of their own can be cloned copy-on-write through a memfd (BAGNALLOC_CLONE=1 backs them with one from the start), see bagnalloc_clone().
+ * Heaps can be grown and their pages faulted in ahead of time, and the caches filled, before the first requests come, see bagnalloc_reserve().
+ * Persistent heaps that live in a file mapped at a fixed address, apart from the arenas, are in persist.c.
+ * Pools of shared memory that several processes allocate from, with offsets for links, are in shared.c.
+ * Thread safety is guaranteed via a lock per arena (see lock.h). Threads that find the lock of their arena taken too often move to a less contended arena. Small blocks may be recycled through the front-end caches in cache.c, and medium blocks through the central free lists in medium.c, without taking it.
  * Beware though, errors will not result in a nice exception like bad_alloc.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/param.h>
 #include <sys/mman.h>
-#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "bagnalloc.h"
+#include "bagnalloc_internal.h"
+#include "lock.h"
 
 #define HEAP_GROWTH_INCREMENT 4 // # of pages
-#define MMAP_THRESHOLD 128*1024 // # of bytes
- 
-/** @struct block_meta
- *  @brief The structure at the beginning of every block node in the heap (whether free or allocated).
- *  @var block_meta::length
- *  Length of the data portion of the block (doesn't include sizeof this structure).
- *  @var block_meta::prev
- *  A pointer to the previous block. NULL if the current block is the first block.
- *  @var block_meta::next
- *  A pointer to the next block. NULL if the current block has been allocated (not free).
- *  If the current block is free, next points to either the next free block or end_brk if the current block is the last free block.
- *  @var x
- *  Reserved. Required for the struct to be long word aligned on a 32-bit system.
- */
-typedef struct block_meta {
-  size_t length;
-  struct block_meta *prev;
-  struct block_meta *next;
-  int x;
-} block_meta;
+#define MMAP_THRESHOLD (256 * 1024) // # of bytes from which requests get a mapping of their own by default
+#define MMAP_TAG (~0u) // block_meta::tag of blocks with a mapping of their own
+#define REQUEST_MAX (SIZE_MAX / 4) // largest request (and alignment), leaving room for headers and padding
+#define PAGEMAP_BATCH 512 // # of /proc/self/pagemap entries read at once by clones
+#define PAGEMAP_PRESENT (1ull << 63) // pagemap entry bit: the page is in memory
+#define PAGEMAP_SWAPPED (1ull << 62) // pagemap entry bit: the page is in swap
+#define PAGEMAP_FILE (1ull << 61) // pagemap entry bit: the page is a page of the file mapped (or shared)
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // Linux 5.14: fault pages in writable without touching them
+#endif
+#define MAX_ARENAS 64
+#define ARENAS_PER_CPU 2 // default cap on the # of arenas
+#define ARENA_SIZE ((size_t)1 << (sizeof(void*) == 8 ? 32 : 26)) // address range reserved per arena; a power of 2
+#define ARENA_WINDOW 256 // # of lock acquisitions by a thread between contention checks
+#define ARENA_MIGRATE_FAILURES 16 // # of failed lock_try() in a window that makes a thread move
+#define ARENA_TRIM_MIN (64 * 1024) // # of bytes a free block needs for its pages to be given back when its arena is left unused
+#define CACHE_LINE 64 // # of bytes in a cache line
+#define QUICK_MAX 512 // largest block (data section) whose coalescing is deferred (BAGNALLOC_DEFER)
+#define QUICK_CLASSES (QUICK_MAX / 8) // one quick list per multiple of 8 up to QUICK_MAX
+#define DEFER_MAX 1024 // # of blocks on the quick lists that triggers a merge pass
+ 
 /*
  * block_meta could be reduced in size so that the next pointer resides
  * in the first few bytes of the data section of a block, but the
@@ -60,14 +81,242 @@ size_t round_up_multof(size_t n, size_t f)
     return (n + (f - 1)) / f * f;
 }
 
+/** @struct arena
+ *  @brief A heap with its own free list and lock. Threads are spread over several arenas so
+ *  they don't all wait on the same lock.
+ *  @var arena::lock
+ *  Protects the free list of the arena.
+ *  @var arena::start_brk
+ *  Start of the arena's heap.
+ *  @var arena::end_brk
+ *  End of the arena's heap. Also marks the end of the free list.
+ *  @var arena::limit
+ *  End of the address range reserved for the arena, NULL for the main arena which grows with sbrk().
+ *  @var arena::free_blocks
+ *  The first free block.
+ *  @var arena::last_free_block
+ *  The last free block.
+ *  @var arena::rover
+ *  The free block the last allocation left off at, where the next-fit engine resumes its search,
+ *  or NULL to start from free_blocks.
+ *  @var arena::id
+ *  Index of the arena in arenas[].
+ *  @var arena::node
+ *  The NUMA node the arena's pages are placed on and whose threads use it (0 for the main arena).
+ *  @var arena::threads
+ *  Number of threads assigned to the arena. Protected by arenas_lock.
+ *  @var arena::pressure
+ *  Number of lock_try() failures in the last window of ARENA_WINDOW acquisitions by a thread
+ *  assigned to the arena. Used to pick where contended threads move to.
+ *  @var arena::acquisitions
+ *  Number of times the lock was taken to allocate.
+ *  @var arena::contention
+ *  Number of times the lock was found taken when allocating.
+ *  @var arena::incoming
+ *  Blocks freed by threads of other arenas, linked through the first word of their data section.
+ *  Pushed to without the lock, and given back to the heap by the next holder of the lock (see
+ *  arena_drain()). They still look allocated to the free list.
+ *  @var arena::quick
+ *  Blocks freed without being merged in deferred coalescing mode, one list per length, linked
+ *  through their prev field. They still look allocated to the free list.
+ *  @var arena::pending
+ *  Number of blocks on the quick lists.
+ *  @var arena::merge_buffer
+ *  Room for 2 * DEFER_MAX blocks, to sort the blocks of the quick lists by address in a merge
+ *  pass. Only mapped with BAGNALLOC_DEFER set, NULL otherwise (see init_arena()).
+ *  @var arena::walks
+ *  Histogram of the number of free blocks passed over by free list searches (see bagnalloc_arena_stats::walks).
+ *  @var arena::buddy
+ *  The state of the buddy engine, used instead of the free list when it is selected.
+ *  @var arena::fits
+ *  The state of the segregated fit or TLSF engine, used instead of the free list when one is selected.
+ */
+typedef struct arena {
+    malloc_lock lock;
+    void *start_brk;
+    void *end_brk;
+    void *limit;
+    block_meta *free_blocks;
+    block_meta *last_free_block;
+    block_meta *rover;
+    unsigned int id;
+    unsigned int node;
+    unsigned int threads;
+    unsigned int pressure;
+    size_t acquisitions;
+    size_t contention;
+    void *incoming;
+    block_meta *quick[QUICK_CLASSES];
+    size_t pending;
+    block_meta **merge_buffer;
+    size_t walks[BAGNALLOC_WALK_BUCKETS];
+    union {
+        buddy_heap buddy;
+        fit_heap fits;
+    };
+} arena;
+
+/** @struct heap_policy
+ *  @brief An engine managing the blocks of every arena's heap. All engines use the same block
+ *  header, so the caches, free() and realloc() don't need to know which one is in use.
+ *  @var heap_policy::name
+ *  The value of BAGNALLOC_ENGINE that selects the engine.
+ *  @var heap_policy::init
+ *  Start the engine's state for an arena whose heap covers [start, end).
+ *  @var heap_policy::find_fit
+ *  Pick the free block to allocate from (engines built on the address ordered free list only).
+ *  @var heap_policy::alloc
+ *  Allocate a block, growing the heap if needed. The caller holds the arena's lock.
+ *  @var heap_policy::alloc_aligned
+ *  Allocate a block with an aligned data section, NULL if the engine doesn't need to do it
+ *  itself (blocks are then over-allocated and split, see heap_alloc_aligned()).
+ *  @var heap_policy::free
+ *  Free a block, coalescing it with free neighbours.
+ *  @var heap_policy::split
+ *  Cut an allocated block in two, keeping the given number of bytes in the first one, and return
+ *  the second one (or NULL if it would be too small). NULL if the engine can't split blocks.
+ *  @var heap_policy::trim
+ *  Give the pages inside free blocks of at least the given size back to the system.
+ *  @var heap_policy::block_length
+ *  Get the length of the block serving a request, NULL if it is the request itself.
+ *  @var heap_policy::growth
+ *  How many times the number of bytes requested the heap may have to grow by.
+ *  @var heap_policy::medium_lists
+ *  Whether the medium free lists may be used; their size classes must line up with the blocks.
+ */
+typedef struct heap_policy {
+    const char *name;
+    void (*init)(arena *a, void *start, void *end);
+    block_meta* (*find_fit)(arena *a, size_t size);
+    void* (*alloc)(arena *a, size_t size);
+    void* (*alloc_aligned)(arena *a, size_t alignment, size_t size);
+    void (*free)(arena *a, void *ptr);
+    block_meta* (*split)(arena *a, block_meta *block, size_t size);
+    void (*trim)(arena *a, size_t min);
+    size_t (*block_length)(size_t size);
+    unsigned int growth;
+    int medium_lists;
+} heap_policy;
+
+/** @struct mapping_meta
+ *  @brief The header of a block with a mapping of its own, in front of its block_meta.
+ *  @var mapping_meta::length
+ *  Number of bytes in the mapping, headers included.
+ *  @var mapping_meta::fd
+ *  The memfd the mapping maps, -1 if it is anonymous.
+ *  @var mapping_meta::shared
+ *  Whether the mapping is a shared one, whose writes go to the memfd, rather than a private
+ *  copy-on-write one of a memfd that no longer changes (see mapping_freeze()).
+ *  @var mapping_meta::prev
+ *  The previous shared mapping on the list of them.
+ *  @var mapping_meta::next
+ *  The next shared mapping on the list of them.
+ */
+typedef struct mapping_meta {
+    size_t length;
+    int fd;
+    int shared;
+    struct mapping_meta *prev;
+    struct mapping_meta *next;
+} mapping_meta;
+
+static const heap_policy first_fit_policy, next_fit_policy, best_fit_policy, segregated_policy, tlsf_policy, buddy_policy;
+static const heap_policy *policies[] = { &first_fit_policy, &next_fit_policy, &best_fit_policy, &segregated_policy, &tlsf_policy, &buddy_policy };
+
+#if defined(BUDDY_ENGINE) && !defined(HEAP_ENGINE)
+#define HEAP_ENGINE "buddy"
+#endif
+
+static const heap_policy *policy = &first_fit_policy; // the engine in use, see init_heap()
+
 static int initialized = 0;
 static size_t page_size;
-static void *start_brk;
-static void *end_brk;
-static block_meta *free_blocks;
-static block_meta *last_free_block;
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static arena main_arena = { MALLOC_LOCK_INITIALIZER };
+static arena *arenas[MAX_ARENAS] = { &main_arena };
+static size_t num_arenas = 1;
+static size_t arena_limit; // # of arenas that may be created
+static size_t arena_migrations;
+static int isolate_lines; // give small blocks whole cache lines (BAGNALLOC_ISOLATE)
+static int prefetch_walks; // software pipeline the free list walks (BAGNALLOC_PREFETCH)
+static int defer_coalescing; // put freed blocks on quick lists and merge them in batches (BAGNALLOC_DEFER)
+static size_t mmap_threshold = MMAP_THRESHOLD; // 0 if every request is served by the arenas (BAGNALLOC_MMAP_THRESHOLD)
+static size_t remote_frees; // # of blocks freed by a thread of another NUMA node than theirs
+static int clone_backing; // back the blocks with mappings of their own with memfds (BAGNALLOC_CLONE)
+static size_t clones; // # of blocks cloned by mapping them again
+static size_t clone_copied; // # of bytes clones had to copy
+static size_t reserved; // # of bytes heaps were grown by ahead of time by bagnalloc_reserve()
+static size_t prefaulted; // # of bytes of them whose pages were faulted in
+static malloc_lock arenas_lock = MALLOC_LOCK_INITIALIZER; // protects the above and arena::threads
+static mapping_meta *shared_mappings; // blocks with a shared mapping of a memfd, frozen before fork()
+static malloc_lock mappings_lock = MALLOC_LOCK_INITIALIZER; // protects shared_mappings
+#ifdef SINGLE_THREAD_ELISION
+int locking_enabled; // see lock.h
+#endif
+
+static pthread_key_t arena_key; // lets thread exit drop the thread's arena assignment
+static __thread arena *thread_arena; // NULL until the thread first allocates
+static __thread unsigned int window_acquisitions; // # of acquisitions in the current window
+static __thread unsigned int window_failures; // # of failed lock_try() in the current window
+
+/** 
+ * @brief Give an arena the heap [\p start, \p end) and start the engine's state for it.
+ */
+static void init_arena(arena *a, void *start, void *end)
+{
+    a->start_brk = start;
+    a->end_brk = end;
+
+    // an arena whose buffer can't be mapped frees its short blocks right away
+    if (defer_coalescing)
+    {
+        a->merge_buffer = mmap(NULL, 2 * DEFER_MAX * sizeof(block_meta*), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (a->merge_buffer == MAP_FAILED)
+            a->merge_buffer = NULL;
+    }
+
+    policy->init(a, start, end);
+}
+
+/** 
+ * @brief Give the pages inside large free blocks of an arena back to the system. They read as
+ * zeroes the next time they are touched.
+ */
+static void arena_trim(arena *a)
+{
+    lock_acquire(&a->lock);
+    policy->trim(a, ARENA_TRIM_MIN);
+    lock_release(&a->lock);
+}
+
+/** 
+ * @brief Take a thread off an arena. An arena left without threads goes back to the pool of
+ * unused arenas, from which the next new or migrating thread is served first, and gives its
+ * free pages back. The caller must hold arenas_lock.
+ */
+static void arena_detach(arena *a)
+{
+    if (--a->threads == 0)
+    {
+        a->pressure = 0;
+        arena_trim(a);
+    }
+}
+
+/** 
+ * @brief Drop the arena assignment of an exiting thread.
+ */
+static void arena_thread_exit(void *value)
+{
+    arena *a = value;
+
+    lock_acquire(&arenas_lock);
+    arena_detach(a);
+    lock_release(&arenas_lock);
+
+    // allocations by later destructors attach the thread again
+    thread_arena = NULL;
+}
 
 /** 
  * @brief Initialize the heap and get system page size. Called on first use of malloc.
@@ -77,38 +326,116 @@ static void init_heap()
     // get system page size
     page_size = sysconf(_SC_PAGESIZE);
 
-    // get initial addresses for everything
-    start_brk = free_blocks = last_free_block = sbrk(page_size);
-    end_brk = start_brk + page_size;
-    
-    // start with one big free block
-    free_blocks->length = page_size - sizeof(block_meta);
-    free_blocks->prev = NULL;
-    free_blocks->next = end_brk;
+    // pick the engine named by BAGNALLOC_ENGINE, or else the one built in as the default
+    const char *engine = getenv("BAGNALLOC_ENGINE");
+#ifdef HEAP_ENGINE
+    if (engine == NULL)
+        engine = HEAP_ENGINE;
+#endif
+    size_t i;
+    for (i = 0; engine != NULL && i < sizeof(policies) / sizeof(policies[0]); ++i)
+        if (!strcmp(engine, policies[i]->name))
+            policy = policies[i];
+
+    bitmap_init();
+    numa_init();
+
+    // read before the main arena is set up, which needs it
+    const char *defer = getenv("BAGNALLOC_DEFER");
+    defer_coalescing = defer != NULL && strcmp(defer, "0");
+
+    // the main arena starts with one page from sbrk
+    void *start = sbrk(page_size);
+    init_arena(&main_arena, start, (char*)start + page_size);
+
+    // allow a few arenas per cpu, or as many as BAGNALLOC_ARENAS says
+    const char *limit = getenv("BAGNALLOC_ARENAS");
+    arena_limit = limit != NULL ? strtoul(limit, NULL, 10) : ARENAS_PER_CPU * sysconf(_SC_NPROCESSORS_CONF);
+    arena_limit = MAX(numa_nodes, MIN(arena_limit, MAX_ARENAS));
+    if (pthread_key_create(&arena_key, arena_thread_exit))
+        arena_limit = 1;
+
+    const char *isolate = getenv("BAGNALLOC_ISOLATE");
+    isolate_lines = isolate != NULL && strcmp(isolate, "0");
+
+    const char *prefetch = getenv("BAGNALLOC_PREFETCH");
+    prefetch_walks = prefetch != NULL && strcmp(prefetch, "0");
+
+    const char *threshold = getenv("BAGNALLOC_MMAP_THRESHOLD");
+    if (threshold != NULL)
+        mmap_threshold = strtoul(threshold, NULL, 10);
+
+    const char *clone = getenv("BAGNALLOC_CLONE");
+    clone_backing = clone != NULL && strcmp(clone, "0");
+
+    cache_init();
+    page_heap_init();
+    tiny_init();
 }
 
 /** 
- * @brief Grow the size of the heap.
+ * @brief Grow the size of an arena. The main arena moves the program break, the others have
+ * their whole range mapped already (see arena_has_room()).
+ * @param a The arena.
  * @param amount The minimum number of bytes to increase by.
- * @return Returns the number of pages the heap increased by.
+ * @return Returns the number of pages the heap increased by, or 0 if the program break couldn't
+ * be moved that far.
  */
-static size_t grow_heap(size_t amount)
+static size_t grow_heap(arena *a, size_t amount)
 {
+    if (amount > REQUEST_MAX)
+        return 0;
+
     size_t num_pages = round_up_multof(amount, page_size) / page_size;
     num_pages = round_up_multof(num_pages, HEAP_GROWTH_INCREMENT);
-    end_brk = sbrk(num_pages * page_size) + num_pages * page_size;
+    if (a->limit == NULL)
+    {
+        void *start = sbrk(num_pages * page_size);
+        if (start == (void*)-1)
+            return 0;
+        numa_bind(start, num_pages * page_size, 0);
+        a->end_brk = (char*)start + num_pages * page_size;
+    }
+    else
+        a->end_brk = (char*)a->end_brk + num_pages * page_size;
     return num_pages;
 }
 
+/*
+ * The links of the blocks of an arena are relative to its start_brk (see block_link), so the
+ * free list code reads and writes them through these.
+ */
+
+static inline block_meta* next_of(arena *a, block_meta *block)
+{
+    return link_get(a->start_brk, block->next);
+}
+
+static inline block_meta* prev_of(arena *a, block_meta *block)
+{
+    return link_get(a->start_brk, block->prev);
+}
+
+static inline void set_next(arena *a, block_meta *block, block_meta *next)
+{
+    block->next = link_make(a->start_brk, next);
+}
+
+static inline void set_prev(arena *a, block_meta *block, block_meta *prev)
+{
+    block->prev = link_make(a->start_brk, prev);
+}
+
 /** 
  * @brief Create a free block in the heap.
+ * @param a The arena.
  * @param loc A pointer to the beginning of the new block.
  * @param prev_block A pointer to the beginning of the free block preceding the new block.
  * @param next_block A pointer to the beginning of the free block succeeding the new block.
  * @param size The size of the new block (including the metadata structure).
  * @return Returns a pointer to the beginning of the new block (equal to \p loc).
  */
-static void* create_free_block(block_meta *loc,
+static void* create_free_block(arena *a, block_meta *loc,
                                 block_meta *prev_block,
                                 block_meta *next_block,
                                 size_t size)
@@ -117,17 +444,17 @@ static void* create_free_block(block_meta *loc,
     loc->length = size - sizeof(block_meta);
 
     // next block
-    loc->next = next_block;
-    if (next_block != end_brk)
-        next_block->prev = loc;
+    set_next(a, loc, next_block);
+    if (next_block != a->end_brk)
+        set_prev(a, next_block, loc);
     else
-        last_free_block = loc;
+        a->last_free_block = loc;
 
     // previous block
-    loc->prev = prev_block;
+    set_prev(a, loc, prev_block);
     if (prev_block != NULL)
     {
-        prev_block->next = loc;
+        set_next(a, prev_block, loc);
     }
 
     return loc;
@@ -135,6 +462,7 @@ static void* create_free_block(block_meta *loc,
 
 /** 
  * @brief Create a data block in the heap.
+ * @param a The arena.
  * @param loc A pointer to the beginning of the new block.
  * @param size The size of the new block (including the metadata structure).
  * @param length The length of the free block that is being replaced or partially replaced by the new block.
@@ -142,13 +470,14 @@ static void* create_free_block(block_meta *loc,
  * @param next_free_block A pointer to the beginning of the free block succeeding the new block.
  * @return Returns a pointer to the beginning of the data section of the new block.
  */
-static void* create_data_block(block_meta *loc, size_t size,
+static void* create_data_block(arena *a, block_meta *loc, size_t size,
                                 size_t length,
                                 block_meta *prev_free_block,
                                 block_meta *next_free_block)
 {
     // set size of data block
     loc->length = size;
+    loc->tag = 0;
 
     // get data pointer to return
     void *start_data = loc + 1; // 1 * sizeof(block_meta) since loc is type block_meta
@@ -157,7 +486,7 @@ static void* create_data_block(block_meta *loc, size_t size,
     block_meta *new_free_block = NULL;
     if (length - size >= sizeof(block_meta) + 8)
     {
-        new_free_block = create_free_block(start_data + size, prev_free_block, next_free_block, length - size);
+        new_free_block = create_free_block(a, start_data + size, prev_free_block, next_free_block, length - size);
     }
     // else still need to update next/prev fields of nearest free blocks
     else
@@ -165,225 +494,421 @@ static void* create_data_block(block_meta *loc, size_t size,
         // just give the leftover data to the data block
         loc->length = length;
 
-        if (loc->prev != NULL)
+        if (prev_of(a, loc) != NULL)
         {
-            loc->prev->next = loc->next;
+            set_next(a, prev_of(a, loc), next_of(a, loc));
 
-            if (loc == last_free_block)
-                last_free_block = loc->prev;
+            if (loc == a->last_free_block)
+                a->last_free_block = prev_of(a, loc);
         }
-        if (loc->next != end_brk)
-            loc->next->prev = loc->prev;
+        if (next_of(a, loc) != a->end_brk)
+            set_prev(a, next_of(a, loc), prev_of(a, loc));
     }
 
     // mark as data block
-    loc->next = NULL;
+    set_next(a, loc, NULL);
 
     // if this was first block, need to change free_blocks pointer
-    if (loc == free_blocks)
+    if (loc == a->free_blocks)
     {
         // if new block was made, set free_blocks to point to it
         if (new_free_block != NULL)
-            free_blocks = new_free_block;
+            a->free_blocks = new_free_block;
         // else set free_blocks to point to next block
         else
         {
-            free_blocks = next_free_block;
+            a->free_blocks = next_free_block;
 
             // if it is the end of the heap, grow the heap and create a new block in the new region
-            if (free_blocks == end_brk)
+            if (a->free_blocks == a->end_brk)
             {
-                grow_heap(1);
-                create_free_block(free_blocks, NULL, end_brk, (char*)end_brk - (char*)free_blocks);
+                grow_heap(a, 1);
+                create_free_block(a, a->free_blocks, NULL, a->end_brk, (char*)a->end_brk - (char*)a->free_blocks);
             }
 
-            free_blocks->prev = NULL;
+            set_prev(a, a->free_blocks, NULL);
         }
     }
 
+    // the next search resumes at what is left of the block, or else at the free block after it
+    // (which the heap has grown into if it was the end of the heap)
+    if (new_free_block != NULL)
+        a->rover = new_free_block;
+    else
+        a->rover = next_free_block != a->end_brk ? next_free_block : NULL;
+
     // return data pointer
     return start_data;
 }
 
 /** 
- * @brief Allocate memory for use by a program.
- * @param size The minimum number of bytes to allocate.
- * @return Returns a pointer to the allocated memory.
+ * @brief Count a free list search in the arena's histogram of walk lengths.
+ * @param a The arena.
+ * @param steps The number of free blocks the search passed over.
  */
-void* malloc(size_t size)
+static inline void record_walk(arena *a, size_t steps)
 {
-    pthread_mutex_lock(&mutex);
-    
-    if (!initialized)
+    size_t bucket = steps ? sizeof(long) * 8 - __builtin_clzl(steps) : 0;
+    a->walks[MIN(bucket, BAGNALLOC_WALK_BUCKETS - 1)]++;
+}
+
+/** 
+ * @brief Walk the free list from \p cursor to the first block that is large enough. Each
+ * step is a pointer chase that may miss the cache on a large heap; with BAGNALLOC_PREFETCH the
+ * loop is software pipelined instead, loading the link of the next block (and so its length)
+ * and prefetching the block after it while the current block is checked.
+ * @param a The arena.
+ * @param cursor The free block to start from.
+ * @param stop Where to stop: end_brk, or a free block further down the list.
+ * @param size The minimum number of bytes needed.
+ * @param steps Incremented by the number of blocks passed over.
+ * @return Returns the block, or \p stop if there is none.
+ */
+static inline block_meta* walk_list(arena *a, block_meta *cursor, block_meta *stop, size_t size, size_t *steps)
+{
+    size_t n = 0;
+
+    if (prefetch_walks)
     {
-        initialized = 1;
-        init_heap();
+        while (cursor != stop)
+        {
+            block_meta *next = next_of(a, cursor);
+            if (next != a->end_brk)
+                __builtin_prefetch(next_of(a, next));
+            if (cursor->length >= size)
+                break;
+            cursor = next;
+            n++;
+        }
+    }
+    else
+    {
+        while (cursor != stop && cursor->length < size)
+        {
+            cursor = next_of(a, cursor);
+            n++;
+        }
     }
 
-    if (!size)
+    *steps += n;
+    return cursor;
+}
+
+/** 
+ * @brief Find the first free block in address order that is large enough.
+ * @param a The arena.
+ * @param size The minimum number of bytes needed.
+ * @return Returns the block, or end_brk if there is none.
+ */
+static block_meta* first_fit(arena *a, size_t size)
+{
+    size_t steps = 0;
+    block_meta *cursor = walk_list(a, a->free_blocks, a->end_brk, size, &steps);
+
+    record_walk(a, steps);
+    return cursor;
+}
+
+/** 
+ * @brief Find the first free block that is large enough starting from where the last
+ * allocation left off, wrapping around to the start of the list. Small fragments that pile up
+ * at the front of the list aren't walked past on every allocation.
+ * @param a The arena.
+ * @param size The minimum number of bytes needed.
+ * @return Returns the block, or end_brk if there is none.
+ */
+static block_meta* next_fit(arena *a, size_t size)
+{
+    block_meta *start = a->rover != NULL ? a->rover : a->free_blocks;
+    size_t steps = 0;
+
+    block_meta *cursor = walk_list(a, start, a->end_brk, size, &steps);
+    if (cursor == a->end_brk)
+        cursor = walk_list(a, a->free_blocks, start, size, &steps);
+
+    record_walk(a, steps);
+    return cursor != start || cursor->length >= size ? cursor : a->end_brk;
+}
+
+/** 
+ * @brief Find the smallest free block that is large enough, the first one in address order
+ * among equals.
+ * @param a The arena.
+ * @param size The minimum number of bytes needed.
+ * @return Returns the block, or end_brk if there is none.
+ */
+static block_meta* best_fit(arena *a, size_t size)
+{
+    block_meta *cursor, *best = a->end_brk;
+    size_t steps = 0;
+
+    for (cursor = a->free_blocks; cursor != a->end_brk; cursor = next_of(a, cursor), steps++)
     {
-        pthread_mutex_unlock(&mutex);
-        return NULL;
+        // see walk_list()
+        if (prefetch_walks && next_of(a, cursor) != a->end_brk)
+            __builtin_prefetch(next_of(a, next_of(a, cursor)));
+
+        if (cursor->length >= size && (best == a->end_brk || cursor->length < best->length))
+        {
+            best = cursor;
+            if (best->length == size)
+                break;
+        }
     }
 
-    size = round_up_multof(size, 8);
-    
-    // use mmap if size is big enough
-    //if (size >= MMAP_THRESHOLD)
-    //{
-        //// extra space for length metadata
-        //size_t mmap_size = round_up_multof(size + 8, page_size);
-        //size_t *ptr = (size_t*)mmap(NULL, mmap_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        //size_t *return_ptr;
-        //*ptr = mmap_size;
-        //// on 32-bit system need to return ptr + 2 to be long word aligned
-        //if (sizeof(size_t) % 8)
-        //{
-            //*(ptr + 1) = mmap_size;
-            //return_ptr = ptr + 2;
-        //}
-        //else
-            //return_ptr = ptr + 1;
-        //pthread_mutex_unlock(&mutex);
-        //return return_ptr;
-    //}
-
-    // begin at free_blocks
-    block_meta *cursor = free_blocks;
-    block_meta *prev_free_block = NULL;
-
-    while (cursor != end_brk)
-    {
-        // length of current block
-        size_t length = cursor->length;
-
-        // location of next block (could be end_brk)
-        block_meta *next_free_block = cursor->next;
-
-        // if block is big enough
-        if (length >= size)
+    record_walk(a, steps);
+    return best;
+}
+
+/** 
+ * @brief Sort blocks by address with a least significant digit radix sort, one pass per byte
+ * of the address bits that differ between the blocks.
+ * @param blocks The blocks.
+ * @param scratch Room for \p n more blocks.
+ * @param n The number of blocks.
+ */
+static void sort_blocks(block_meta **blocks, block_meta **scratch, size_t n)
+{
+    uintptr_t low = UINTPTR_MAX, high = 0;
+    size_t i, shift;
+
+    for (i = 0; i < n; ++i)
+    {
+        low = MIN(low, (uintptr_t)blocks[i]);
+        high = MAX(high, (uintptr_t)blocks[i]);
+    }
+
+    // blocks are 8 byte aligned, so the low 3 bits never differ
+    block_meta **from = blocks, **to = scratch;
+    for (shift = 3; shift < sizeof(uintptr_t) * 8 && ((low ^ high) >> shift) != 0; shift += 8)
+    {
+        size_t counts[257] = { 0 };
+
+        for (i = 0; i < n; ++i)
+            counts[(((uintptr_t)from[i] >> shift) & 255) + 1]++;
+        for (i = 1; i < 257; ++i)
+            counts[i] += counts[i - 1];
+        for (i = 0; i < n; ++i)
+            to[counts[((uintptr_t)from[i] >> shift) & 255]++] = from[i];
+
+        block_meta **swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != blocks)
+        memcpy(blocks, from, n * sizeof(block_meta*));
+}
+
+/** 
+ * @brief Merge the blocks of the quick lists into the free list: sort them by address and
+ * insert them, coalescing with their neighbours, in one sweep of the list. The caller must hold
+ * the arena's lock.
+ */
+static void list_merge_pending(arena *a)
+{
+    block_meta **blocks = a->merge_buffer;
+    size_t n = 0, i;
+
+    for (i = 0; i < QUICK_CLASSES; ++i)
+    {
+        block_meta *block;
+        for (block = a->quick[i]; block != NULL; block = prev_of(a, block))
+            blocks[n++] = block;
+        a->quick[i] = NULL;
+    }
+    a->pending = 0;
+
+    sort_blocks(blocks, blocks + n, n);
+
+    // prev is the free block before the cursor (NULL at the start of the list)
+    block_meta *prev = NULL, *cursor = a->free_blocks;
+    for (i = 0; i < n; ++i)
+    {
+        block_meta *block = blocks[i];
+        while (cursor != a->end_brk && cursor < block)
         {
-            void *ptr = create_data_block(cursor, size, length, prev_free_block, next_free_block);
-            pthread_mutex_unlock(&mutex);
-            return ptr;
+            prev = cursor;
+            cursor = next_of(a, cursor);
+        }
+
+        // merge with the free block before it or link it in after that one
+        if (prev != NULL && (char*)(prev + 1) + prev->length == (char*)block)
+            prev->length += block->length + sizeof(block_meta);
+        else
+        {
+            set_prev(a, block, prev);
+            set_next(a, block, cursor);
+            if (prev != NULL)
+                set_next(a, prev, block);
+            else
+                a->free_blocks = block;
+            if (cursor != a->end_brk)
+                set_prev(a, cursor, block);
+            else
+                a->last_free_block = block;
+            prev = block;
         }
 
-        // otherwise advance cursor
-        prev_free_block = cursor;
-        cursor = cursor->next;
+        // merge the free block after it
+        if (cursor != a->end_brk && (char*)(prev + 1) + prev->length == (char*)cursor)
+        {
+            if (a->rover == cursor)
+                a->rover = prev;
+            prev->length += cursor->length + sizeof(block_meta);
+            set_next(a, prev, next_of(a, cursor));
+            if (next_of(a, cursor) != a->end_brk)
+                set_prev(a, next_of(a, cursor), prev);
+            else
+                a->last_free_block = prev;
+            cursor = next_of(a, prev);
+        }
+    }
+}
+
+/** 
+ * @brief Allocate a block from the address ordered free list, splitting the block picked by
+ * the engine's find_fit(). The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param size The minimum number of bytes to allocate (a nonzero multiple of 8).
+ * @return Returns a pointer to the data section of the new block.
+ */
+static void* list_alloc(arena *a, size_t size)
+{
+    // a block freed with its coalescing deferred fits exactly
+    if (size <= QUICK_MAX && a->quick[size / 8 - 1] != NULL)
+    {
+        block_meta *block = a->quick[size / 8 - 1];
+        a->quick[size / 8 - 1] = prev_of(a, block);
+        a->pending--;
+        block->tag = 0;
+        return block + 1;
+    }
+
+    block_meta *cursor = policy->find_fit(a, size);
+
+    // merge the deferred blocks before growing the heap, they may make a block large enough
+    if (cursor == a->end_brk && a->pending)
+    {
+        list_merge_pending(a);
+        cursor = policy->find_fit(a, size);
     }
 
+    // the links of a free block are its neighbours on the free list
+    if (cursor != a->end_brk)
+        return create_data_block(a, cursor, size, cursor->length, prev_of(a, cursor), next_of(a, cursor));
+
+    block_meta *prev_free_block = a->last_free_block;
+
     // if we made it this far, a suitable free block was not found
     // so the size of the heap must be increased
 
     // if the last free block was at the end of the heap, expand it to the new end
-    if (prev_free_block != NULL && (char*)prev_free_block + sizeof(block_meta) + prev_free_block->length == end_brk)
+    if (prev_free_block != NULL && (char*)prev_free_block + sizeof(block_meta) + prev_free_block->length == a->end_brk)
     {
         // length of last free block
         size_t length = prev_free_block->length;
         // amount we need to expand by
         size_t required_space = size + sizeof(block_meta) - length;
         // grow heap, get number of pages it grew by
-        size_t num_of_pages_grown = grow_heap(required_space);
+        size_t num_of_pages_grown = grow_heap(a, required_space);
+        if (!num_of_pages_grown)
+            return NULL;
 
         // new length increases by new pages * page size
         length += num_of_pages_grown * page_size;
         // copy length into the length field of the last free block
         prev_free_block->length = length;
         // copy new end_brk location into next block field of the last free block
-        prev_free_block->next = end_brk;
+        set_next(a, prev_free_block, a->end_brk);
 
         // create new data block starting at the last free block and return the data pointer
-        void *ptr = create_data_block(prev_free_block, size, length, prev_free_block->prev, end_brk);
-        pthread_mutex_unlock(&mutex);
-        return ptr;
+        return create_data_block(a, prev_free_block, size, length, prev_of(a, prev_free_block), a->end_brk);
     }
     // else create new block in the new region
     else
     {
         // grow heap, get number of pages it grew by
-        size_t new_block_size_pages = grow_heap(size + sizeof(block_meta));
+        size_t new_block_size_pages = grow_heap(a, size + sizeof(block_meta));
+        if (!new_block_size_pages)
+            return NULL;
         // length of the new free block
         size_t length = new_block_size_pages * page_size - sizeof(block_meta);
         // create new free block
-        create_free_block(cursor, prev_free_block, end_brk, new_block_size_pages * page_size);
+        create_free_block(a, cursor, prev_free_block, a->end_brk, new_block_size_pages * page_size);
 
         // create new data block starting at new free block and return the data pointer
-        void *ptr = create_data_block(cursor, size, length, prev_free_block, end_brk);
-        pthread_mutex_unlock(&mutex);
-        return ptr;
+        return create_data_block(a, cursor, size, length, prev_free_block, a->end_brk);
     }
-    
-    pthread_mutex_unlock(&mutex);
 }
 
 /** 
- * @brief Deallocate memory that has been allocated by malloc().
- * @param ptr A pointer to the allocated memory.
+ * @brief Return a block to the address ordered free list. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param ptr A pointer to the data section of the block.
  */
-void free(void *ptr)
+static void list_free(arena *a, void *ptr)
 {
-    if (ptr == NULL)
-        return;
-        
-    pthread_mutex_lock(&mutex);
-    
-    //// if outside the heap, must be mmapped
-    //if (ptr < start_brk || ptr > end_brk)
-    //{
-        //void *mmap_ptr = ptr - sizeof(size_t);
-        //size_t size = *(size_t*)mmap_ptr;
-        //munmap(mmap_ptr, size);
-        //pthread_mutex_unlock(&mutex);
-        //return;
-    //}
-
     // block we are freeing
     block_meta *block = ptr - sizeof(block_meta);
 
+    // defer the merging of short blocks, malloc() often asks for the same length again soon
+    if (a->merge_buffer != NULL && block->length <= QUICK_MAX)
+    {
+        set_prev(a, block, a->quick[block->length / 8 - 1]);
+        a->quick[block->length / 8 - 1] = block;
+        if (++a->pending == DEFER_MAX)
+            list_merge_pending(a);
+        return;
+    }
+
     //if (block->next != NULL) // shouldn't happen, this means its not a data block
     //    return;
 
     // if this block is after the last free block
-    if (block > last_free_block)
+    if (block > a->last_free_block)
     {
         // if this block is immediately after last_free_block, merge
-        if ((char*)last_free_block + sizeof(block_meta) + last_free_block->length == (char*)block)
+        if ((char*)a->last_free_block + sizeof(block_meta) + a->last_free_block->length == (char*)block)
         {
-            last_free_block->length += block->length + sizeof(block_meta);
+            a->last_free_block->length += block->length + sizeof(block_meta);
         }
         // else this is the new last_free_block
         else
         {
-            last_free_block->next = block;
-            block->prev = last_free_block;
-            block->next = end_brk;
+            set_next(a, a->last_free_block, block);
+            set_prev(a, block, a->last_free_block);
+            set_next(a, block, a->end_brk);
 
-            last_free_block = block;
+            a->last_free_block = block;
         }
     }
     // else if this block is before first free block
-    else if (block < free_blocks)
+    else if (block < a->free_blocks)
     {
         // if this block is immediately before free_blocks, merge
-        if ((char*)block + sizeof(block_meta) + block->length == (char*)free_blocks)
+        if ((char*)block + sizeof(block_meta) + block->length == (char*)a->free_blocks)
         {
-            block->length += free_blocks->length + sizeof(block_meta);
-            block->next = free_blocks->next;
-            if (free_blocks->next != end_brk)
-                free_blocks->next->prev = block;
+            if (a->rover == a->free_blocks)
+                a->rover = block;
+            block->length += a->free_blocks->length + sizeof(block_meta);
+            set_next(a, block, next_of(a, a->free_blocks));
+            if (next_of(a, a->free_blocks) != a->end_brk)
+                set_prev(a, next_of(a, a->free_blocks), block);
+            else
+                a->last_free_block = block;
         }
         // else connect this block and free_blocks
         else
         {
-            block->next = free_blocks;
-            free_blocks->prev = block;
+            set_next(a, block, a->free_blocks);
+            set_prev(a, a->free_blocks, block);
         }
 
-        block->prev = NULL;
+        set_prev(a, block, NULL);
 
         // this is the new free_blocks
-        free_blocks = block;
+        a->free_blocks = block;
     }
     // else this block is in the middle somewhere
     else
@@ -393,153 +918,1675 @@ void free(void *ptr)
         block_meta *prev_block;
 
         // if next adjacent block is free, merge with it
-        if (next_block->next != NULL)
+        if (next_of(a, next_block) != NULL)
         {
+            if (a->rover == next_block)
+                a->rover = block;
             block->length += next_block->length + sizeof(block_meta);
-            block->next = next_block->next;
-            if (next_block->next != end_brk)
-                next_block->next->prev = block;
+            set_next(a, block, next_of(a, next_block));
+            if (next_of(a, next_block) != a->end_brk)
+                set_prev(a, next_of(a, next_block), block);
             else
-                last_free_block = block;
+                a->last_free_block = block;
 
             // get prev_block before changing it so we know our prev_block
-            prev_block = next_block->prev;
+            prev_block = prev_of(a, next_block);
         }
         // else find next free block and connect to it
         else
         {
-            if ((size_t)block < ((size_t)start_brk + (size_t)end_brk) / 2)
+            if ((size_t)block < ((size_t)a->start_brk + (size_t)a->end_brk) / 2)
             {
-                prev_block = free_blocks;
-                next_block = free_blocks->next;
+                prev_block = a->free_blocks;
+                next_block = next_of(a, a->free_blocks);
                 while (next_block < block)
                 {
-                    prev_block = prev_block->next;
-                    next_block = next_block->next;
+                    prev_block = next_of(a, prev_block);
+                    next_block = next_of(a, next_block);
                 }
             }
             else
             {
-                next_block = last_free_block;
-                prev_block = last_free_block->prev;
+                next_block = a->last_free_block;
+                prev_block = prev_of(a, a->last_free_block);
                 while (prev_block > block)
                 {
-                    next_block = next_block->prev;
-                    prev_block = prev_block->prev;
+                    next_block = prev_of(a, next_block);
+                    prev_block = prev_of(a, prev_block);
                 }
             }
 
-            block->next = next_block;
-            next_block->prev = block;
+            set_next(a, block, next_block);
+            set_prev(a, next_block, block);
         }
 
         // if this block is adjacent to prev_block, merge
         if ((char*) prev_block + sizeof(block_meta) + prev_block->length == (char*)block)
         {
+            if (a->rover == block)
+                a->rover = prev_block;
             prev_block->length += block->length + sizeof(block_meta);
-            prev_block->next = block->next;
-            if (block->next != end_brk)
-                block->next->prev = prev_block;
+            set_next(a, prev_block, next_of(a, block));
+            if (next_of(a, block) != a->end_brk)
+                set_prev(a, next_of(a, block), prev_block);
             else
-                last_free_block = prev_block;
+                a->last_free_block = prev_block;
         }
         // else connect this block to prev_block
         else
         {
-            prev_block->next = block;
-            block->prev = prev_block;
+            set_next(a, prev_block, block);
+            set_prev(a, block, prev_block);
         }
     }
-    
-    pthread_mutex_unlock(&mutex);
 }
 
 /** 
- * @brief Allocates memory for an array of \p nmemb elements and zero-initializes the allocated memory.
- * @param nmemb The number of array elements.
- * @param size The size of each array element.
- * @return Returns a pointer to the allocated memory. If \p nmemb or \p size is 0, NULL is returned.
+ * @brief Start an arena's free list with one free block covering [\p start, \p end).
  */
-void *calloc(size_t nmemb, size_t size)
+static void list_init(arena *a, void *start, void *end)
 {
-    size_t real_size = nmemb * size;
+    a->free_blocks = a->last_free_block = start;
+    a->rover = NULL;
 
-    if (!real_size)
-        return NULL;
-        
-    //pthread_mutex_lock(&mutex);
+    a->free_blocks->length = (char*)end - (char*)start - sizeof(block_meta);
+    set_prev(a, a->free_blocks, NULL);
+    set_next(a, a->free_blocks, end);
+}
 
-    void * volatile ptr = malloc(real_size);
+/** 
+ * @brief Cut a data block in two. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param block The data block.
+ * @param size The number of bytes of the data section to keep in the first block (a multiple of 8).
+ * @return Returns the second block, a data block, or NULL if it would be too small to hold a block of its own.
+ */
+static block_meta* list_split(arena *a, block_meta *block, size_t size)
+{
+    if (block->length - size < sizeof(block_meta) + 8)
+        return NULL;
 
-    memset(ptr, 0, real_size);
-    
-    //pthread_mutex_unlock(&mutex);
+    block_meta *tail = (block_meta*)((char*)(block + 1) + size);
+    tail->length = block->length - size - sizeof(block_meta);
+    set_next(a, tail, NULL);
+    tail->tag = 0;
+    block->length = size;
 
-    return ptr;
+    return tail;
 }
 
-// not sure if extra mutex is required in realloc
 /** 
- * @brief Changes the size of the memory block pointed to by \p ptr.
- * @param ptr A pointer to memory allocated by malloc().
- * @param size The new data size.
- * @return Returns a pointer to the resized block. It is guaranteed to be different from the original pointer.
- * @note If \p ptr is NULL, this function is equivalent to malloc()
- * @note If \p ptr is not NULL and \p size is 0, this function is equivalent to free()
+ * @brief Give the pages inside free blocks of at least \p min bytes back to the system,
+ * keeping the pages holding their headers. The caller must hold the arena's lock.
  */
-void *realloc(void *ptr, size_t size)
+static void list_trim(arena *a, size_t min)
 {
-    size = round_up_multof(size, 8);
-    
-    // if ptr is NULL, equivalent to malloc(size)
-    if (ptr == NULL)
-        return malloc(size);
+    block_meta *block;
 
-    // if ptr not NULL and size is 0, equivalent to free(ptr)
-    if (!size)
+    if (a->pending)
+        list_merge_pending(a);
+
+    for (block = a->free_blocks; block != a->end_brk; block = next_of(a, block))
     {
-        free(ptr);
-        return NULL;
+        if (block->length < min)
+            continue;
+
+        // keep the page holding the block header
+        char *start = (char*)round_up_multof((size_t)(block + 1), page_size);
+        char *end = (char*)((size_t)((char*)(block + 1) + block->length) / page_size * page_size);
+        if (end > start)
+            madvise(start, end - start, MADV_DONTNEED);
     }
-    
-    //pthread_mutex_lock(&mutex);
+}
 
-    void * volatile new_ptr = malloc(size);
-    
-    size_t old_size;
-    //// if ptr is mmapped
-    //if (ptr < start_brk || ptr > end_brk)
-    //{
-        //// length is in the sizeof(size_t) bytes preceding ptr
-        //old_size = *(size_t*)(ptr - sizeof(size_t)) - sizeof(size_t);
-    //}
-    //// else in heap
-    //else
-    //{
-        // length field of ptr's data block
-        old_size = * (size_t*) ((char*)ptr - sizeof(block_meta));
-    //}
-    
-    size_t new_size;
-    // if new_ptr is mmapped
-    //if (new_ptr < start_brk || new_ptr > end_brk)
-    //{
-        //// length is in the sizeof(size_t) bytes preceding new_ptr
-        //new_size = *(size_t*)(new_ptr - sizeof(size_t)) - sizeof(size_t);
-    //}
-    //// else in heap
-    //else
-    //{
-        new_size = size;
-    //}
+static void segregated_init(arena *a, void *start, void *end)
+{
+    fits_init(&a->fits, FIT_SEGREGATED, start, end);
+}
 
-    size_t min_size = old_size < new_size ? old_size : new_size; // min
+static void tlsf_init(arena *a, void *start, void *end)
+{
+    fits_init(&a->fits, FIT_TLSF, start, end);
+}
 
-    memcpy(new_ptr, ptr, min_size);
+/** 
+ * @brief Allocate a block from the segregated fit or TLSF engine, growing the heap if no free
+ * block is large enough. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param size The minimum number of bytes to allocate (a nonzero multiple of 8).
+ * @return Returns a pointer to the data section of the new block, or NULL if \p size is too big.
+ */
+static void* fits_arena_alloc(arena *a, size_t size)
+{
+    void *ptr = fits_alloc(&a->fits, size);
+    if (ptr != NULL)
+        return ptr;
 
-    free(ptr);
-    
-    //pthread_mutex_unlock(&mutex);
+    size_t shortfall = fits_shortfall(&a->fits, size);
+    if (!shortfall)
+        return NULL;
 
-    return new_ptr;
+    if (!grow_heap(a, shortfall))
+        return NULL;
+    fits_grow(&a->fits, a->end_brk);
+    return fits_alloc(&a->fits, size);
+}
+
+static void fits_arena_free(arena *a, void *ptr)
+{
+    fits_free(&a->fits, ptr);
+}
+
+static block_meta* fits_arena_split(arena *a, block_meta *block, size_t size)
+{
+    return fits_split(&a->fits, block, size);
+}
+
+static void fits_arena_trim(arena *a, size_t min)
+{
+    fits_trim(&a->fits, min, page_size);
+}
+
+static void buddy_arena_init(arena *a, void *start, void *end)
+{
+    buddy_init(&a->buddy, start, end);
+}
+
+/** 
+ * @brief Allocate a block from the buddy engine, growing the heap if no free block is large
+ * enough. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param alignment The alignment of the data section (a power of two).
+ * @param size The minimum number of bytes to allocate (a nonzero multiple of 8).
+ * @return Returns a pointer to the data section of the new block, or NULL if \p size is too big.
+ */
+static void* buddy_arena_alloc_aligned(arena *a, size_t alignment, size_t size)
+{
+    void *ptr = buddy_alloc(&a->buddy, alignment, size);
+    if (ptr != NULL)
+        return ptr;
+
+    size_t shortfall = buddy_shortfall(&a->buddy, alignment, size);
+    if (!shortfall)
+        return NULL;
+
+    if (!grow_heap(a, shortfall))
+        return NULL;
+    buddy_grow(&a->buddy, a->end_brk);
+    return buddy_alloc(&a->buddy, alignment, size);
+}
+
+static void* buddy_arena_alloc(arena *a, size_t size)
+{
+    return buddy_arena_alloc_aligned(a, 8, size);
+}
+
+static void buddy_arena_free(arena *a, void *ptr)
+{
+    buddy_free(&a->buddy, ptr);
+}
+
+static void buddy_arena_trim(arena *a, size_t min)
+{
+    buddy_trim(&a->buddy, min, page_size);
+}
+
+static const heap_policy first_fit_policy = {
+    .name = "first-fit", .init = list_init, .find_fit = first_fit, .alloc = list_alloc,
+    .free = list_free, .split = list_split, .trim = list_trim, .growth = 1, .medium_lists = 1,
+};
+
+static const heap_policy next_fit_policy = {
+    .name = "next-fit", .init = list_init, .find_fit = next_fit, .alloc = list_alloc,
+    .free = list_free, .split = list_split, .trim = list_trim, .growth = 1, .medium_lists = 1,
+};
+
+static const heap_policy best_fit_policy = {
+    .name = "best-fit", .init = list_init, .find_fit = best_fit, .alloc = list_alloc,
+    .free = list_free, .split = list_split, .trim = list_trim, .growth = 1, .medium_lists = 1,
+};
+
+static const heap_policy segregated_policy = {
+    .name = "segregated", .init = segregated_init, .alloc = fits_arena_alloc,
+    .free = fits_arena_free, .split = fits_arena_split, .trim = fits_arena_trim, .growth = 1, .medium_lists = 1,
+};
+
+// TLSF rounds requests up to the next of its lists, so it may need up to 1/16 more than asked
+static const heap_policy tlsf_policy = {
+    .name = "tlsf", .init = tlsf_init, .alloc = fits_arena_alloc,
+    .free = fits_arena_free, .split = fits_arena_split, .trim = fits_arena_trim, .growth = 2, .medium_lists = 1,
+};
+
+// a buddy block may be twice as big as asked and have to start past a gap just as big; the
+// medium free lists' classes don't line up with its blocks
+static const heap_policy buddy_policy = {
+    .name = "buddy", .init = buddy_arena_init, .alloc = buddy_arena_alloc,
+    .alloc_aligned = buddy_arena_alloc_aligned, .free = buddy_arena_free, .trim = buddy_arena_trim,
+    .block_length = buddy_block_length, .growth = 4, .medium_lists = 0,
+};
+
+/** 
+ * @brief Allocate a block from the heap with the selected engine. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param size The minimum number of bytes to allocate (a nonzero multiple of 8).
+ * @return Returns a pointer to the data section of the new block, or NULL if \p size is more
+ * than the engine can ever serve.
+ */
+static inline void* heap_alloc(arena *a, size_t size)
+{
+    return policy->alloc(a, size);
+}
+
+/** 
+ * @brief Return a block to the heap with the selected engine. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param ptr A pointer to the data section of the block.
+ */
+static inline void heap_free(arena *a, void *ptr)
+{
+    policy->free(a, ptr);
+}
+
+/** 
+ * @brief Give the blocks other threads pushed to an arena back to its heap. The caller must hold
+ * the arena's lock.
+ */
+static void arena_drain(arena *a)
+{
+    if (__atomic_load_n(&a->incoming, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    void *ptr = __atomic_exchange_n(&a->incoming, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL)
+    {
+        void *next = *(void**)ptr;
+        heap_free(a, ptr);
+        ptr = next;
+    }
+}
+
+/** 
+ * @brief Free a chain of blocks of an arena that isn't the calling thread's without waiting for
+ * its lock: the chain is pushed to the arena's incoming blocks, and given back to the heap at
+ * once only if the lock is free.
+ * @param a The arena the blocks belong to.
+ * @param first The first block of the chain, whose blocks are linked through the first word of
+ * their data section.
+ * @param last The last block of the chain.
+ */
+static void arena_push(arena *a, void *first, void *last)
+{
+    void *head = __atomic_load_n(&a->incoming, __ATOMIC_RELAXED);
+    do
+        *(void**)last = head;
+    while (!__atomic_compare_exchange_n(&a->incoming, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    if (lock_try(&a->lock))
+    {
+        arena_drain(a);
+        lock_release(&a->lock);
+    }
+}
+
+/** 
+ * @brief Give back the unused tail of a data block to the heap. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param block The data block to shrink.
+ * @param size The number of bytes of the data section to keep (a multiple of 8).
+ */
+static void trim_block(arena *a, block_meta *block, size_t size)
+{
+    // only done if the tail can hold a block of its own
+    block_meta *tail = policy->split(a, block, size);
+    if (tail != NULL)
+        heap_free(a, tail + 1);
+}
+
+/** 
+ * @brief Allocate a block whose data section is aligned to \p alignment. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param alignment A power of two.
+ * @param size The minimum number of bytes to allocate (a nonzero multiple of 8).
+ * @return Returns a pointer to the data section of the new block.
+ */
+static void* heap_alloc_aligned(arena *a, size_t alignment, size_t size)
+{
+    if (policy->alloc_aligned != NULL)
+        return policy->alloc_aligned(a, alignment, size);
+
+    if (alignment <= 8)
+        return heap_alloc(a, size);
+
+    // over-allocate so there is room in front of the aligned block for a free block
+    char *data = heap_alloc(a, size + alignment + sizeof(block_meta) + 8);
+    if (data == NULL)
+        return NULL;
+    block_meta *block = (block_meta*)data - 1;
+
+    char *aligned = (char*)round_up_multof((size_t)data, alignment);
+    if (aligned != data)
+    {
+        // the leading gap must be able to hold a block of its own
+        while (aligned - data < sizeof(block_meta) + 8)
+            aligned += alignment;
+
+        // split off the leading gap as a data block and free it
+        block_meta *aligned_block = policy->split(a, block, aligned - data - sizeof(block_meta));
+        heap_free(a, data);
+
+        block = aligned_block;
+    }
+
+    trim_block(a, block, size);
+    return aligned;
+}
+
+/** 
+ * @brief Get the length of the data section of a block of at least \p size bytes that fills
+ * whole cache lines, header included.
+ */
+static inline size_t isolated_size(size_t size)
+{
+    return round_up_multof(size + sizeof(block_meta), CACHE_LINE) - sizeof(block_meta);
+}
+
+/** 
+ * @brief Check whether a block fills whole cache lines, header included.
+ * @param ptr A pointer to the data section of the block.
+ */
+static inline int is_isolated(void *ptr)
+{
+    block_meta *block = (block_meta*)ptr - 1;
+    return ((uintptr_t)block | (sizeof(block_meta) + block->length)) % CACHE_LINE == 0;
+}
+
+/** 
+ * @brief Allocate a block whose header starts a cache line and whose data section ends one,
+ * so that no other block has anything in the lines it touches. The caller must hold the arena's lock.
+ * @param a The arena.
+ * @param size The length of the data section (as given by isolated_size()).
+ * @return Returns a pointer to the data section of the new block, or NULL if the arena is full.
+ */
+static void* heap_alloc_isolated(arena *a, size_t size)
+{
+    // engines that can't split blocks (buddy) only make line aligned powers of two
+    if (policy->split == NULL)
+        return heap_alloc(a, size);
+
+    // over-allocate so that both the leading gap and the trailing tail can be split off as
+    // blocks of their own: the gap is either empty or up to CACHE_LINE + sizeof(block_meta) + 8
+    // bytes, and what is left after it still has room for a tail block
+    char *data = heap_alloc(a, size + CACHE_LINE + 2 * (sizeof(block_meta) + 8));
+    if (data == NULL)
+        return NULL;
+    block_meta *block = (block_meta*)data - 1;
+
+    block_meta *aligned_block = (block_meta*)round_up_multof((size_t)block, CACHE_LINE);
+    if (aligned_block != block)
+    {
+        // the leading gap must be able to hold a block of its own
+        while ((char*)aligned_block - (char*)block < sizeof(block_meta) + 8)
+            aligned_block = (block_meta*)((char*)aligned_block + CACHE_LINE);
+
+        // split off the leading gap as a data block and free it
+        policy->split(a, block, (char*)aligned_block - data);
+        heap_free(a, data);
+
+        block = aligned_block;
+    }
+
+    trim_block(a, block, size);
+    return block + 1;
+}
+
+/** 
+ * @brief Get the arena a block belongs to. Arenas other than the main one are aligned to
+ * ARENA_SIZE, so the arena of a block outside the main heap is found by rounding its address down.
+ * @param ptr A pointer to the data section of the block.
+ */
+static inline arena* arena_of(void *ptr)
+{
+    if (ptr >= main_arena.start_brk && ptr < __atomic_load_n(&main_arena.end_brk, __ATOMIC_RELAXED))
+        return &main_arena;
+    return (arena*)((uintptr_t)ptr & ~(uintptr_t)(ARENA_SIZE - 1));
+}
+
+/** 
+ * @brief Check whether an arena can serve a request without running out of its reserved range.
+ * With COMPRESSED_LINKS, the main arena can't grow past LINK_SPAN bytes either.
+ * @param a The arena.
+ * @param bytes The number of bytes needed including block metadata.
+ */
+static inline int arena_has_room(arena *a, size_t bytes)
+{
+    if (bytes > REQUEST_MAX / policy->growth)
+        return 0;
+    bytes *= policy->growth;
+
+    // heap_alloc() may grow the heap twice by up to HEAP_GROWTH_INCREMENT pages more than asked
+    bytes += 2 * HEAP_GROWTH_INCREMENT * page_size;
+    if (a->limit == NULL)
+    {
+#ifdef COMPRESSED_LINKS
+        return (size_t)((char*)a->end_brk - (char*)a->start_brk) + bytes <= LINK_SPAN;
+#else
+        return 1;
+#endif
+    }
+    return (size_t)((char*)a->limit - (char*)a->end_brk) >= bytes;
+}
+
+/** 
+ * @brief Create a new arena in an mmap()ed range of ARENA_SIZE bytes. The caller must hold arenas_lock.
+ * @param node The NUMA node to place its pages on.
+ * @return Returns the new arena, or NULL if the range could not be mapped.
+ */
+static arena* arena_create(unsigned int node)
+{
+    // map twice the size to be able to cut out an aligned range; pages are only used once touched
+    char *region = mmap(NULL, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+        return NULL;
+
+    char *base = (char*)round_up_multof((size_t)region, ARENA_SIZE);
+    if (base != region)
+        munmap(region, base - region);
+    munmap(base + ARENA_SIZE, region + ARENA_SIZE - base);
+    numa_bind(base, ARENA_SIZE, node);
+
+    // the arena structure lives in the first pages, the heap follows it
+    arena *a = (arena*)base;
+    char *heap = base + round_up_multof(sizeof(arena), page_size);
+    malloc_lock unlocked = MALLOC_LOCK_INITIALIZER;
+    a->lock = unlocked;
+    a->limit = base + ARENA_SIZE;
+    a->id = num_arenas;
+    a->node = node;
+    init_arena(a, heap, heap + page_size * HEAP_GROWTH_INCREMENT);
+
+    arenas[num_arenas++] = a;
+    return a;
+}
+
+/** 
+ * @brief Get the start of the mapping of a block with a mapping of its own: the headers are only
+ * at the start of the mapping if the block needed no more than 8-byte alignment.
+ */
+static inline char* mapping_start(mapping_meta *m)
+{
+    return (char*)((uintptr_t)m / page_size * page_size);
+}
+
+/** 
+ * @brief Take a shared mapping off the list of shared mappings. The caller holds mappings_lock.
+ */
+static void mapping_unlink(mapping_meta *m)
+{
+    if (m->prev != NULL)
+        m->prev->next = m->next;
+    else
+        shared_mappings = m->next;
+    if (m->next != NULL)
+        m->next->prev = m->prev;
+}
+
+/** 
+ * @brief Turn a shared mapping of a memfd into a private copy-on-write one of the same memfd,
+ * whose pages then never change again: from now on, writes to the block go to pages of its own.
+ * Nothing is copied, and the block's contents stay the same. The caller holds mappings_lock.
+ * @return Returns 1 on success, 0 if the mapping is left shared.
+ */
+static int mapping_freeze(mapping_meta *m)
+{
+    if (mmap(mapping_start(m), m->length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, m->fd, 0) == MAP_FAILED)
+        return 0;
+    mapping_unlink(m);
+    m->shared = 0;
+    return 1;
+}
+
+/** 
+ * @brief Take every allocator lock before fork(), so that no other thread is in the middle of
+ * changing the heap when the child is created. The arenas list lock comes first, then the arena
+ * locks by index, then the locks of the caches, the tiny slots, the page heap and the mappings.
+ * Blocks with a shared mapping of a memfd are made private, or the parent and the child would
+ * see each other's writes to them.
+ */
+static void fork_prepare()
+{
+    mapping_meta *m, *next;
+    size_t i;
+
+    lock_acquire(&arenas_lock);
+    for (i = 0; i < num_arenas; ++i)
+        lock_acquire(&arenas[i]->lock);
+    cache_fork_prepare();
+    tiny_fork_prepare();
+    page_fork_prepare();
+    lock_acquire(&mappings_lock);
+    for (m = shared_mappings; m != NULL; m = next)
+    {
+        next = m->next;
+        mapping_freeze(m);
+    }
+}
+
+/** 
+ * @brief Release the locks taken by fork_prepare() in the parent after fork().
+ */
+static void fork_parent()
+{
+    size_t i;
+
+    lock_release(&mappings_lock);
+    page_fork_parent();
+    tiny_fork_parent();
+    cache_fork_parent();
+    for (i = num_arenas; i-- > 0;)
+        lock_release(&arenas[i]->lock);
+    lock_release(&arenas_lock);
+}
+
+/** 
+ * @brief Reset the allocator in the child after fork(). The locks are reinitialized rather than
+ * released since the threads holding them don't exist in the child, and only the thread that
+ * called fork() is left assigned to an arena. The heap itself is kept as it is.
+ */
+static void fork_child()
+{
+    malloc_lock unlocked = MALLOC_LOCK_INITIALIZER;
+    size_t i;
+
+    // covers the locks of the caches, the tiny slots and the page heap too
+    lock_fork_child();
+
+    arenas_lock = unlocked;
+    mappings_lock = unlocked;
+    for (i = 0; i < num_arenas; ++i)
+    {
+        arenas[i]->lock = unlocked;
+        arenas[i]->threads = 0;
+        arenas[i]->pressure = 0;
+    }
+    if (thread_arena != NULL)
+        thread_arena->threads = 1;
+    window_acquisitions = window_failures = 0;
+
+    cache_fork_child();
+    tiny_fork_child();
+    page_fork_child();
+}
+
+/** 
+ * @brief Assign the calling thread to the arena with the fewest threads among those of the NUMA
+ * node it runs on, creating the node's first arena if needed, initializing the heap if this is
+ * the first allocation.
+ * @return Returns the arena.
+ */
+static arena* arena_attach()
+{
+    size_t i;
+
+    int first = 0;
+
+    lock_acquire(&arenas_lock);
+
+    if (!initialized)
+    {
+        initialized = first = 1;
+        init_heap();
+    }
+
+    unsigned int node = numa_node();
+    arena *a = NULL;
+    for (i = 0; i < num_arenas; ++i)
+        if (arenas[i]->node == node && (a == NULL || arenas[i]->threads < a->threads))
+            a = arenas[i];
+    if (a == NULL && num_arenas < arena_limit)
+        a = arena_create(node);
+
+    // the main arena is left if a node's arena can't be had
+    if (a == NULL)
+        a = &main_arena;
+    a->threads++;
+
+    lock_release(&arenas_lock);
+
+    thread_arena = a;
+    pthread_setspecific(arena_key, a);
+
+    // pthread_atfork() may allocate, so it can only be called once the thread has an arena
+    if (first)
+        pthread_atfork(fork_prepare, fork_parent, fork_child);
+
+    return a;
+}
+
+/** 
+ * @brief Move the calling thread away from an arena it found contended: to a quiet arena if
+ * there is one, else to a new arena if the limit allows it, else to the least contended arena
+ * if that is better than the current one. Threads stay on arenas of the NUMA node they were on.
+ * @param a The current arena of the thread.
+ * @param failures The number of failed lock_try() calls in the thread's last window.
+ * @return Returns the new arena of the thread (which may be \p a).
+ */
+static arena* arena_migrate(arena *a, unsigned int failures)
+{
+    arena *best = NULL;
+    size_t i;
+
+    lock_acquire(&arenas_lock);
+
+    a->pressure = failures;
+    for (i = 0; i < num_arenas; ++i)
+    {
+        arena *other = arenas[i];
+        if (other != a && other->node == a->node && (best == NULL || other->pressure < best->pressure ||
+                           (other->pressure == best->pressure && other->threads < best->threads)))
+            best = other;
+    }
+
+    if ((best == NULL || best->pressure >= ARENA_MIGRATE_FAILURES / 2) && num_arenas < arena_limit)
+    {
+        arena *created = arena_create(a->node);
+        if (created != NULL)
+            best = created;
+    }
+
+    if (best != NULL && best->pressure < failures)
+    {
+        arena_detach(a);
+        best->threads++;
+        arena_migrations++;
+        a = best;
+    }
+
+    lock_release(&arenas_lock);
+
+    thread_arena = a;
+    pthread_setspecific(arena_key, a);
+    return a;
+}
+
+/** 
+ * @brief Lock the calling thread's arena. Every ARENA_WINDOW calls, a thread that found the
+ * lock taken too often moves to another arena first.
+ * @return Returns the locked arena.
+ */
+static arena* arena_lock()
+{
+    arena *a = thread_arena;
+
+    if (a == NULL)
+        a = arena_attach();
+    else if (++window_acquisitions == ARENA_WINDOW)
+    {
+        if (window_failures >= ARENA_MIGRATE_FAILURES)
+            a = arena_migrate(a, window_failures);
+        else
+            __atomic_store_n(&a->pressure, window_failures, __ATOMIC_RELAXED);
+        window_acquisitions = window_failures = 0;
+    }
+
+    if (!lock_try(&a->lock))
+    {
+        window_failures++;
+        lock_acquire(&a->lock);
+        a->contention++;
+    }
+    a->acquisitions++;
+    arena_drain(a);
+
+    return a;
+}
+
+/** 
+ * @brief Lock an arena that can serve a request: the calling thread's arena, or the main arena
+ * if the thread's arena has run out of address range. With COMPRESSED_LINKS the main arena can
+ * run out too, and the request goes to the first arena with room, a new one if needed: a heap
+ * bigger than LINK_SPAN is served as segments of ARENA_SIZE bytes.
+ * @param bytes The number of bytes needed including block metadata.
+ * @return Returns the locked arena, or NULL if there is none with room and no more can be created.
+ */
+static arena* arena_lock_for(size_t bytes)
+{
+    arena *a = arena_lock();
+    if (arena_has_room(a, bytes))
+        return a;
+
+    lock_release(&a->lock);
+    lock_acquire(&main_arena.lock);
+    arena_drain(&main_arena);
+#ifndef COMPRESSED_LINKS
+    return &main_arena;
+#else
+    if (arena_has_room(&main_arena, bytes))
+        return &main_arena;
+    lock_release(&main_arena.lock);
+
+    // the segments don't count towards arena_limit, which only spreads the threads
+    size_t i;
+    lock_acquire(&arenas_lock);
+    for (i = 1; i < num_arenas; ++i)
+    {
+        a = arenas[i];
+        lock_acquire(&a->lock);
+        if (arena_has_room(a, bytes))
+            break;
+        lock_release(&a->lock);
+    }
+    if (i == num_arenas)
+    {
+        a = num_arenas < MAX_ARENAS ? arena_create(heap_thread_node()) : NULL;
+        if (a != NULL)
+        {
+            lock_acquire(&a->lock);
+            if (!arena_has_room(a, bytes))
+            {
+                lock_release(&a->lock);
+                a = NULL;
+            }
+        }
+    }
+    lock_release(&arenas_lock);
+    return a;
+#endif
+}
+
+/** 
+ * @brief Allocate several blocks of the same size with a single acquisition of an arena lock.
+ * @param size The number of bytes in each block (a nonzero multiple of 8).
+ * @param ptrs Array receiving the data pointers of the new blocks.
+ * @param n The number of blocks wanted.
+ * @return Returns the number of blocks allocated.
+ */
+size_t heap_alloc_batch(size_t size, void **ptrs, size_t n)
+{
+    size_t i;
+
+    if (isolate_lines && size <= SMALL_MAX)
+    {
+        arena *a = arena_lock_for(n * (size + CACHE_LINE + 3 * sizeof(block_meta) + 16));
+        if (a == NULL)
+            return 0;
+        // stops at the first block the arena has no room for
+        for (i = 0; i < n && (ptrs[i] = heap_alloc_isolated(a, size)) != NULL; ++i)
+            ;
+        lock_release(&a->lock);
+        return i;
+    }
+
+    arena *a = arena_lock_for(n * (size + sizeof(block_meta)));
+    if (a == NULL)
+        return 0;
+    for (i = 0; i < n && (ptrs[i] = heap_alloc(a, size)) != NULL; ++i)
+        ;
+    lock_release(&a->lock);
+
+    return i;
+}
+
+/** 
+ * @brief Return several blocks to the heap, taking the lock of each arena involved once.
+ * The blocks are freed from the highest address down so that neighbours in the batch merge
+ * with each other instead of each one walking the free list for its position. Blocks of other
+ * arenas than the calling thread's are pushed to them as one chain per arena (see arena_push()).
+ * @param ptrs Array of data pointers of the blocks (reordered by this function).
+ * @param n The number of blocks.
+ */
+void heap_free_batch(void **ptrs, size_t n)
+{
+    size_t i, j;
+
+    // insertion sort by decreasing address; batches are small
+    for (i = 1; i < n; ++i)
+    {
+        void *ptr = ptrs[i];
+        for (j = i; j > 0 && ptrs[j - 1] < ptr; --j)
+            ptrs[j] = ptrs[j - 1];
+        ptrs[j] = ptr;
+    }
+
+    // blocks of the same arena are next to each other after sorting
+    for (i = 0; i < n; i = j)
+    {
+        arena *a = arena_of(ptrs[i]);
+
+        if (a != thread_arena)
+        {
+            for (j = i + 1; j < n && arena_of(ptrs[j]) == a; ++j)
+                *(void**)ptrs[j - 1] = ptrs[j];
+            arena_push(a, ptrs[i], ptrs[j - 1]);
+            continue;
+        }
+
+        lock_acquire(&a->lock);
+        for (j = i; j < n && arena_of(ptrs[j]) == a; ++j)
+            heap_free(a, ptrs[j]);
+        arena_drain(a);
+        lock_release(&a->lock);
+    }
+}
+
+/** 
+ * @brief Get the NUMA node of the calling thread's arena, which is the node whose memory the
+ * thread is given and may cache.
+ * @return Returns the node, 0 if the thread has no arena.
+ */
+unsigned int heap_thread_node()
+{
+    return thread_arena != NULL ? thread_arena->node : 0;
+}
+
+/** 
+ * @brief Get the NUMA node of a block's arena.
+ * @param ptr A pointer to the data section of a block of an arena.
+ */
+unsigned int heap_block_node(void *ptr)
+{
+    return arena_of(ptr)->node;
+}
+
+/** 
+ * @brief Get the header of the mapping of a block with a mapping of its own.
+ */
+static inline mapping_meta* mapping_of(void *ptr)
+{
+    return (mapping_meta*)((block_meta*)ptr - 1) - 1;
+}
+
+/** 
+ * @brief Allocate a large block in a mapping of its own, which free() unmaps so that the memory
+ * goes straight back to the system instead of staying in an arena. With BAGNALLOC_CLONE set, the
+ * mapping is a shared one of a memfd of its own, which bagnalloc_clone() can map again. Blocks
+ * aligned to more than 8 bytes are carved out of a larger anonymous range, whose ends are unmapped.
+ * @param alignment A power of two no larger than REQUEST_MAX.
+ * @param size The number of bytes to allocate (a multiple of 8 no larger than REQUEST_MAX).
+ * @return Returns a pointer to the allocated memory, or NULL if the mapping failed.
+ */
+static void* mmap_alloc(size_t alignment, size_t size)
+{
+    size_t headers = sizeof(mapping_meta) + sizeof(block_meta);
+    size_t reserved = round_up_multof(size + headers + (alignment > 8 ? alignment : 0), page_size);
+    int fd = -1;
+
+    char *base = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    // the block goes at the first aligned address past the headers, the pages around it go back
+    char *data = (char*)round_up_multof((uintptr_t)base + headers, alignment);
+    mapping_meta *m = mapping_of(data);
+    char *start = mapping_start(m);
+    char *end = (char*)round_up_multof((uintptr_t)data + size, page_size);
+    size_t length = end - start;
+    if (start > base)
+        munmap(base, start - base);
+    if (end < base + reserved)
+        munmap(end, base + reserved - end);
+
+    // the anonymous pages stay if the memfd can't be had
+    if (clone_backing && (fd = memfd_create("bagnalloc", MFD_CLOEXEC)) >= 0 &&
+        (ftruncate(fd, length) || mmap(start, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
+    {
+        close(fd);
+        fd = -1;
+        // a failed MAP_FIXED may have unmapped the range already
+        if (mmap(start, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+            return NULL;
+    }
+
+    m->length = length;
+    m->fd = fd;
+    m->shared = fd >= 0;
+    if (m->shared)
+    {
+        lock_acquire(&mappings_lock);
+        m->prev = NULL;
+        m->next = shared_mappings;
+        if (shared_mappings != NULL)
+            shared_mappings->prev = m;
+        shared_mappings = m;
+        lock_release(&mappings_lock);
+    }
+
+    block_meta *block = (block_meta*)(m + 1);
+    block->length = end - data;
+    block->prev = block->next = link_make(NULL, NULL);
+    block->tag = MMAP_TAG;
+    return data;
+}
+
+/** 
+ * @brief Unmap a block with a mapping of its own, closing its memfd if it has one.
+ */
+static void mmap_free(void *ptr)
+{
+    mapping_meta *m = mapping_of(ptr);
+    int fd = m->fd;
+
+    if (fd >= 0)
+    {
+        lock_acquire(&mappings_lock);
+        if (m->shared)
+            mapping_unlink(m);
+        lock_release(&mappings_lock);
+    }
+
+    munmap(mapping_start(m), m->length);
+    if (fd >= 0)
+        close(fd);
+}
+
+/** 
+ * @brief Allocate a small block that shares no cache line with any other block, so that
+ * threads writing to blocks next to each other don't slow each other down (false sharing).
+ * The request is padded out to whole cache lines, header included. Padded sizes that are
+ * too big for the front-end caches skip the medium free lists, whose blocks aren't padded.
+ * @param size The number of bytes to allocate (a nonzero multiple of 8 no larger than SMALL_MAX).
+ * @return Returns a pointer to the allocated memory.
+ */
+static void* isolated_malloc(size_t size)
+{
+    size = isolated_size(size);
+
+    if (size <= SMALL_MAX)
+    {
+        void *ptr = cache_alloc(size);
+        if (ptr != NULL)
+            return ptr;
+    }
+
+    arena *a = arena_lock_for(size + CACHE_LINE + 3 * sizeof(block_meta) + 16);
+    if (a == NULL)
+        return NULL;
+    void *ptr = heap_alloc_isolated(a, size);
+    lock_release(&a->lock);
+
+    return ptr;
+}
+
+/** 
+ * @brief Allocate memory for use by a program.
+ * @param size The minimum number of bytes to allocate.
+ * @return Returns a pointer to the allocated memory.
+ */
+void* malloc(size_t size)
+{
+    // sizes near SIZE_MAX would wrap around to small ones once rounded up
+    if (!size || size > REQUEST_MAX)
+        return NULL;
+
+    size = round_up_multof(size, 8);
+
+    // the heap must be set up to have read the environment
+    if (thread_arena == NULL)
+        arena_attach();
+
+    // tiny sizes get a slot without a header if BAGNALLOC_TINY is set
+    if (size <= TINY_MAX)
+    {
+        void *ptr = tiny_alloc(size);
+        if (ptr != NULL)
+            return ptr;
+    }
+
+    // ask for the whole block (buddy) so that the caches see the blocks' own size classes
+    if (policy->block_length != NULL)
+        size = policy->block_length(size);
+
+    // large sizes get a span of the page heap if it is on, or else a mapping of their own
+    if (mmap_threshold && size >= mmap_threshold)
+    {
+        void *ptr = page_alloc((size + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE, PAGE_LARGE);
+        return ptr != NULL ? ptr : mmap_alloc(8, size);
+    }
+
+    // small sizes are served by the front-end cache if one is enabled
+    if (size <= SMALL_MAX)
+    {
+        if (isolate_lines)
+            return isolated_malloc(size);
+
+        void *ptr = cache_alloc(size);
+        if (ptr != NULL)
+            return ptr;
+    }
+    // and medium sizes by the central free lists, if their classes line up with the blocks
+    else if (size <= MEDIUM_MAX && policy->medium_lists)
+    {
+        void *ptr = medium_alloc(size);
+        if (ptr != NULL)
+            return ptr;
+    }
+
+    arena *a = arena_lock_for(size + sizeof(block_meta));
+    if (a == NULL)
+        return NULL;
+    void *ptr = heap_alloc(a, size);
+    lock_release(&a->lock);
+
+    return ptr;
+}
+
+/** 
+ * @brief Deallocate memory that has been allocated by malloc().
+ * @param ptr A pointer to the allocated memory.
+ */
+void free(void *ptr)
+{
+    if (ptr == NULL || tiny_free(ptr))
+        return;
+
+    if (page_kind(ptr) == PAGE_LARGE)
+    {
+        page_free(ptr);
+        return;
+    }
+
+    // length field of ptr's data block
+    size_t length = ((block_meta*)ptr - 1)->length;
+
+    if (((block_meta*)ptr - 1)->tag == MMAP_TAG)
+    {
+        mmap_free(ptr);
+        return;
+    }
+
+    arena *a = arena_of(ptr);
+
+    // blocks of another NUMA node go home rather than into the caches of this one
+    if (numa_nodes > 1 && (thread_arena == NULL || a->node != thread_arena->node))
+    {
+        __atomic_fetch_add(&remote_frees, 1, __ATOMIC_RELAXED);
+        arena_push(a, ptr, ptr);
+        return;
+    }
+
+    // blocks that don't fill their cache lines (e.g. from memalign()) must not be cached in
+    // place of padded ones
+    if (length <= SMALL_MAX ? (!isolate_lines || is_isolated(ptr)) && cache_free(ptr, length)
+                            : length <= MEDIUM_MAX && policy->medium_lists && medium_free(ptr, length))
+        return;
+
+    // a block of another arena doesn't wait for its lock
+    if (a != thread_arena)
+    {
+        arena_push(a, ptr, ptr);
+        return;
+    }
+
+    lock_acquire(&a->lock);
+    heap_free(a, ptr);
+    arena_drain(a);
+    lock_release(&a->lock);
+}
+
+/** 
+ * @brief Allocate memory whose address is a multiple of \p alignment. Large requests and those
+ * aligned to more than a page take the same path as large ones of malloc(): a span of the page
+ * heap if the alignment allows it, or else a mapping of their own.
+ * @param alignment A power of two, or 0 (taken as 8 like any alignment below 8).
+ * @param size The minimum number of bytes to allocate.
+ * @return Returns a pointer to the allocated memory, or NULL if \p size is 0 or there isn't
+ * enough memory.
+ */
+static void* aligned_malloc(size_t alignment, size_t size)
+{
+    if (!size || size > REQUEST_MAX || alignment > REQUEST_MAX)
+        return NULL;
+
+    // every block is 8-byte aligned anyway, and an alignment of 0 would divide by zero
+    if (alignment < 8)
+        alignment = 8;
+    size = round_up_multof(size, 8);
+
+    // the heap must be set up to have read the environment
+    if (thread_arena == NULL)
+        arena_attach();
+
+    if ((mmap_threshold && size >= mmap_threshold) || alignment > page_size)
+    {
+        void *ptr = alignment <= HEAP_PAGE_SIZE ? page_alloc((size + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE, PAGE_LARGE) : NULL;
+        return ptr != NULL ? ptr : mmap_alloc(alignment, size);
+    }
+
+    arena *a = arena_lock_for(size + alignment + 2 * sizeof(block_meta) + 8);
+    if (a == NULL)
+        return NULL;
+    void *ptr = heap_alloc_aligned(a, alignment, size);
+    lock_release(&a->lock);
+
+    return ptr;
+}
+
+/** 
+ * @brief Allocates \p size bytes aligned to \p alignment and stores the address in \p memptr.
+ * @param memptr Location receiving the pointer to the allocated memory.
+ * @param alignment A power of two multiple of sizeof(void*).
+ * @param size The minimum number of bytes to allocate.
+ * @return Returns 0 on success, EINVAL if \p alignment is not valid or ENOMEM if there isn't
+ * enough memory, in which case \p memptr is left alone.
+ * @note libgomp and libstdc++ allocate through this family of functions, so they have to be
+ * provided here or glibc's allocator would start moving the program break behind our back.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (!alignment || alignment % sizeof(void*) || (alignment & (alignment - 1)))
+        return EINVAL;
+
+    void *ptr = aligned_malloc(alignment, size);
+    if (ptr == NULL && size)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+/** 
+ * @brief Allocates \p size bytes aligned to \p alignment.
+ * @param alignment A power of two.
+ * @param size The minimum number of bytes to allocate.
+ * @return Returns a pointer to the allocated memory.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment & (alignment - 1))
+        return NULL;
+
+    return aligned_malloc(alignment, size);
+}
+
+/** 
+ * @brief Obsolete equivalent of aligned_alloc(). Like glibc's, it takes any alignment: one that
+ * isn't a power of two is rounded up to the next one.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    if (alignment > REQUEST_MAX)
+        return NULL;
+
+    // clear all but the highest bit, then move on to the next power of two
+    if (alignment & (alignment - 1))
+    {
+        while (alignment & (alignment - 1))
+            alignment &= alignment - 1;
+        alignment <<= 1;
+    }
+
+    return aligned_malloc(alignment, size);
+}
+
+/** 
+ * @brief Obsolete equivalent of aligned_alloc() with the page size as the alignment.
+ */
+void *valloc(size_t size)
+{
+    return aligned_malloc(sysconf(_SC_PAGESIZE), size);
+}
+
+/** 
+ * @brief Obsolete equivalent of valloc() that also rounds \p size up to a multiple of the page size.
+ */
+void *pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > REQUEST_MAX)
+        return NULL;
+    return aligned_malloc(page, round_up_multof(size, page));
+}
+
+/** 
+ * @brief Get the number of bytes that can actually be used in a block returned by malloc().
+ * @param ptr A pointer to the allocated memory.
+ * @return Returns the length of the data section of the block, or 0 if \p ptr is NULL.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+
+    size_t length = tiny_length(ptr);
+    if (length)
+        return length;
+
+    if (page_kind(ptr) == PAGE_LARGE)
+        return page_length(ptr);
+
+    return ((block_meta*)ptr - 1)->length;
+}
+
+/** 
+ * @brief Allocates memory for an array of \p nmemb elements and zero-initializes the allocated memory.
+ * @param nmemb The number of array elements.
+ * @param size The size of each array element.
+ * @return Returns a pointer to the allocated memory. If \p nmemb or \p size is 0, or if
+ * \p nmemb * \p size overflows or there isn't enough memory, NULL is returned.
+ */
+void *calloc(size_t nmemb, size_t size)
+{
+    size_t real_size;
+
+    if (__builtin_mul_overflow(nmemb, size, &real_size) || !real_size)
+        return NULL;
+        
+    //lock_acquire(&mutex);
+
+    void * volatile ptr = malloc(real_size);
+
+    if (ptr != NULL)
+        memset(ptr, 0, real_size);
+    
+    //lock_release(&mutex);
+
+    return ptr;
+}
+
+// not sure if extra mutex is required in realloc
+/** 
+ * @brief Changes the size of the memory block pointed to by \p ptr.
+ * @param ptr A pointer to memory allocated by malloc().
+ * @param size The new data size.
+ * @return Returns a pointer to the resized block. It is guaranteed to be different from the original pointer.
+ * If there isn't enough memory, NULL is returned and \p ptr is left as it was.
+ * @note If \p ptr is NULL, this function is equivalent to malloc()
+ * @note If \p ptr is not NULL and \p size is 0, this function is equivalent to free()
+ */
+void *realloc(void *ptr, size_t size)
+{
+    if (size > REQUEST_MAX)
+        return NULL;
+
+    size = round_up_multof(size, 8);
+    
+    // if ptr is NULL, equivalent to malloc(size)
+    if (ptr == NULL)
+        return malloc(size);
+
+    // if ptr not NULL and size is 0, equivalent to free(ptr)
+    if (!size)
+    {
+        free(ptr);
+        return NULL;
+    }
+    
+    //lock_acquire(&mutex);
+
+    void * volatile new_ptr = malloc(size);
+    if (new_ptr == NULL)
+        return NULL;
+    
+    // length of ptr's data block
+    size_t old_size = malloc_usable_size(ptr);
+    size_t new_size = size;
+
+    size_t min_size = old_size < new_size ? old_size : new_size; // min
+
+    memcpy(new_ptr, ptr, min_size);
+
+    free(ptr);
+    
+    //lock_release(&mutex);
+
+    return new_ptr;
+}
+
+/** 
+ * @brief Clone a block the usual way: allocate another one and copy the data over.
+ */
+static void* clone_copy(void *ptr)
+{
+    size_t length = malloc_usable_size(ptr);
+    void *clone = malloc(length);
+
+    if (clone != NULL)
+    {
+        memcpy(clone, ptr, length);
+        __atomic_fetch_add(&clone_copied, length, __ATOMIC_RELAXED);
+    }
+    return clone;
+}
+
+/** 
+ * @brief Move an anonymous mapping into a new memfd, which then replaces it as a private
+ * copy-on-write mapping (see mapping_freeze()). The only time a clone copies a whole block.
+ * Writes to the block by other threads while it is moved may be lost. The caller holds
+ * mappings_lock.
+ * @return Returns 1 on success, 0 if the mapping is left anonymous.
+ */
+static int mapping_to_memfd(mapping_meta *m)
+{
+    size_t length = m->length, done = 0;
+    char *start = mapping_start(m);
+    ssize_t n = 0;
+
+    int fd = memfd_create("bagnalloc", MFD_CLOEXEC);
+    if (fd < 0)
+        return 0;
+    if (!ftruncate(fd, length))
+        while (done < length && (n = pwrite(fd, start + done, length - done, done)) > 0)
+            done += n;
+    if (done < length || mmap(start, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        close(fd);
+        return 0;
+    }
+
+    m->fd = fd;
+    __atomic_fetch_add(&clone_copied, length, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/** 
+ * @brief Copy the pages of a frozen mapping that were written since it was frozen (and so no
+ * longer are the memfd's) to another private mapping of the same memfd. The pages are told
+ * apart by their /proc/self/pagemap entries: written ones are anonymous, in memory or in swap.
+ * If the entries can't be read, every page is copied.
+ * @param from The start of the frozen mapping.
+ * @param to The start of the other mapping.
+ * @param length The number of bytes in both mappings.
+ * @return Returns the number of bytes copied.
+ */
+static size_t copy_written_pages(char *from, char *to, size_t length)
+{
+    uint64_t entries[PAGEMAP_BATCH];
+    size_t pages = length / page_size, copied = 0, first, i;
+
+    int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    for (first = 0; first < pages; first += PAGEMAP_BATCH)
+    {
+        size_t n = MIN(PAGEMAP_BATCH, pages - first);
+        off_t offset = ((uintptr_t)from / page_size + first) * sizeof(uint64_t);
+
+        if (fd < 0 || pread(fd, entries, n * sizeof(uint64_t), offset) != (ssize_t)(n * sizeof(uint64_t)))
+            for (i = 0; i < n; ++i)
+                entries[i] = PAGEMAP_SWAPPED;
+
+        for (i = 0; i < n; ++i)
+            if ((entries[i] & PAGEMAP_SWAPPED) || (entries[i] & (PAGEMAP_PRESENT | PAGEMAP_FILE)) == PAGEMAP_PRESENT)
+            {
+                memcpy(to + (first + i) * page_size, from + (first + i) * page_size, page_size);
+                copied += page_size;
+            }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    __atomic_fetch_add(&clone_copied, copied, __ATOMIC_RELAXED);
+    return copied;
+}
+
+/** 
+ * @brief Make a copy of a block, cheaply if it has a mapping of its own. Such a block is put in a
+ * memfd if it isn't already (BAGNALLOC_CLONE puts them there when they are allocated, otherwise
+ * its first clone copies it there once), and both the block and the clone become private
+ * copy-on-write mappings of the memfd: the clone costs page tables, and pages are only copied
+ * when either of them writes to them. Pages the block wrote to since it was last cloned are
+ * copied. Other blocks are copied the usual way.
+ * @param ptr A pointer to memory allocated by malloc(). It must not be written while it is cloned.
+ * @return Returns a pointer to the clone, to be freed with free(), or NULL if \p ptr is NULL or
+ * there isn't enough memory.
+ */
+void* bagnalloc_clone(void *ptr)
+{
+    if (ptr == NULL)
+        return NULL;
+    if (tiny_length(ptr) || page_kind(ptr) == PAGE_LARGE || ((block_meta*)ptr - 1)->tag != MMAP_TAG)
+        return clone_copy(ptr);
+
+    mapping_meta *m = mapping_of(ptr);
+    lock_acquire(&mappings_lock);
+    int frozen = m->fd < 0 ? mapping_to_memfd(m) : !m->shared || mapping_freeze(m);
+    lock_release(&mappings_lock);
+    if (!frozen)
+        return clone_copy(ptr);
+
+    // the clone holds a descriptor of its own, closed when it is freed
+    int fd = fcntl(m->fd, F_DUPFD_CLOEXEC, 0);
+    char *map = fd < 0 ? MAP_FAILED : mmap(NULL, m->length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        if (fd >= 0)
+            close(fd);
+        return clone_copy(ptr);
+    }
+
+    // the clone's headers are as far into its mapping as the block's are into the block's
+    copy_written_pages(mapping_start(m), map, m->length);
+    mapping_meta *clone = (mapping_meta*)(map + ((char*)m - mapping_start(m)));
+    clone->length = m->length;
+    clone->fd = fd;
+    clone->shared = 0;
+    clone->prev = clone->next = NULL;
+    __atomic_fetch_add(&clones, 1, __ATOMIC_RELAXED);
+
+    return (block_meta*)(clone + 1) + 1;
+}
+
+/** 
+ * @brief Fault in the pages of an address range that the caller owns, writable. Asks the kernel
+ * to do it with MADV_POPULATE_WRITE, or else touches every page itself.
+ * @return Returns the number of bytes in the pages faulted in.
+ */
+static size_t prefault(void *start, size_t length)
+{
+    char *first = (char*)round_up_multof((uintptr_t)start, page_size);
+    char *last = (char*)(((uintptr_t)start + length) / page_size * page_size);
+    char *page;
+
+    if (last <= first)
+        return 0;
+    if (madvise(first, last - first, MADV_POPULATE_WRITE))
+        for (page = first; page < last; page += page_size)
+            *(volatile char*)page = 0;
+    return last - first;
+}
+
+/** 
+ * @brief Grow the heap of the calling thread's arena ahead of time, so that the first requests
+ * don't each have to grow it. The heap is grown by allocating a block of \p bytes from it and
+ * freeing it again, which works the same with every engine and leaves a free block that later
+ * requests are split off. With BAGNALLOC_RESERVE_POPULATE, the pages of the block are faulted
+ * in before it is freed, so that the first requests don't fault either.
+ * @param bytes The number of bytes to reserve; 0 does nothing.
+ * @param flags 0 or BAGNALLOC_RESERVE_POPULATE.
+ * @return Returns 0 on success, -1 if the heap couldn't be grown by that much.
+ */
+int bagnalloc_reserve(size_t bytes, int flags)
+{
+    if (!bytes)
+        return 0;
+    // sizes near SIZE_MAX would wrap around to small ones once rounded up
+    if (bytes > REQUEST_MAX)
+        return -1;
+    bytes = round_up_multof(bytes, 8);
+
+    if (thread_arena == NULL)
+        arena_attach();
+
+    arena *a = arena_lock_for(bytes + sizeof(block_meta));
+    if (a == NULL)
+        return -1;
+    void *ptr = heap_alloc(a, bytes);
+    lock_release(&a->lock);
+    if (ptr == NULL)
+        return -1;
+
+    // the block is the caller's until it is freed, so it is faulted in without the lock
+    if (flags & BAGNALLOC_RESERVE_POPULATE)
+        __atomic_fetch_add(&prefaulted, prefault(ptr, bytes), __ATOMIC_RELAXED);
+    __atomic_fetch_add(&reserved, bytes, __ATOMIC_RELAXED);
+
+    lock_acquire(&a->lock);
+    heap_free(a, ptr);
+    lock_release(&a->lock);
+    return 0;
+}
+
+/** 
+ * @brief Fill the front-end caches (BAGNALLOC_CACHE) of the calling thread with blocks of a size
+ * class, by allocating \p count blocks of \p size bytes and freeing them all. The caches keep
+ * what they have room for (the rest goes to the transfer caches or the heap), and the blocks
+ * were written to, so their pages are faulted in.
+ * @param size The size of the blocks.
+ * @param count The number of blocks.
+ * @return Returns the number of blocks allocated and freed.
+ */
+size_t bagnalloc_reserve_cache(size_t size, size_t count)
+{
+    void *blocks = NULL, *next;
+    size_t n;
+
+    // the blocks are linked through their first word, there's room for one in any of them
+    for (n = 0; n < count; ++n)
+    {
+        void **ptr = malloc(MAX(size, sizeof(void*)));
+        if (ptr == NULL)
+            break;
+        *ptr = blocks;
+        blocks = ptr;
+    }
+    for (; blocks != NULL; blocks = next)
+    {
+        next = *(void**)blocks;
+        free(blocks);
+    }
+    return n;
+}
+
+/** 
+ * @brief Take a snapshot of the allocator's counters.
+ * @param stats The structure to fill in.
+ */
+void bagnalloc_get_stats(struct bagnalloc_stats *stats)
+{
+    size_t i;
+
+    lock_acquire(&arenas_lock);
+    stats->engine = policy->name;
+    stats->heap_size = 0;
+    if (initialized)
+        for (i = 0; i < num_arenas; ++i)
+            stats->heap_size += (char*)arenas[i]->end_brk - (char*)arenas[i]->start_brk;
+    stats->arenas = num_arenas;
+    stats->arena_limit = arena_limit;
+    stats->arena_migrations = arena_migrations;
+    stats->thread_arena = thread_arena != NULL ? (long)thread_arena->id : -1;
+    stats->numa_nodes = numa_nodes;
+    stats->numa_remote_frees = __atomic_load_n(&remote_frees, __ATOMIC_RELAXED);
+    stats->clones = __atomic_load_n(&clones, __ATOMIC_RELAXED);
+    stats->clone_copied_bytes = __atomic_load_n(&clone_copied, __ATOMIC_RELAXED);
+    stats->reserved_bytes = __atomic_load_n(&reserved, __ATOMIC_RELAXED);
+    stats->prefaulted_bytes = __atomic_load_n(&prefaulted, __ATOMIC_RELAXED);
+    lock_release(&arenas_lock);
+
+    cache_stats(stats);
+    medium_stats(stats);
+    tiny_stats(stats);
+    page_heap_stats(stats);
+}
+
+/** 
+ * @brief Take a snapshot of the counters of one arena.
+ * @param index The index of the arena, from 0 to bagnalloc_stats::arenas - 1.
+ * @param stats The structure to fill in.
+ * @return Returns 1 on success, 0 if there is no such arena.
+ */
+int bagnalloc_get_arena_stats(size_t index, struct bagnalloc_arena_stats *stats)
+{
+    lock_acquire(&arenas_lock);
+    arena *a = index < num_arenas && initialized ? arenas[index] : NULL;
+    if (a != NULL)
+    {
+        stats->node = a->node;
+        stats->threads = a->threads;
+        stats->pressure = a->pressure;
+    }
+    lock_release(&arenas_lock);
+
+    if (a == NULL)
+        return 0;
+
+    lock_acquire(&a->lock);
+    stats->size = (char*)a->end_brk - (char*)a->start_brk;
+    stats->acquisitions = a->acquisitions;
+    stats->contention = a->contention;
+    memcpy(stats->walks, a->walks, sizeof(stats->walks));
+    lock_release(&a->lock);
+
+    return 1;
+}
+
+/** 
+ * @brief Print the allocator's counters in a human readable form.
+ * @param file The stream to print to.
+ */
+void bagnalloc_print_stats(FILE *file)
+{
+    struct bagnalloc_stats stats;
+    bagnalloc_get_stats(&stats);
+
+    size_t refills = stats.transfer_hits + stats.transfer_misses;
+    size_t flushes = stats.transfer_inserts + stats.transfer_overflows;
+    size_t medium = stats.medium_hits + stats.medium_misses;
+
+    fprintf(file, "engine:                  %s\n", stats.engine);
+    fprintf(file, "heap size:               %zu bytes\n", stats.heap_size);
+    fprintf(file, "transfer cache refills:  %zu (%zu hits, %.1f%%)\n", refills, stats.transfer_hits,
+            refills ? 100.0 * stats.transfer_hits / refills : 0.0);
+    fprintf(file, "transfer cache flushes:  %zu (%zu taken in, %.1f%%)\n", flushes, stats.transfer_inserts,
+            flushes ? 100.0 * stats.transfer_inserts / flushes : 0.0);
+    fprintf(file, "transfer cache holds:    %zu bytes\n", stats.transfer_cached_bytes);
+    fprintf(file, "medium allocations:      %zu (%zu from central lists, %.1f%%)\n", medium, stats.medium_hits,
+            medium ? 100.0 * stats.medium_hits / medium : 0.0);
+    fprintf(file, "central lists hold:      %zu bytes\n", stats.medium_cached_bytes);
+    fprintf(file, "tiny slots:              %zu in %zu runs\n", stats.tiny_objects, stats.tiny_runs);
+    fprintf(file, "page heap:               %zu bytes in spans, %zu free (%zu released), %zu large spans\n",
+            stats.page_heap_size, stats.page_free_bytes, stats.page_released_bytes, stats.page_large_spans);
+    fprintf(file, "huge pages:              %zu filled, %.1f%% dense, %zu bytes backed (%.1f%% of the unreleased spans)\n",
+            stats.page_filled_huge_pages,
+            stats.page_filled_huge_pages ? 100.0 * stats.page_filled_bytes / (stats.page_filled_huge_pages * 2097152.0) : 0.0,
+            stats.page_huge_backed_bytes, stats.page_heap_size > stats.page_released_bytes ?
+            100.0 * stats.page_huge_backed_bytes / (stats.page_heap_size - stats.page_released_bytes) : 0.0);
+    fprintf(file, "arenas:                  %zu of at most %zu, %zu migrations, this thread on arena %ld\n",
+            stats.arenas, stats.arena_limit, stats.arena_migrations, stats.thread_arena);
+    fprintf(file, "  (a thread moves when %d of its last %d lock attempts found its arena taken)\n",
+            ARENA_MIGRATE_FAILURES, ARENA_WINDOW);
+    fprintf(file, "numa nodes:              %zu, %zu blocks freed from another node\n",
+            stats.numa_nodes, stats.numa_remote_frees);
+    fprintf(file, "clones:                  %zu by mapping, %zu bytes copied by clones\n",
+            stats.clones, stats.clone_copied_bytes);
+    fprintf(file, "reserved:                %zu bytes ahead of time, %zu prefaulted\n",
+            stats.reserved_bytes, stats.prefaulted_bytes);
+
+    struct bagnalloc_arena_stats arena_stats;
+    size_t i;
+    for (i = 0; bagnalloc_get_arena_stats(i, &arena_stats); ++i)
+    {
+        fprintf(file, "  arena %zu: node %zu, %zu bytes, %zu threads, %zu locks (%zu contended), pressure %zu\n", i,
+                arena_stats.node, arena_stats.size, arena_stats.threads, arena_stats.acquisitions, arena_stats.contention,
+                arena_stats.pressure);
+
+        size_t b;
+        for (b = 0; b < BAGNALLOC_WALK_BUCKETS; ++b)
+            if (arena_stats.walks[b])
+                break;
+        if (b == BAGNALLOC_WALK_BUCKETS)
+            continue;
+
+        // free list searches by the number of blocks passed over
+        fprintf(file, "    free list walks:");
+        for (b = 0; b < BAGNALLOC_WALK_BUCKETS; ++b)
+        {
+            size_t low = b ? (size_t)1 << (b - 1) : 0, high = b ? ((size_t)1 << b) - 1 : 0;
+            if (!arena_stats.walks[b])
+                continue;
+            if (b == BAGNALLOC_WALK_BUCKETS - 1)
+                fprintf(file, " %zu+: %zu", low, arena_stats.walks[b]);
+            else if (low == high)
+                fprintf(file, " %zu: %zu", low, arena_stats.walks[b]);
+            else
+                fprintf(file, " %zu-%zu: %zu", low, high, arena_stats.walks[b]);
+        }
+        fprintf(file, "\n");
+    }
 }
@@ -0,0 +1,247 @@
+/**
+ * @file medium.c
+ * @author Alexander Bagnall
+ * @brief Sharded lock-free central free lists for medium sized blocks.
+ *
+ * Blocks too big for the front-end caches but no larger than MEDIUM_MAX are kept, once freed,
+ * on central free lists instead of going back to the heap. Every medium size class has
+ * MEDIUM_SHARDS lists so threads running on different CPUs mostly touch different cache lines,
+ * and each list is a Treiber stack updated with a single compare and swap, so no lock is taken
+ * unless a list runs dry and has to be refilled from the heap.
+ *
+ * A plain Treiber stack suffers from the ABA problem: between reading the top block and its
+ * link, other threads may pop that block, pop and push others, and push the block back, after
+ * which the compare and swap succeeds with a stale link. The top of every stack therefore
+ * carries a generation counter in the bits of the word that addresses don't use, bumped by
+ * every push and pop. A popping thread may still read the link of a block that another thread
+ * has just taken, and which may even have gone back to its arena and been trimmed since. Medium
+ * blocks always live in an arena, and arenas are never unmapped: trimming only drops their pages
+ * with MADV_DONTNEED, so the stale read hits at worst a zero page instead of faulting. The
+ * generation counter has moved on by then, so the compare and swap that follows fails and the
+ * value read is thrown away.
+ *
+ * With several NUMA nodes (see numa.c) the shards of a class are split between the nodes, and a
+ * thread only takes blocks from the shards of its arena's node; blocks of other nodes never get
+ * here since free() sends them home.
+ *
+ * The medium lists are enabled along with the front-end caches (see BAGNALLOC_CACHE in cache.c).
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <sched.h>
+
+#include "bagnalloc.h"
+#include "bagnalloc_internal.h"
+
+#define MEDIUM_STEP 64 // difference in bytes between consecutive medium size classes
+#define NUM_MEDIUM_CLASSES ((MEDIUM_MAX - SMALL_MAX) / MEDIUM_STEP)
+#define MEDIUM_SHARDS 8 // # of free lists per medium size class
+#define MEDIUM_SHARD_MAX 32 // max # of blocks on a free list, beyond which they go to the heap
+#define MEDIUM_BATCH 8 // # of blocks taken from the heap when all free lists of a class are empty
+
+// pointers are stored in the low bits of a stack top, the generation counter in the rest
+#if UINTPTR_MAX > 0xffffffff
+#define POINTER_BITS 48
+#else
+#define POINTER_BITS 32
+#endif
+#define POINTER_MASK (((uint64_t)1 << POINTER_BITS) - 1)
+
+/** @struct medium_shard
+ *  @brief One free list of a medium size class. Aligned to a cache line so shards don't share one.
+ *  @var medium_shard::top
+ *  The first block of the list in the low POINTER_BITS bits, the generation counter above them.
+ *  The blocks are linked through the first word of their data sections.
+ *  @var medium_shard::count
+ *  Approximate number of blocks in the list, only used to bound it.
+ *  @var medium_shard::hits
+ *  Number of blocks handed out by the list.
+ *  @var medium_shard::misses
+ *  Number of times the list was the first one tried and all lists of its class were empty.
+ */
+typedef struct medium_shard {
+    uint64_t top;
+    long count;
+    size_t hits;
+    size_t misses;
+} __attribute__((aligned(64))) medium_shard;
+
+static medium_shard medium_shards[NUM_MEDIUM_CLASSES][MEDIUM_SHARDS];
+
+static int medium_enabled = 0;
+
+/**
+ * @brief Get the medium size class serving a request.
+ * @param size The number of bytes requested (a multiple of 8 in (SMALL_MAX, MEDIUM_MAX]).
+ * @return Returns the index of the smallest class whose blocks are at least \p size bytes.
+ */
+static inline size_t medium_class(size_t size)
+{
+    return (size - SMALL_MAX + MEDIUM_STEP - 1) / MEDIUM_STEP - 1;
+}
+
+/**
+ * @brief Get the block length of a medium size class.
+ */
+static inline size_t medium_class_size(size_t c)
+{
+    return SMALL_MAX + (c + 1) * MEDIUM_STEP;
+}
+
+/**
+ * @brief Get the number of shards of a class that belong to each NUMA node.
+ */
+static inline size_t node_shards()
+{
+    return MEDIUM_SHARDS / numa_nodes;
+}
+
+/**
+ * @brief Pick the shard of the calling thread among those of its node: the one of its current
+ * cpu or, if the cpu is unknown, one picked by hashing a thread local address.
+ */
+static inline size_t current_shard()
+{
+    static __thread char thread_marker;
+
+    size_t shards = node_shards();
+    int cpu = sched_getcpu();
+    size_t index = cpu >= 0 ? (size_t)cpu : (uintptr_t)&thread_marker >> 12;
+    return heap_thread_node() * shards + index % shards;
+}
+
+/**
+ * @brief Push a block onto a free list.
+ */
+static void shard_push(medium_shard *shard, void *ptr)
+{
+    uint64_t top = __atomic_load_n(&shard->top, __ATOMIC_RELAXED);
+    uint64_t new_top;
+
+    do
+    {
+        *(void**)ptr = (void*)(uintptr_t)(top & POINTER_MASK);
+        new_top = (uint64_t)(uintptr_t)ptr | ((top & ~POINTER_MASK) + (POINTER_MASK + 1));
+    } while (!__atomic_compare_exchange_n(&shard->top, &top, new_top, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&shard->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Pop a block from a free list.
+ * @return Returns the data pointer of the block, or NULL if the list is empty.
+ */
+static void* shard_pop(medium_shard *shard)
+{
+    uint64_t top = __atomic_load_n(&shard->top, __ATOMIC_ACQUIRE);
+    uint64_t new_top;
+    void *ptr;
+
+    do
+    {
+        ptr = (void*)(uintptr_t)(top & POINTER_MASK);
+        if (ptr == NULL)
+            return NULL;
+
+        // may be a stale value if the block was popped meanwhile; the exchange will fail then
+        void *next = __atomic_load_n((void**)ptr, __ATOMIC_RELAXED);
+        new_top = (uint64_t)(uintptr_t)next | ((top & ~POINTER_MASK) + (POINTER_MASK + 1));
+    } while (!__atomic_compare_exchange_n(&shard->top, &top, new_top, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+    __atomic_fetch_sub(&shard->count, 1, __ATOMIC_RELAXED);
+    return ptr;
+}
+
+/**
+ * @brief Turn on the medium free lists. Called once while the heap is initialized.
+ */
+void medium_init()
+{
+    medium_enabled = 1;
+}
+
+/**
+ * @brief Allocate a medium block from the central free lists, refilling them from the heap if
+ * they are all empty.
+ * @param size The number of bytes to allocate (a multiple of 8 in (SMALL_MAX, MEDIUM_MAX]).
+ * @return Returns a pointer to the allocated memory, or NULL if the caller should use the heap.
+ */
+void* medium_alloc(size_t size)
+{
+    if (!medium_enabled)
+        return NULL;
+
+    size_t c = medium_class(size);
+    size_t first = current_shard();
+    size_t shards = node_shards();
+    size_t base = first - first % shards;
+    size_t i, n;
+    void *ptr;
+
+    // own shard first, then steal from the others of the node before going to the heap
+    for (i = 0; i < shards; ++i)
+    {
+        medium_shard *shard = &medium_shards[c][base + (first - base + i) % shards];
+        ptr = shard_pop(shard);
+        if (ptr != NULL)
+        {
+            __atomic_fetch_add(&shard->hits, 1, __ATOMIC_RELAXED);
+            return ptr;
+        }
+    }
+    __atomic_fetch_add(&medium_shards[c][first].misses, 1, __ATOMIC_RELAXED);
+
+    void *batch[MEDIUM_BATCH];
+    n = heap_alloc_batch(medium_class_size(c), batch, MEDIUM_BATCH);
+    if (n == 0)
+        return NULL;
+    for (i = 1; i < n; ++i)
+        shard_push(&medium_shards[c][first], batch[i]);
+    return batch[0];
+}
+
+/**
+ * @brief Return a medium block to the central free lists.
+ * @param ptr A pointer to the data section of the block.
+ * @param length The length of the data section (in (SMALL_MAX, MEDIUM_MAX]).
+ * @return Returns 1 if the block was taken, 0 if the caller should free it to the heap.
+ */
+int medium_free(void *ptr, size_t length)
+{
+    if (!medium_enabled || length < medium_class_size(0))
+        return 0;
+
+    // a block longer than its class size can still serve the largest class it covers
+    size_t c = (length - SMALL_MAX) / MEDIUM_STEP - 1;
+    medium_shard *shard = &medium_shards[c][current_shard()];
+
+    if (__atomic_load_n(&shard->count, __ATOMIC_RELAXED) >= MEDIUM_SHARD_MAX)
+        return 0;
+
+    shard_push(shard, ptr);
+    return 1;
+}
+
+/**
+ * @brief Fill in the medium free list part of the allocator statistics.
+ * @param stats The structure to fill in.
+ */
+void medium_stats(struct bagnalloc_stats *stats)
+{
+    size_t c, s;
+
+    stats->medium_hits = stats->medium_misses = stats->medium_cached_bytes = 0;
+
+    for (c = 0; c < NUM_MEDIUM_CLASSES; ++c)
+        for (s = 0; s < MEDIUM_SHARDS; ++s)
+        {
+            medium_shard *shard = &medium_shards[c][s];
+            long count = __atomic_load_n(&shard->count, __ATOMIC_RELAXED);
+
+            stats->medium_hits += __atomic_load_n(&shard->hits, __ATOMIC_RELAXED);
+            stats->medium_misses += __atomic_load_n(&shard->misses, __ATOMIC_RELAXED);
+            if (count > 0)
+                stats->medium_cached_bytes += count * medium_class_size(c);
+        }
+}
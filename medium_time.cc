@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+#include <chrono>
+
+// Scaling of medium sized allocations (too big for the front-end caches) with the thread count.
+// Compare the locked heap against the sharded central free lists:
+//   make mediumtime && ./a.out
+//   make mediumtime && BAGNALLOC_CACHE=thread ./a.out
+// Each line gives the thread count, the wall time and the throughput in millions of malloc/free
+// pairs per second over all threads.
+
+#define OPS 200000 // # of malloc/free pairs per thread
+#define K 32 // # of live blocks per thread
+#define MIN_SIZE 264
+#define MAX_SIZE 4096
+
+using namespace std;
+
+static void work(unsigned int seed)
+{
+    void *stuff[K] = { 0 };
+
+    for (size_t i = 0; i < OPS; ++i)
+    {
+        size_t slot = rand_r(&seed) % K;
+        free(stuff[slot]);
+        stuff[slot] = malloc(MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE));
+        *(char*)stuff[slot] = 0;
+    }
+
+    for (size_t i = 0; i < K; ++i)
+        free(stuff[i]);
+}
+
+int main()
+{
+    printf("threads seconds mops\n");
+
+    int thread_counts[] = { 1, 2, 4, 8, 16, 32 };
+
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+    {
+        int n = thread_counts[t];
+        auto start = chrono::steady_clock::now();
+
+        vector<thread> threads;
+        for (int i = 0; i < n; ++i)
+            threads.push_back(thread(work, i));
+        for (int i = 0; i < n; ++i)
+            threads[i].join();
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        printf("%d %f %f\n", n, seconds, (double)OPS * n / seconds / 1e6);
+    }
+
+    return 0;
+}
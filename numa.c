@@ -0,0 +1,126 @@
+/**
+ * @file numa.c
+ * @author Alexander Bagnall
+ * @brief NUMA topology: the node a thread runs on and where the pages of an arena are placed.
+ *
+ * On a machine with several memory nodes, memory first touched by a thread on one node and used
+ * by threads on another costs every access a trip across the interconnect. The arenas are
+ * therefore bound to nodes (see arena_attach() in malloc.c): a thread only uses arenas of the
+ * node it runs on when it is assigned one, the pages of an arena are placed on its node with
+ * mbind(), and frees of blocks of another node skip the caches and go home to their arena.
+ *
+ * The number of nodes is read from /sys/devices/system/node/online, and the node of a thread is
+ * asked with getcpu(). Both mbind() and getcpu() are called as raw system calls, so that neither
+ * libnuma nor a recent libc is needed. A machine with one node (or without the sysfs file) is
+ * treated as uniform and nothing changes.
+ *
+ * The BAGNALLOC_NUMA_FAKE environment variable fakes a topology of that many nodes (up to
+ * NUMA_MAX_NODES), which lets the routing be tried on a machine with one node: threads are dealt
+ * to the fake nodes round robin in the order they first ask, and no pages are bound.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+
+#include "bagnalloc_internal.h"
+
+#define NUMA_PREFERRED 1 // MPOL_PREFERRED from <linux/mempolicy.h>: the node first, others when it is full
+
+unsigned int numa_nodes = 1;
+
+static int numa_fake; // whether the nodes come from BAGNALLOC_NUMA_FAKE
+static unsigned int fake_next; // the fake node the next thread is dealt to
+static __thread int fake_node = -1; // the fake node of the thread, -1 until it asks
+
+/**
+ * @brief Count the nodes listed in /sys/devices/system/node/online (such as "0-1" or "0,2-3"),
+ * as one more than the highest node number.
+ * @return Returns the number of nodes, 1 if the file can't be read.
+ */
+static unsigned int online_nodes()
+{
+    char buf[256];
+    unsigned long highest = 0;
+
+    int fd = open("/sys/devices/system/node/online", O_RDONLY);
+    if (fd < 0)
+        return 1;
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0)
+        return 1;
+    buf[n] = '\0';
+
+    // ranges and single nodes are separated by commas; the last number of the list is the highest
+    char *p = buf;
+    while (*p >= '0' && *p <= '9')
+    {
+        highest = strtoul(p, &p, 10);
+        if (*p == '-' || *p == ',')
+            ++p;
+    }
+    return highest + 1;
+}
+
+/**
+ * @brief Find out how many nodes there are, or take the fake topology of BAGNALLOC_NUMA_FAKE.
+ * Called once while the heap is initialized.
+ */
+void numa_init()
+{
+    const char *fake = getenv("BAGNALLOC_NUMA_FAKE");
+    unsigned long nodes;
+
+    if (fake != NULL && (nodes = strtoul(fake, NULL, 10)) > 0)
+        numa_fake = 1;
+    else
+        nodes = online_nodes();
+
+    numa_nodes = MIN(nodes, NUMA_MAX_NODES);
+}
+
+/**
+ * @brief Get the node the calling thread runs on. Threads can be moved by the scheduler, so the
+ * answer is only a hint about where the thread's memory should come from.
+ * @return Returns the node, from 0 to numa_nodes - 1.
+ */
+unsigned int numa_node()
+{
+    unsigned int cpu, node;
+
+    if (numa_nodes == 1)
+        return 0;
+    if (numa_fake)
+    {
+        if (fake_node < 0)
+            fake_node = __atomic_fetch_add(&fake_next, 1, __ATOMIC_RELAXED) % numa_nodes;
+        return fake_node;
+    }
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return node % numa_nodes;
+}
+
+/**
+ * @brief Have the pages of an address range placed on a node when they are first touched. Pages
+ * touched already stay where they are. Does nothing on a uniform machine or with a fake topology.
+ * @param start The start of the range (page aligned).
+ * @param length The length of the range.
+ * @param node The node.
+ */
+void numa_bind(void *start, size_t length, unsigned int node)
+{
+    unsigned long mask = 1ul << node;
+
+    if (numa_nodes == 1 || numa_fake)
+        return;
+
+    // maxnode counts the bits of the mask the kernel may read
+    syscall(SYS_mbind, start, length, NUMA_PREFERRED, &mask, sizeof(mask) * 8, 0);
+}
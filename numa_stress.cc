@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stress.h"
+
+// Stress test for the NUMA routing, on any machine thanks to a fake topology. Run it with
+//   BAGNALLOC_NUMA_FAKE=2 BAGNALLOC_CACHE=thread ./a.out
+// Small and medium blocks go through the harness of stress.h, so about half the blocks are freed
+// by a thread of another node and must go home to their arena rather than into the caches of the
+// freeing one. Every thread checks that its arena stays on the node it was first given, even when
+// it migrates, and at the end every node must have had threads and remote frees must have been
+// counted. The program exits with status 1 on the first error.
+
+#define THREADS 8
+#define MAX_SIZE 4096
+
+static std::atomic<unsigned int> nodes_seen(0); // bit n is set once a thread ran on node n
+
+static size_t numa_size(unsigned int *seed)
+{
+    return 16 + rand_r(seed) % (MAX_SIZE - 16);
+}
+
+// the node of the calling thread's arena, -1 if it has none
+static long thread_node()
+{
+    struct bagnalloc_stats stats;
+    struct bagnalloc_arena_stats arena;
+
+    bagnalloc_get_stats(&stats);
+    if (stats.thread_arena < 0 || !bagnalloc_get_arena_stats(stats.thread_arena, &arena))
+        return -1;
+    return arena.node;
+}
+
+// the first allocation assigns the calling thread to an arena; volatile keeps it from being optimized out
+static void attach()
+{
+    void * volatile ptr = malloc(8);
+    free(ptr);
+}
+
+// the first call of each thread records its node, the later ones check that it didn't change
+static int same_node(unsigned int id)
+{
+    static __thread long node = -1;
+
+    if (node < 0)
+    {
+        attach();
+        if ((node = thread_node()) < 0)
+            return 0;
+        nodes_seen |= 1u << node;
+        return 1;
+    }
+    if (thread_node() != node)
+    {
+        printf("FAILED: thread %u left node %ld\n", id, node);
+        return 0;
+    }
+    return 1;
+}
+
+int main()
+{
+    struct bagnalloc_stats stats;
+
+    attach();
+    bagnalloc_get_stats(&stats);
+    if (stats.numa_nodes < 2)
+    {
+        printf("only one NUMA node, run with BAGNALLOC_NUMA_FAKE=2\n");
+        return 1;
+    }
+
+    stress_test t = { THREADS, 200000, 1024, numa_size, NULL, NULL, same_node };
+    int failed = stress_run(t);
+
+    bagnalloc_get_stats(&stats);
+    if (failed)
+    {
+        printf("FAILED: %d errors\n", failed);
+        return 1;
+    }
+    if (nodes_seen != (1u << stats.numa_nodes) - 1 && THREADS >= stats.numa_nodes)
+    {
+        printf("FAILED: threads ran on nodes %#x of %zu\n", nodes_seen.load(), stats.numa_nodes);
+        return 1;
+    }
+    if (stats.numa_remote_frees == 0)
+    {
+        printf("FAILED: no remote frees counted\n");
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
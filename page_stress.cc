@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stress.h"
+
+// Correctness stress test for the page heap. Run it with
+//   BAGNALLOC_PAGEHEAP=1 BAGNALLOC_TINY=1 ./a.out
+// First checks that spans merge: COALESCE large blocks side by side are freed in a shuffled
+// order, after which a block as large as all of them together must fit in the pages they left
+// without growing the page heap. Then puts large blocks (spans), which must be page aligned, and
+// tiny objects (slab spans) through the harness of stress.h, growing some of them with realloc().
+// Every large span must be back in the page heap at the end. The program exits with status 1 on
+// the first error.
+
+#define COALESCE 64
+#define MIN_LARGE (256 * 1024) // the default mmap threshold
+#define MAX_LARGE (2 * 1024 * 1024)
+
+static size_t object_size(unsigned int *seed)
+{
+    return rand_r(seed) % 2 ? 1 + rand_r(seed) % 16 : MIN_LARGE + rand_r(seed) % (MAX_LARGE - MIN_LARGE);
+}
+
+static int page_aligned(object *o)
+{
+    return o->size <= 16 || (uintptr_t)o->ptr % 4096 == 0;
+}
+
+static size_t grow(size_t size)
+{
+    return size + MIN_LARGE;
+}
+
+int main()
+{
+    struct bagnalloc_stats start, before, after;
+    void *blocks[COALESCE];
+    unsigned int seed = 1;
+
+    // with a low BAGNALLOC_MMAP_THRESHOLD the runtime may have large blocks of its own
+    bagnalloc_get_stats(&start);
+    for (size_t i = 0; i < COALESCE; ++i)
+        blocks[i] = malloc(MIN_LARGE);
+    bagnalloc_get_stats(&before);
+    if (before.page_large_spans != start.page_large_spans + COALESCE)
+    {
+        printf("the page heap is off, run with BAGNALLOC_PAGEHEAP=1\n");
+        return 1;
+    }
+    for (size_t i = COALESCE; i > 1; --i)
+    {
+        size_t j = rand_r(&seed) % i;
+        void *tmp = blocks[j];
+        blocks[j] = blocks[i - 1];
+        blocks[i - 1] = tmp;
+    }
+    for (size_t i = 0; i < COALESCE; ++i)
+        free(blocks[i]);
+    bagnalloc_get_stats(&before);
+    void *whole = malloc(COALESCE * MIN_LARGE);
+    bagnalloc_get_stats(&after);
+    if (after.page_heap_size != before.page_heap_size)
+    {
+        printf("FAILED: freed spans did not merge\n");
+        return 1;
+    }
+    free(whole);
+
+    stress_test t = { 8, 20000, 256, object_size, page_aligned, grow, NULL };
+    int corrupted = stress_run(t);
+
+    bagnalloc_get_stats(&after);
+    if (after.page_large_spans != start.page_large_spans)
+    {
+        printf("FAILED: %zu large spans left\n", after.page_large_spans - start.page_large_spans);
+        return 1;
+    }
+    if (corrupted)
+    {
+        printf("FAILED: %d corrupted objects\n", corrupted);
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
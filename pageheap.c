@@ -0,0 +1,729 @@
+/**
+ * @file pageheap.c
+ * @author Alexander Bagnall
+ * @brief A heap of whole pages, handed out as spans: runs of contiguous pages.
+ *
+ * The arenas manage their memory a byte at a time, with a block_meta header in front of every
+ * block. The page heap manages an address range reserved for it a page (HEAP_PAGE_SIZE bytes) at
+ * a time instead, and keeps what it knows about a span in a span structure outside of the span,
+ * so the pages handed out are whole and page-aligned. It carves two kinds of spans:
+ *  - slabs, the runs of header-free slots of tiny.c,
+ *  - large allocations, which would otherwise get a mapping of their own (see mmap_alloc() in
+ *    malloc.c).
+ *
+ * Free spans are kept on lists by their number of pages, one list per length up to PAGE_LISTS - 1
+ * pages and one for every longer span, with a bitmap of the non-empty lists; a request takes the
+ * head of the first non-empty list at or above its length (the best fit on the last list) and
+ * the pages it doesn't need go back to the lists. The page map has an entry per page of the range,
+ * set for the first and the last page of every span, so free() finds a span from its address and
+ * a freed span merges with the free spans on either side of it. Free spans of PAGE_RELEASE_PAGES
+ * or more are given back to the system with madvise(), which never has to split a page since
+ * spans are made of whole ones. Pages no span has covered yet are cut from the top of the range.
+ *
+ * With the huge page filler on (BAGNALLOC_HUGEPAGE), the range is aligned to huge pages and
+ * marked for transparent huge pages, and the free lists only deal in whole huge pages. Spans
+ * shorter than a huge page are packed into huge pages by the filler instead: it keeps a bitmap
+ * of the pages in use in each huge page it fills and lists of those huge pages by their longest
+ * run of free pages, and puts a span into the fullest huge page among those whose longest run
+ * fits it most tightly. A huge page the filler has emptied goes back to the free lists whole,
+ * and is given back to the system whole, so freeing never breaks up a huge page that still
+ * holds spans. Longer spans take whole huge pages, and the rest of their last huge page is left
+ * to the filler.
+ *
+ * One lock protects the page heap. Enabled with the BAGNALLOC_PAGEHEAP environment variable, on
+ * systems whose pages are HEAP_PAGE_SIZE bytes.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "bagnalloc.h"
+#include "bagnalloc_internal.h"
+#include "lock.h"
+
+#define PAGE_SHIFT_BITS 12 // log2(HEAP_PAGE_SIZE)
+#define PAGE_LISTS 128 // list i holds the free spans of i + 1 pages, the last one all longer spans
+#define PAGE_WORDS ((PAGE_LISTS + 63) / 64) // # of words in the bitmap of the lists
+#define PAGE_REGION_SIZE ((size_t)1 << (sizeof(void*) == 8 ? 36 : 28)) // address range reserved for spans
+#define PAGE_REGION_PAGES (PAGE_REGION_SIZE >> PAGE_SHIFT_BITS)
+#define PAGE_RELEASE_PAGES 64 // # of pages from which a free span is given back to the system
+#define SPAN_CHUNK (64 * 1024) // # of bytes mapped at a time for span structures
+#define HUGE_PAGE_PAGES 512 // # of pages in a huge page (2 MiB)
+#define HUGE_PAGE_SIZE ((size_t)HUGE_PAGE_PAGES << PAGE_SHIFT_BITS)
+#define HUGE_WORDS (HUGE_PAGE_PAGES / 64) // # of words in the bitmap of a huge page
+#define HUGE_LIST_WORDS ((HUGE_PAGE_PAGES + 1 + 63) / 64) // # of words in the bitmap of the filler lists
+#define HUGE_PAGES (PAGE_REGION_PAGES / HUGE_PAGE_PAGES) // # of huge pages in the range
+
+/** @struct span
+ *  @brief A run of pages of the page heap, free or handed out.
+ *  @var span::start
+ *  Index of its first page in the range.
+ *  @var span::pages
+ *  Number of pages.
+ *  @var span::prev
+ *  The previous span on the same free list, NULL if it is the first one or the span isn't free.
+ *  @var span::next
+ *  The next span on the same free list (or on the spare structures), NULL if it is the last one.
+ *  @var span::kind
+ *  PAGE_FREE, PAGE_SLAB or PAGE_LARGE.
+ *  @var span::released
+ *  Whether the pages of a free span have been given back to the system.
+ *  @var span::filled
+ *  Whether the span (or, for spans of a huge page or more, its last huge page) is one the filler
+ *  packs spans into.
+ */
+typedef struct span {
+    size_t start;
+    size_t pages;
+    struct span *prev;
+    struct span *next;
+    unsigned char kind;
+    unsigned char released;
+    unsigned char filled;
+} span;
+
+/** @struct huge_page
+ *  @brief A huge page the filler packs spans into.
+ *  @var huge_page::used_map
+ *  Bit i is set if page i of the huge page is in a span.
+ *  @var huge_page::prev
+ *  The previous huge page on the same filler list.
+ *  @var huge_page::next
+ *  The next huge page on the same filler list.
+ *  @var huge_page::used
+ *  Number of pages in spans.
+ *  @var huge_page::longest
+ *  Length of its longest run of free pages, the index of its filler list.
+ */
+typedef struct huge_page {
+    uint64_t used_map[HUGE_WORDS];
+    struct huge_page *prev;
+    struct huge_page *next;
+    unsigned short used;
+    unsigned short longest;
+} huge_page;
+
+static malloc_lock page_lock = MALLOC_LOCK_INITIALIZER; // protects everything below but page_base and page_map
+
+static char *page_base; // start of the range reserved for spans, NULL if the page heap is off
+static span **page_map; // the span of every first and last page of a span
+static size_t page_top; // # of pages at the start of the range covered by spans
+
+static span *page_lists[PAGE_LISTS];
+static uint64_t page_bitmap[PAGE_WORDS]; // bit i is set if list i isn't empty
+
+static span *spare_spans; // span structures not in use
+static char *chunk_next, *chunk_end; // unused part of the last chunk of span structures
+
+static size_t free_pages; // # of pages in free spans
+static size_t released_pages; // # of those pages given back to the system
+static size_t large_spans; // # of spans handed out as large allocations
+
+static huge_page *huge_pages; // one per huge page of the range, NULL if the filler is off
+static huge_page *huge_lists[HUGE_PAGE_PAGES + 1]; // the filled huge pages by their longest run of free pages
+static uint64_t huge_bitmap[HUGE_LIST_WORDS]; // bit i is set if filler list i isn't empty
+static size_t filled_huge_pages; // # of huge pages the filler packs spans into
+static size_t filled_pages; // # of pages in spans in them
+
+/**
+ * @brief Get a span structure, mapping a new chunk of them if none is left.
+ * @return Returns the structure, or NULL if the mapping failed.
+ */
+static span* span_new()
+{
+    span *s = spare_spans;
+    if (s != NULL)
+    {
+        spare_spans = s->next;
+        return s;
+    }
+
+    if (chunk_next == NULL || chunk_next + sizeof(span) > chunk_end)
+    {
+        char *chunk = mmap(NULL, SPAN_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+            return NULL;
+        chunk_next = chunk;
+        chunk_end = chunk + SPAN_CHUNK;
+    }
+
+    s = (span*)chunk_next;
+    chunk_next += sizeof(span);
+    return s;
+}
+
+/**
+ * @brief Put a span structure back on the spare ones. Stale page map entries may still point
+ * to it, so it must not look free.
+ */
+static void span_delete(span *s)
+{
+    s->kind = PAGE_NONE;
+    s->next = spare_spans;
+    spare_spans = s;
+}
+
+static inline size_t list_of(size_t pages)
+{
+    return (pages < PAGE_LISTS ? pages : PAGE_LISTS) - 1;
+}
+
+static inline void map_span(span *s)
+{
+    page_map[s->start] = s;
+    page_map[s->start + s->pages - 1] = s;
+}
+
+/**
+ * @brief Put a span on the free list of its length.
+ */
+static void free_insert(span *s)
+{
+    size_t i = list_of(s->pages);
+
+    s->kind = PAGE_FREE;
+    s->prev = NULL;
+    s->next = page_lists[i];
+    if (s->next != NULL)
+        s->next->prev = s;
+    page_lists[i] = s;
+    page_bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+
+    free_pages += s->pages;
+    if (s->released)
+        released_pages += s->pages;
+}
+
+/**
+ * @brief Take a span off the free list of its length.
+ */
+static void free_remove(span *s)
+{
+    size_t i = list_of(s->pages);
+
+    if (s->prev != NULL)
+        s->prev->next = s->next;
+    else if ((page_lists[i] = s->next) == NULL)
+        page_bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+    if (s->next != NULL)
+        s->next->prev = s->prev;
+
+    free_pages -= s->pages;
+    if (s->released)
+        released_pages -= s->pages;
+}
+
+/**
+ * @brief Find the free span that fits \p pages pages best.
+ * @return Returns the span, still on its list, or NULL if no free span is long enough.
+ */
+static span* find_span(size_t pages)
+{
+    size_t i = bitmap_find_set(page_bitmap, PAGE_WORDS, list_of(pages));
+    if (i < PAGE_LISTS - 1)
+        return page_lists[i];
+    if (i == PAGE_LISTS)
+        return NULL;
+
+    // the spans on the last list have different lengths
+    span *s, *best = NULL;
+    for (s = page_lists[i]; s != NULL; s = s->next)
+        if (s->pages >= pages && (best == NULL || s->pages < best->pages))
+            best = s;
+    return best;
+}
+
+/**
+ * @brief Take \p pages pages from the free lists, or else from the top of the range.
+ * @return Returns the span, whose kind is left to the caller, or NULL if the range is used up.
+ */
+static span* span_take(size_t pages)
+{
+    span *s = find_span(pages);
+    if (s != NULL)
+    {
+        free_remove(s);
+
+        // the rest of the span stays free
+        span *rest;
+        if (s->pages > pages && (rest = span_new()) != NULL)
+        {
+            rest->start = s->start + pages;
+            rest->pages = s->pages - pages;
+            rest->released = s->released;
+            s->pages = pages;
+            map_span(rest);
+            free_insert(rest);
+        }
+    }
+    else
+    {
+        if (pages > PAGE_REGION_PAGES - page_top || (s = span_new()) == NULL)
+            return NULL;
+        s->start = page_top;
+        s->pages = pages;
+        page_top += pages;
+    }
+
+    s->prev = s->next = NULL;
+    s->released = 0;
+    s->filled = 0;
+    return s;
+}
+
+/**
+ * @brief Put a span back on the free lists, merging it with the free spans next to it, and give
+ * its pages back to the system if it is long enough.
+ */
+static void span_release(span *s)
+{
+    span *prev = s->start ? page_map[s->start - 1] : NULL;
+    if (prev != NULL && prev->kind == PAGE_FREE && prev->start + prev->pages == s->start)
+    {
+        free_remove(prev);
+        prev->pages += s->pages;
+        prev->released = 0;
+        span_delete(s);
+        s = prev;
+    }
+
+    // entries of pages inside a span are stale, hence the check that the neighbour ends up here
+    size_t end = s->start + s->pages;
+    span *next = end < page_top ? page_map[end] : NULL;
+    if (next != NULL && next->kind == PAGE_FREE && next->start == end)
+    {
+        free_remove(next);
+        s->pages += next->pages;
+        s->released = 0;
+        span_delete(next);
+    }
+
+    if (s->pages >= PAGE_RELEASE_PAGES && !s->released)
+    {
+        madvise(page_base + (s->start << PAGE_SHIFT_BITS), s->pages << PAGE_SHIFT_BITS, MADV_DONTNEED);
+        s->released = 1;
+    }
+
+    map_span(s);
+    free_insert(s);
+}
+
+/**
+ * @brief Find the first run of at least \p pages free pages in a huge page.
+ * @param longest Set to the length of its longest run of free pages if not NULL.
+ * @return Returns the index of the first page of the run, or HUGE_PAGE_PAGES if there is none.
+ */
+static size_t huge_find_run(huge_page *hp, size_t pages, size_t *longest)
+{
+    size_t from = 0, found = HUGE_PAGE_PAGES, max = 0;
+
+    while (from < HUGE_PAGE_PAGES)
+    {
+        size_t first = bitmap_find_clear(hp->used_map, HUGE_WORDS, from);
+        if (first == HUGE_PAGE_PAGES)
+            break;
+        size_t end = bitmap_find_set(hp->used_map, HUGE_WORDS, first);
+        if (end - first >= pages && found == HUGE_PAGE_PAGES)
+        {
+            found = first;
+            if (longest == NULL)
+                break;
+        }
+        if (end - first > max)
+            max = end - first;
+        from = end;
+    }
+
+    if (longest != NULL)
+        *longest = max;
+    return found;
+}
+
+static void huge_unlink(huge_page *hp)
+{
+    size_t i = hp->longest;
+
+    if (hp->prev != NULL)
+        hp->prev->next = hp->next;
+    else if ((huge_lists[i] = hp->next) == NULL)
+        huge_bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+    if (hp->next != NULL)
+        hp->next->prev = hp->prev;
+}
+
+/**
+ * @brief Put a huge page on the filler list of its longest run of free pages, once its bitmap
+ * has changed.
+ */
+static void huge_link(huge_page *hp)
+{
+    size_t longest;
+    huge_find_run(hp, HUGE_PAGE_PAGES + 1, &longest);
+    size_t i = hp->longest = longest;
+
+    hp->prev = NULL;
+    hp->next = huge_lists[i];
+    if (hp->next != NULL)
+        hp->next->prev = hp;
+    huge_lists[i] = hp;
+    huge_bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+}
+
+/**
+ * @brief Mark pages of a huge page as used or free.
+ */
+static void huge_mark(huge_page *hp, size_t first, size_t pages, int used)
+{
+    size_t i;
+
+    for (i = first; i < first + pages; ++i)
+        if (used)
+            hp->used_map[i / 64] |= (uint64_t)1 << (i % 64);
+        else
+            hp->used_map[i / 64] &= ~((uint64_t)1 << (i % 64));
+
+    if (used)
+    {
+        hp->used += pages;
+        filled_pages += pages;
+    }
+    else
+    {
+        hp->used -= pages;
+        filled_pages -= pages;
+    }
+}
+
+/**
+ * @brief Start filling a huge page whose first \p pages pages are in use.
+ */
+static void huge_start(size_t start, size_t pages)
+{
+    huge_page *hp = &huge_pages[start / HUGE_PAGE_PAGES];
+
+    memset(hp->used_map, 0, sizeof(hp->used_map));
+    hp->used = 0;
+    huge_mark(hp, 0, pages, 1);
+    huge_link(hp);
+    filled_huge_pages++;
+}
+
+/**
+ * @brief Put a span shorter than a huge page into the fullest huge page it fits in most tightly,
+ * starting a new huge page if none has room.
+ * @return Returns the span, or NULL if the range is used up.
+ */
+static span* filler_take(size_t pages)
+{
+    span *s = span_new();
+    if (s == NULL)
+        return NULL;
+
+    size_t i = bitmap_find_set(huge_bitmap, HUGE_LIST_WORDS, pages);
+    huge_page *hp, *fullest = NULL;
+    if (i <= HUGE_PAGE_PAGES)
+        for (hp = huge_lists[i]; hp != NULL; hp = hp->next)
+            if (fullest == NULL || hp->used > fullest->used)
+                fullest = hp;
+
+    if (fullest == NULL)
+    {
+        span *host = span_take(HUGE_PAGE_PAGES);
+        if (host == NULL)
+        {
+            span_delete(s);
+            return NULL;
+        }
+        s->start = host->start;
+        span_delete(host);
+        huge_start(s->start, pages);
+    }
+    else
+    {
+        huge_unlink(fullest);
+        size_t first = huge_find_run(fullest, pages, NULL);
+        huge_mark(fullest, first, pages, 1);
+        huge_link(fullest);
+        s->start = (size_t)(fullest - huge_pages) * HUGE_PAGE_PAGES + first;
+    }
+
+    s->pages = pages;
+    s->prev = s->next = NULL;
+    s->released = 0;
+    s->filled = 1;
+    return s;
+}
+
+/**
+ * @brief Free pages of a filled huge page. A huge page left empty goes back to the free lists.
+ */
+static void filler_release(size_t start, size_t pages)
+{
+    huge_page *hp = &huge_pages[start / HUGE_PAGE_PAGES];
+
+    huge_unlink(hp);
+    huge_mark(hp, start % HUGE_PAGE_PAGES, pages, 0);
+
+    span *whole;
+    if (hp->used == 0 && (whole = span_new()) != NULL)
+    {
+        filled_huge_pages--;
+        whole->start = start - start % HUGE_PAGE_PAGES;
+        whole->pages = HUGE_PAGE_PAGES;
+        whole->released = 0;
+        whole->filled = 0;
+        span_release(whole);
+    }
+    else
+        huge_link(hp);
+}
+
+/**
+ * @brief Reserve the address range for the page heap if the BAGNALLOC_PAGEHEAP environment
+ * variable is set, and turn the huge page filler on if BAGNALLOC_HUGEPAGE is set as well.
+ * Called once while the heap is initialized, before tiny_init().
+ */
+void page_heap_init()
+{
+    const char *pageheap = getenv("BAGNALLOC_PAGEHEAP");
+    if (pageheap == NULL || !strcmp(pageheap, "0") || sysconf(_SC_PAGESIZE) != HEAP_PAGE_SIZE)
+        return;
+
+    // pages of these are only used once touched
+    span **map = mmap(NULL, PAGE_REGION_PAGES * sizeof(span*), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return;
+    // one huge page more, so the range can start on a huge page boundary
+    char *region = mmap(NULL, PAGE_REGION_SIZE + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        munmap(map, PAGE_REGION_PAGES * sizeof(span*));
+        return;
+    }
+    page_map = map;
+    page_base = (char*)(((uintptr_t)region + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+
+    const char *hugepage = getenv("BAGNALLOC_HUGEPAGE");
+    if (hugepage == NULL || !strcmp(hugepage, "0"))
+        return;
+    huge_page *hps = mmap(NULL, HUGE_PAGES * sizeof(huge_page), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (hps == MAP_FAILED)
+        return;
+    madvise(page_base, PAGE_REGION_SIZE, MADV_HUGEPAGE);
+    huge_pages = hps;
+}
+
+/**
+ * @brief Check whether the page heap is on.
+ */
+int page_heap_enabled()
+{
+    return page_base != NULL;
+}
+
+/**
+ * @brief Hand out a span.
+ * @param pages The number of pages (nonzero).
+ * @param kind What the span is for, PAGE_SLAB or PAGE_LARGE.
+ * @return Returns the address of its first page, or NULL if the page heap is off or full.
+ */
+void* page_alloc(size_t pages, int kind)
+{
+    if (page_base == NULL)
+        return NULL;
+
+    lock_acquire(&page_lock);
+
+    span *s;
+    if (huge_pages == NULL)
+        s = span_take(pages);
+    else if (pages < HUGE_PAGE_PAGES)
+        s = filler_take(pages);
+    else
+    {
+        // whole huge pages, the rest of the last one is left to the filler
+        size_t whole = (pages + HUGE_PAGE_PAGES - 1) / HUGE_PAGE_PAGES * HUGE_PAGE_PAGES;
+        s = span_take(whole);
+        if (s != NULL && whole != pages)
+        {
+            s->pages = pages;
+            s->filled = 1;
+            huge_start(s->start + whole - HUGE_PAGE_PAGES, pages % HUGE_PAGE_PAGES);
+        }
+    }
+
+    if (s == NULL)
+    {
+        lock_release(&page_lock);
+        return NULL;
+    }
+
+    s->kind = kind;
+    map_span(s);
+    if (kind == PAGE_LARGE)
+        large_spans++;
+
+    lock_release(&page_lock);
+
+    return page_base + (s->start << PAGE_SHIFT_BITS);
+}
+
+/**
+ * @brief Give back a span handed out by page_alloc(), merging it with the free spans next to it.
+ * @param ptr The address of its first page.
+ */
+void page_free(void *ptr)
+{
+    size_t start = ((char*)ptr - page_base) >> PAGE_SHIFT_BITS;
+
+    lock_acquire(&page_lock);
+
+    span *s = page_map[start];
+    if (s->kind == PAGE_LARGE)
+        large_spans--;
+
+    if (!s->filled)
+        span_release(s);
+    else if (s->pages < HUGE_PAGE_PAGES)
+    {
+        filler_release(s->start, s->pages);
+        span_delete(s);
+    }
+    else
+    {
+        // the last huge page goes back to the filler first, so the rest can merge with it
+        size_t whole = s->pages / HUGE_PAGE_PAGES * HUGE_PAGE_PAGES;
+        filler_release(s->start + whole, s->pages - whole);
+        s->pages = whole;
+        s->filled = 0;
+        span_release(s);
+    }
+
+    lock_release(&page_lock);
+}
+
+/**
+ * @brief Get what the span holding an address is for. Only valid for addresses in spans that
+ * are handed out, or outside of the page heap.
+ * @param ptr The address.
+ * @return Returns PAGE_SLAB or PAGE_LARGE, or PAGE_NONE if \p ptr isn't in the page heap.
+ */
+int page_kind(void *ptr)
+{
+    if (page_base == NULL || (uintptr_t)((char*)ptr - page_base) >= PAGE_REGION_SIZE)
+        return PAGE_NONE;
+
+    span *s = page_map[((char*)ptr - page_base) >> PAGE_SHIFT_BITS];
+    return s != NULL ? s->kind : PAGE_NONE;
+}
+
+/**
+ * @brief Get the number of bytes in a span handed out by page_alloc().
+ * @param ptr The address of its first page.
+ */
+size_t page_length(void *ptr)
+{
+    return page_map[((char*)ptr - page_base) >> PAGE_SHIFT_BITS]->pages << PAGE_SHIFT_BITS;
+}
+
+/**
+ * @brief Get the number of bytes of the range backed by transparent huge pages, which the kernel
+ * reports as AnonHugePages in /proc/self/smaps. Reads the file with plain system calls, since
+ * stdio would allocate.
+ */
+static size_t huge_backed_bytes()
+{
+    char buf[4096];
+    size_t len = 0, total = 0;
+    int in_range = 0;
+
+    int fd = open("/proc/self/smaps", O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    for (;;)
+    {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0)
+            break;
+        len += n;
+        buf[len] = '\0';
+
+        char *line = buf, *eol;
+        while ((eol = memchr(line, '\n', buf + len - line)) != NULL)
+        {
+            *eol = '\0';
+            // mappings start with their address range, in lower case hex; the fields are capitalized
+            if ((*line >= '0' && *line <= '9') || (*line >= 'a' && *line <= 'f'))
+            {
+                char *dash;
+                uintptr_t start = strtoul(line, &dash, 16);
+                uintptr_t end = *dash == '-' ? strtoul(dash + 1, NULL, 16) : start;
+                in_range = start < (uintptr_t)page_base + PAGE_REGION_SIZE && end > (uintptr_t)page_base;
+            }
+            else if (in_range && !strncmp(line, "AnonHugePages:", 14))
+                total += strtoul(line + 14, NULL, 10) * 1024;
+            line = eol + 1;
+        }
+
+        // keep the start of a line cut off by the end of the buffer
+        len = buf + len - line;
+        memmove(buf, line, len);
+        if (len == sizeof(buf) - 1)
+            len = 0;
+    }
+
+    close(fd);
+    return total;
+}
+
+/**
+ * @brief Fill in the page heap part of the allocator statistics.
+ * @param stats The structure to fill in.
+ */
+void page_heap_stats(struct bagnalloc_stats *stats)
+{
+    lock_acquire(&page_lock);
+    stats->page_heap_size = page_top << PAGE_SHIFT_BITS;
+    stats->page_free_bytes = free_pages << PAGE_SHIFT_BITS;
+    stats->page_released_bytes = released_pages << PAGE_SHIFT_BITS;
+    stats->page_large_spans = large_spans;
+    stats->page_filled_huge_pages = filled_huge_pages;
+    stats->page_filled_bytes = filled_pages << PAGE_SHIFT_BITS;
+    lock_release(&page_lock);
+
+    stats->page_huge_backed_bytes = page_base != NULL ? huge_backed_bytes() : 0;
+}
+
+/**
+ * @brief Take the lock of the page heap before fork() (see fork_prepare() in malloc.c).
+ */
+void page_fork_prepare()
+{
+    lock_acquire(&page_lock);
+}
+
+/**
+ * @brief Release the lock taken by page_fork_prepare() in the parent after fork().
+ */
+void page_fork_parent()
+{
+    lock_release(&page_lock);
+}
+
+/**
+ * @brief Reset the lock of the page heap in the child after fork().
+ */
+void page_fork_child()
+{
+    malloc_lock unlocked = MALLOC_LOCK_INITIALIZER;
+
+    page_lock = unlocked;
+}
@@ -0,0 +1,277 @@
+/**
+ * @file persist.c
+ * @author Alexander Bagnall
+ * @brief Persistent heaps: heaps that live in a file and survive the process.
+ *
+ * A persistent heap is a file mapped shared at a fixed address, so that the pointers stored in
+ * it (both the allocator's and the program's) are still valid when the file is mapped again by
+ * the next run of the program. The file starts with a header holding everything the allocator
+ * needs (its free lists are those of a TLSF engine, see fits.c, kept in the header) and a root
+ * pointer through which the program finds its data again. The address range is reserved for
+ * the largest size the heap may reach, and the file grows into it PERSIST_GROWTH bytes at a time.
+ *
+ * The header has a clean flag, cleared while the heap is open and set again once it is closed
+ * after everything has been written back. A heap found not clean when opened was left by a
+ * process that died with the heap open, maybe in the middle of an allocation, so its free lists
+ * are rebuilt by walking the blocks (see fits_rebuild()) before it is used again.
+ *
+ * Blocks of a persistent heap must only be freed with bagnalloc_persist_free(), never free().
+ * A heap is open in one process at a time, which holds an exclusive flock() on the file; its
+ * threads share it under a lock.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "bagnalloc.h"
+#include "bagnalloc_internal.h"
+#include "lock.h"
+
+#define PERSIST_MAGIC 0x737265706e676162ull // "bagnpers" read as a little endian word
+#define PERSIST_VERSION 1
+#define PERSIST_GROWTH (1024 * 1024) // # of bytes the file grows by at once; a multiple of the page size
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+/** @struct bagnalloc_persist
+ *  @brief The header at the start of a persistent heap's file, which is also the handle of the
+ *  heap while it is open. The heap itself follows it, up to heap.end, where the file ends.
+ *  @var bagnalloc_persist::magic
+ *  PERSIST_MAGIC once the heap has been set up.
+ *  @var bagnalloc_persist::version
+ *  PERSIST_VERSION, the layout of the file.
+ *  @var bagnalloc_persist::link_size
+ *  sizeof(heap_link): a build with -DCOMPRESSED_LINKS can't read the blocks of one without it.
+ *  @var bagnalloc_persist::base
+ *  The address the file is mapped at, which it must be mapped at again.
+ *  @var bagnalloc_persist::size
+ *  The number of bytes reserved for the heap by the process that has it open.
+ *  @var bagnalloc_persist::clean
+ *  Whether the heap was closed properly; cleared while it is open.
+ *  @var bagnalloc_persist::recoveries
+ *  Number of times the heap was found not clean and its free lists rebuilt.
+ *  @var bagnalloc_persist::fd
+ *  The file descriptor of the file in the process that has it open.
+ *  @var bagnalloc_persist::lock
+ *  Protects the heap in the process that has it open.
+ *  @var bagnalloc_persist::root
+ *  The pointer set with bagnalloc_persist_set_root().
+ *  @var bagnalloc_persist::heap
+ *  The state of the engine.
+ */
+struct bagnalloc_persist {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t link_size;
+    void *base;
+    size_t size;
+    int clean;
+    int fd;
+    size_t recoveries;
+    malloc_lock lock;
+    void *root;
+    fit_heap heap;
+};
+
+/**
+ * @brief Write the first page of the header, which holds the clean flag, back to the file.
+ */
+static int sync_header(struct bagnalloc_persist *h)
+{
+    return msync(h, sysconf(_SC_PAGESIZE), MS_SYNC);
+}
+
+/**
+ * @brief Open a persistent heap, creating it if the file is empty or doesn't exist.
+ * @param path The file holding the heap.
+ * @param base The address to map the file at (page aligned), the same every time.
+ * @param size The largest size the file may grow to.
+ * @param recovered If not NULL, set to whether the heap wasn't closed properly and was recovered.
+ * @return Returns the heap, or NULL with errno set if the file can't be opened, is open in
+ * another process (EBUSY), can't be mapped at \p base (EEXIST) or holds something else (EINVAL).
+ */
+struct bagnalloc_persist* bagnalloc_persist_open(const char *path, void *base, size_t size, int *recovered)
+{
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    struct stat st;
+    int rebuilt = 0;
+
+    if ((uintptr_t)base % page_size || size < PERSIST_GROWTH)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    size = (size + PERSIST_GROWTH - 1) / PERSIST_GROWTH * PERSIST_GROWTH;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+
+    // the lock goes with the descriptor, so it is released when the heap is closed or the process dies
+    if (flock(fd, LOCK_EX | LOCK_NB))
+    {
+        int error = errno == EWOULDBLOCK ? EBUSY : errno;
+        close(fd);
+        errno = error;
+        return NULL;
+    }
+
+    // only an empty file is made a heap; one too short to be a heap holds something else
+    int created = 0;
+    if (fstat(fd, &st) || (st.st_size == 0 && (created = 1, ftruncate(fd, PERSIST_GROWTH))))
+    {
+        close(fd);
+        return NULL;
+    }
+    if (!created && st.st_size < PERSIST_GROWTH)
+    {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // the whole range is reserved now, the file only covers what the heap has grown to
+    struct bagnalloc_persist *h = mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (h == MAP_FAILED || h != base)
+    {
+        if (h != MAP_FAILED)
+            munmap(h, size);
+        close(fd);
+        errno = EEXIST;
+        return NULL;
+    }
+
+    if (created)
+    {
+        // a new file
+        char *start = (char*)h + (sizeof(*h) + 63) / 64 * 64;
+        h->version = PERSIST_VERSION;
+        h->link_size = sizeof(heap_link);
+        h->base = base;
+        h->recoveries = 0;
+        h->root = NULL;
+        fits_init(&h->heap, FIT_TLSF, start, (char*)h + PERSIST_GROWTH);
+        h->clean = 1;
+        h->magic = PERSIST_MAGIC;
+    }
+    else if (h->magic != PERSIST_MAGIC || h->version != PERSIST_VERSION || h->link_size != sizeof(heap_link) ||
+             h->base != base || h->heap.end > (char*)h + size || h->heap.end > (char*)h + st.st_size)
+    {
+        munmap(h, size);
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    else if (!h->clean)
+    {
+        fits_rebuild(&h->heap);
+        h->recoveries++;
+        rebuilt = 1;
+    }
+
+    malloc_lock unlocked = MALLOC_LOCK_INITIALIZER;
+    h->lock = unlocked;
+    h->fd = fd;
+    h->size = size;
+
+    // from here on, a crash leaves the heap marked as not clean
+    h->clean = 0;
+    sync_header(h);
+
+    if (recovered != NULL)
+        *recovered = rebuilt;
+    return h;
+}
+
+/**
+ * @brief Allocate a block of a persistent heap, growing the file if needed.
+ * @return Returns a pointer to the block, or NULL if the heap has reached its size or \p size is
+ * larger than any block of the fit engines (FIT_MAX_SIZE).
+ */
+void* bagnalloc_persist_alloc(struct bagnalloc_persist *h, size_t size)
+{
+    // sizes near SIZE_MAX would wrap around to small ones once rounded up
+    if (!size || size > FIT_MAX_SIZE)
+        return NULL;
+    size = (size + 7) & ~(size_t)7;
+
+    lock_acquire(&h->lock);
+
+    void *ptr = fits_alloc(&h->heap, size);
+    size_t shortfall, used = h->heap.end - (char*)h;
+    if (ptr == NULL && (shortfall = fits_shortfall(&h->heap, size)) != 0 && shortfall <= h->size - used)
+    {
+        // the file grows before the heap does, so the heap never reaches past it
+        size_t length = used + shortfall;
+        length = (length + PERSIST_GROWTH - 1) / PERSIST_GROWTH * PERSIST_GROWTH;
+        if (length <= h->size && !ftruncate(h->fd, length))
+        {
+            fits_grow(&h->heap, (char*)h + length);
+            ptr = fits_alloc(&h->heap, size);
+        }
+    }
+
+    lock_release(&h->lock);
+    return ptr;
+}
+
+/**
+ * @brief Free a block of a persistent heap.
+ */
+void bagnalloc_persist_free(struct bagnalloc_persist *h, void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    lock_acquire(&h->lock);
+    fits_free(&h->heap, ptr);
+    lock_release(&h->lock);
+}
+
+/**
+ * @brief Get the root pointer of a persistent heap, NULL until one is set.
+ */
+void* bagnalloc_persist_root(struct bagnalloc_persist *h)
+{
+    return __atomic_load_n(&h->root, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Set the root pointer of a persistent heap, through which its data is found again.
+ */
+void bagnalloc_persist_set_root(struct bagnalloc_persist *h, void *root)
+{
+    __atomic_store_n(&h->root, root, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Write a persistent heap back to its file, mark it clean and unmap it.
+ * @return Returns 0 on success, -1 if writing failed (the heap will be recovered when opened).
+ */
+int bagnalloc_persist_close(struct bagnalloc_persist *h)
+{
+    size_t size = h->size;
+    int fd = h->fd;
+
+    // the heap must be in the file before the flag says so, or a crash in between could leave a
+    // torn heap marked clean
+    int ok = !msync(h, h->heap.end - (char*)h, MS_SYNC);
+    if (ok)
+    {
+        h->clean = 1;
+        ok = !sync_header(h);
+    }
+
+    munmap(h, size);
+    close(fd);
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// Warm restarts and crash recovery of a persistent heap. Builds a hash table of ENTRIES values
+// of random lengths in a persistent heap and closes it, then reopens it as the next run of a
+// service would and checks every value, timing the build against the reopening. Then, CRASHES
+// times over, a child process opens the heap and keeps inserting and deleting values until it is
+// killed with SIGKILL somewhere in the middle, maybe inside the allocator; the heap is then
+// recovered on the next open, checked, churned some more (blocks handed out twice by broken free
+// lists would overwrite values) and checked again. Opening a heap that is already open, or a
+// file that isn't a heap, must fail, and so must requests larger than the heap:
+//   make persisttest && ./a.out
+// The program exits with status 1 on the first error.
+
+#define HEAP_FILE "persist_test.heap"
+#define BASE ((void*)0x500000000000) // where the heap is mapped in every run
+#define HEAP_SIZE ((size_t)1 << 30)
+#define BUCKETS 65536
+#define ENTRIES 200000
+#define MAX_VALUE 1024
+#define CRASHES 5
+#define CHURN 200000 // # of inserts or deletes after a recovery
+
+using namespace std;
+
+struct entry {
+    entry *next;
+    uint64_t key;
+    size_t length;
+    unsigned char value[];
+};
+
+struct table {
+    size_t count;
+    entry *buckets[BUCKETS];
+};
+
+static struct bagnalloc_persist *heap;
+static table *tab;
+
+static unsigned char value_byte(uint64_t key, size_t i)
+{
+    return (unsigned char)(key * 31 + i);
+}
+
+// the entry is filled in before it is linked, so a crash never leaves half an entry in the table
+static void insert(uint64_t key, size_t length)
+{
+    entry *e = (entry*)bagnalloc_persist_alloc(heap, sizeof(entry) + length);
+    if (e == NULL)
+        return;
+    e->key = key;
+    e->length = length;
+    for (size_t i = 0; i < length; ++i)
+        e->value[i] = value_byte(key, i);
+    e->next = tab->buckets[key % BUCKETS];
+    tab->buckets[key % BUCKETS] = e;
+    tab->count++;
+}
+
+// deletes the first entry of a bucket
+static void erase(uint64_t bucket)
+{
+    entry *e = tab->buckets[bucket % BUCKETS];
+    if (e == NULL)
+        return;
+    tab->buckets[bucket % BUCKETS] = e->next;
+    tab->count--;
+    bagnalloc_persist_free(heap, e);
+}
+
+// returns the number of entries, or -1 if one of them is corrupted
+static long check()
+{
+    long count = 0;
+
+    for (size_t b = 0; b < BUCKETS; ++b)
+        for (entry *e = tab->buckets[b]; e != NULL; e = e->next)
+        {
+            if (e->key % BUCKETS != b || e->length > MAX_VALUE)
+                return -1;
+            for (size_t i = 0; i < e->length; ++i)
+                if (e->value[i] != value_byte(e->key, i))
+                    return -1;
+            count++;
+        }
+    return count;
+}
+
+static void churn(unsigned int *seed, size_t ops)
+{
+    for (size_t i = 0; i < ops; ++i)
+    {
+        uint64_t key = ((uint64_t)rand_r(seed) << 31) | rand_r(seed);
+        if (rand_r(seed) % 2)
+            insert(key, rand_r(seed) % MAX_VALUE);
+        else
+            erase(key);
+    }
+}
+
+static int open_heap(int expect_recovered)
+{
+    int recovered;
+
+    heap = bagnalloc_persist_open(HEAP_FILE, BASE, HEAP_SIZE, &recovered);
+    if (heap == NULL)
+    {
+        perror("FAILED: bagnalloc_persist_open");
+        return 0;
+    }
+    if (recovered != expect_recovered)
+    {
+        printf("FAILED: heap %s\n", recovered ? "recovered after a clean close" : "not recovered after a crash");
+        return 0;
+    }
+    tab = (table*)bagnalloc_persist_root(heap);
+    return 1;
+}
+
+static double since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    unsigned int seed = 1;
+    long count;
+
+    // a short file of zeros isn't a heap
+    unlink(HEAP_FILE);
+    int fd = open(HEAP_FILE, O_RDWR | O_CREAT, 0600);
+    char zeros[100] = { 0 };
+    if (fd < 0 || write(fd, zeros, sizeof(zeros)) != sizeof(zeros))
+        return 1;
+    close(fd);
+    if (bagnalloc_persist_open(HEAP_FILE, BASE, HEAP_SIZE, NULL) != NULL || errno != EINVAL)
+    {
+        printf("FAILED: a file of zeros was opened as a heap\n");
+        return 1;
+    }
+    unlink(HEAP_FILE);
+
+    // first run: build the table
+    auto start = chrono::steady_clock::now();
+    if (!open_heap(0))
+        return 1;
+    tab = (table*)bagnalloc_persist_alloc(heap, sizeof(table));
+    memset(tab, 0, sizeof(table));
+    bagnalloc_persist_set_root(heap, tab);
+    for (size_t i = 0; i < ENTRIES; ++i)
+        insert(((uint64_t)rand_r(&seed) << 31) | rand_r(&seed), rand_r(&seed) % MAX_VALUE);
+    bagnalloc_persist_close(heap);
+    printf("built %zu entries in %.1f ms\n", (size_t)ENTRIES, since(start));
+
+    // second run: everything is still there
+    start = chrono::steady_clock::now();
+    if (!open_heap(0))
+        return 1;
+    printf("reopened in %.3f ms\n", since(start));
+    if (bagnalloc_persist_open(HEAP_FILE, BASE, HEAP_SIZE, NULL) != NULL || errno != EBUSY)
+    {
+        printf("FAILED: a heap was opened twice\n");
+        return 1;
+    }
+    // requests the heap can never hold fail instead of wrapping around to small blocks
+    volatile size_t too_big[] = { SIZE_MAX, SIZE_MAX - 3, HEAP_SIZE };
+    for (size_t i = 0; i < sizeof(too_big) / sizeof(too_big[0]); ++i)
+        if (bagnalloc_persist_alloc(heap, too_big[i]) != NULL)
+        {
+            printf("FAILED: a block of %zu bytes was allocated\n", (size_t)too_big[i]);
+            return 1;
+        }
+    if ((count = check()) != (long)tab->count || count != ENTRIES)
+    {
+        printf("FAILED: %ld entries found after reopening, %zu expected\n", count, (size_t)ENTRIES);
+        return 1;
+    }
+    bagnalloc_persist_close(heap);
+
+    for (unsigned int crash = 0; crash < CRASHES; ++crash)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            unsigned int child_seed = crash + 100;
+            if (!open_heap(0))
+                _exit(1);
+            for (;;)
+                churn(&child_seed, 1);
+        }
+
+        usleep(50000 + rand_r(&seed) % 100000);
+        kill(pid, SIGKILL);
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFSIGNALED(status))
+        {
+            printf("FAILED: child exited with status %d\n", WEXITSTATUS(status));
+            return 1;
+        }
+
+        start = chrono::steady_clock::now();
+        if (!open_heap(1))
+            return 1;
+        double recovery = since(start);
+
+        // the count may be off by one if the child died between linking and counting
+        count = check();
+        if (count < 0)
+        {
+            printf("FAILED: corrupted entry after crash %u\n", crash);
+            return 1;
+        }
+        tab->count = count;
+        churn(&seed, CHURN);
+        if ((count = check()) != (long)tab->count)
+        {
+            printf("FAILED: %ld entries found after churning, %zu expected\n", count, tab->count);
+            return 1;
+        }
+        printf("crash %u: recovered in %.1f ms, %ld entries\n", crash, recovery, count);
+        bagnalloc_persist_close(heap);
+    }
+
+    unlink(HEAP_FILE);
+    printf("passed\n");
+    return 0;
+}
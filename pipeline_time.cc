@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// A pipeline where short lived producer threads allocate messages and a long lived consumer
+// (the main thread) frees them. Run it with a front-end cache, e.g.
+//   BAGNALLOC_CACHE=thread ./a.out
+// and look at the transfer cache hit rates printed at the end: batches given up by the consumer
+// should be picked up by the next producer instead of going through the heap.
+
+#define ROUNDS 2000
+#define BLOCKS 4096 // # of messages per round
+#define MIN_SIZE 16
+#define MAX_SIZE 128
+
+using namespace std;
+
+static void *messages[BLOCKS];
+
+static void produce(unsigned int seed)
+{
+    for (size_t i = 0; i < BLOCKS; ++i)
+    {
+        size_t n = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE);
+        messages[i] = malloc(n);
+        memset(messages[i], 0, n);
+    }
+}
+
+int main()
+{
+    auto start = chrono::steady_clock::now();
+
+    for (unsigned int r = 0; r < ROUNDS; ++r)
+    {
+        thread producer(produce, r);
+        producer.join();
+
+        for (size_t i = 0; i < BLOCKS; ++i)
+            free(messages[i]);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("%f seconds\n", seconds);
+    bagnalloc_print_stats(stdout);
+
+    return 0;
+}
@@ -0,0 +1,500 @@
+/**
+ * @file shared.c
+ * @author Alexander Bagnall
+ * @brief Shared pools: heaps in shared memory that several processes allocate from.
+ *
+ * A pool is a memfd (or any other shared file, such as one from shm_open()) that every process
+ * maps, wherever its own address space has room, so that processes can hand each other large
+ * messages without copying them: one allocates and fills a block, passes its offset from the
+ * start of the pool, and the other turns the offset back into a pointer and eventually frees it.
+ * Since the pool is mapped at a different address in each process, nothing inside it is a
+ * pointer: the free lists link blocks by their offsets, and the pool header holds offsets too.
+ *
+ * The engine is a small segregated fit one with boundary tags, in the style of the fit engines
+ * of fits.c but self-contained: one free list per power of two with a bitmap of the non-empty
+ * ones, and the free neighbours of a freed block found through the flags and the length of the
+ * previous block kept in every block header, so no list has to be walked to coalesce. The pool
+ * has a fixed size, set when it is created.
+ *
+ * The pool is protected by a process-shared robust pthread mutex rather than the lock of lock.h,
+ * which knows nothing about other processes. A process that dies while holding it, maybe half
+ * way through changing a free list, leaves the mutex to the next process that locks it, which
+ * is told so (EOWNERDEAD) and rebuilds the free lists by walking the blocks (see pool_rebuild())
+ * before marking the mutex consistent again.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include "bagnalloc.h"
+#include "bagnalloc_internal.h"
+
+#define SHARED_MAGIC 0x726168736e676162ull // "bagnshar" read as a little endian word
+#define SHARED_ALIGN 16 // blocks and their data sections are aligned to this
+#define SHARED_HEADER 16 // # of bytes in a block header
+#define SHARED_MIN_BLOCK 32 // smallest block, header included: a free block holds two list links
+#define SHARED_LISTS 64 // one free list per power of two
+#define IN_USE 1 // shared_block::head flag: the block is allocated
+#define PREV_IN_USE 2 // shared_block::head flag: the block before it is allocated
+#define FLAGS (SHARED_ALIGN - 1)
+
+/** @struct shared_block
+ *  @brief The header of a block of a pool; the data section follows it.
+ *  @var shared_block::prev_size
+ *  The size of the previous block, valid only if that block is free.
+ *  @var shared_block::head
+ *  The size of the block, header included (a multiple of SHARED_ALIGN), and the IN_USE and
+ *  PREV_IN_USE flags in its low bits.
+ *  @var shared_block::next
+ *  Offset of the next block on the free list, 0 for none. Only in free blocks, where it takes
+ *  the start of the data section.
+ *  @var shared_block::prev
+ *  Offset of the previous block on the free list, 0 for none. Only in free blocks.
+ */
+typedef struct shared_block {
+    size_t prev_size;
+    size_t head;
+    uint64_t next;
+    uint64_t prev;
+} shared_block;
+
+/** @struct shared_pool
+ *  @brief The header at the start of a pool. The first block follows it and a sentinel header,
+ *  always in use, ends the pool.
+ *  @var shared_pool::magic
+ *  SHARED_MAGIC once the pool has been set up.
+ *  @var shared_pool::size
+ *  Number of bytes in the pool.
+ *  @var shared_pool::lock
+ *  Protects the rest of the header and the blocks' headers. Process-shared and robust.
+ *  @var shared_pool::used
+ *  Number of bytes in allocated blocks, headers included.
+ *  @var shared_pool::recoveries
+ *  Number of times a process found the lock left by a dead process and rebuilt the free lists.
+ *  @var shared_pool::bitmap
+ *  Bit i is set if list i isn't empty.
+ *  @var shared_pool::lists
+ *  Offset of the first free block of each list, 0 if the list is empty. List i holds the free
+ *  blocks of 2^i to 2^(i+1) - 1 bytes.
+ */
+typedef struct shared_pool {
+    uint64_t magic;
+    size_t size;
+    pthread_mutex_t lock;
+    size_t used;
+    size_t recoveries;
+    uint64_t bitmap;
+    uint64_t lists[SHARED_LISTS];
+} shared_pool;
+
+/** @struct bagnalloc_shared
+ *  @brief A process's handle on a pool.
+ *  @var bagnalloc_shared::pool
+ *  Where the pool is mapped in this process.
+ *  @var bagnalloc_shared::fd
+ *  The file descriptor of the pool in this process.
+ */
+struct bagnalloc_shared {
+    shared_pool *pool;
+    int fd;
+};
+
+#define FIRST_BLOCK ((sizeof(shared_pool) + SHARED_ALIGN - 1) / SHARED_ALIGN * SHARED_ALIGN) // offset of the first block
+
+static inline shared_block* block_at(shared_pool *p, uint64_t offset)
+{
+    return (shared_block*)((char*)p + offset);
+}
+
+static inline uint64_t offset_of(shared_pool *p, shared_block *block)
+{
+    return (char*)block - (char*)p;
+}
+
+static inline size_t block_size(shared_block *block)
+{
+    return block->head & ~(size_t)FLAGS;
+}
+
+static inline shared_block* next_phys(shared_block *block)
+{
+    return (shared_block*)((char*)block + block_size(block));
+}
+
+/**
+ * @brief Get the offset of the sentinel header at the end of a pool.
+ */
+static inline uint64_t pool_end(shared_pool *p)
+{
+    return p->size - SHARED_HEADER;
+}
+
+/**
+ * @brief Get the list of free blocks of a size: the index of its highest set bit.
+ */
+static inline size_t list_of(size_t size)
+{
+    return sizeof(long) * 8 - 1 - __builtin_clzl(size);
+}
+
+static void list_insert(shared_pool *p, shared_block *block)
+{
+    size_t i = list_of(block_size(block));
+    uint64_t offset = offset_of(p, block);
+
+    block->prev = 0;
+    block->next = p->lists[i];
+    if (p->lists[i])
+        block_at(p, p->lists[i])->prev = offset;
+    p->lists[i] = offset;
+    p->bitmap |= (uint64_t)1 << i;
+}
+
+static void list_remove(shared_pool *p, shared_block *block)
+{
+    size_t i = list_of(block_size(block));
+
+    if (block->prev)
+        block_at(p, block->prev)->next = block->next;
+    else if ((p->lists[i] = block->next) == 0)
+        p->bitmap &= ~((uint64_t)1 << i);
+    if (block->next)
+        block_at(p, block->next)->prev = block->prev;
+}
+
+/**
+ * @brief Start a pool with one free block covering everything between its header and the sentinel.
+ */
+static void pool_init(shared_pool *p, size_t size)
+{
+    p->size = size;
+    p->used = 0;
+    p->recoveries = 0;
+    p->bitmap = 0;
+    memset(p->lists, 0, sizeof(p->lists));
+
+    shared_block *first = block_at(p, FIRST_BLOCK);
+    shared_block *sentinel = block_at(p, pool_end(p));
+    first->head = (pool_end(p) - FIRST_BLOCK) | PREV_IN_USE;
+    sentinel->head = IN_USE;
+    sentinel->prev_size = block_size(first);
+    list_insert(p, first);
+}
+
+/**
+ * @brief Rebuild the free lists of a pool left by a process that died while holding its lock,
+ * in the spirit of fits_rebuild(). The blocks are walked from the first one: runs of free blocks
+ * are merged, a header that can't be right (torn by the death) turns the rest of the pool into a
+ * free block, and the flags, the boundary tags and the lists are set again. Every block that was
+ * allocated is kept; one that was being freed may leak.
+ */
+static void pool_rebuild(shared_pool *p)
+{
+    uint64_t offset, end = pool_end(p);
+    shared_block *block, *prev = NULL, *last_free = NULL;
+
+    // merge the free runs
+    for (offset = FIRST_BLOCK; offset < end; offset += block_size(block))
+    {
+        block = block_at(p, offset);
+        size_t size = block_size(block);
+
+        if (end - offset < SHARED_MIN_BLOCK)
+        {
+            // too short for a block of its own, the previous one takes it
+            prev->head += end - offset;
+            break;
+        }
+        if (size < SHARED_MIN_BLOCK || size > end - offset)
+            block->head = end - offset;
+
+        if (!(block->head & IN_USE) && last_free != NULL)
+        {
+            last_free->head += block_size(block);
+            block = last_free;
+            offset = offset_of(p, block);
+        }
+        else
+        {
+            last_free = block->head & IN_USE ? NULL : block;
+            prev = block;
+        }
+    }
+
+    // then link them up again
+    p->bitmap = 0;
+    p->used = 0;
+    memset(p->lists, 0, sizeof(p->lists));
+    size_t prev_flag = PREV_IN_USE;
+    for (offset = FIRST_BLOCK; offset < end; offset += block_size(block))
+    {
+        block = block_at(p, offset);
+        block->head = (block->head & ~(size_t)PREV_IN_USE) | prev_flag;
+        if (block->head & IN_USE)
+            p->used += block_size(block);
+        else
+        {
+            list_insert(p, block);
+            next_phys(block)->prev_size = block_size(block);
+        }
+        prev_flag = block->head & IN_USE ? PREV_IN_USE : 0;
+    }
+    block_at(p, end)->head = IN_USE | prev_flag;
+}
+
+/**
+ * @brief Lock a pool, recovering it if the last process to hold the lock died with it.
+ * @return Returns 0, or an error number if the lock can't be had (ENOTRECOVERABLE).
+ */
+static int pool_lock(shared_pool *p)
+{
+    int error = pthread_mutex_lock(&p->lock);
+    if (error == EOWNERDEAD)
+    {
+        pool_rebuild(p);
+        p->recoveries++;
+        error = pthread_mutex_consistent(&p->lock);
+    }
+    return error;
+}
+
+/**
+ * @brief Map a pool and make a handle for it.
+ */
+static struct bagnalloc_shared* pool_map(int fd, size_t size)
+{
+    struct bagnalloc_shared *shared = malloc(sizeof(struct bagnalloc_shared));
+    if (shared == NULL)
+        return NULL;
+
+    shared->pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared->pool == MAP_FAILED)
+    {
+        free(shared);
+        return NULL;
+    }
+    shared->fd = fd;
+    return shared;
+}
+
+/**
+ * @brief Create a pool in a file, or in a new memfd if \p fd is negative.
+ * @param fd The file, which is truncated to the size of the pool, or -1.
+ * @param size The size of the pool, rounded up to whole pages.
+ * @return Returns the pool, or NULL with errno set (EINVAL if \p size is too small to hold a block).
+ */
+struct bagnalloc_shared* bagnalloc_shared_create(int fd, size_t size)
+{
+    pthread_mutexattr_t attr;
+    int created = fd < 0;
+
+    size = (size + sysconf(_SC_PAGESIZE) - 1) / sysconf(_SC_PAGESIZE) * sysconf(_SC_PAGESIZE);
+    if (size < FIRST_BLOCK + SHARED_MIN_BLOCK + SHARED_HEADER)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (created && (fd = memfd_create("bagnalloc", MFD_CLOEXEC)) < 0)
+        return NULL;
+    struct bagnalloc_shared *shared = ftruncate(fd, size) ? NULL : pool_map(fd, size);
+    if (shared == NULL)
+    {
+        if (created)
+            close(fd);
+        return NULL;
+    }
+
+    shared_pool *p = shared->pool;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&p->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pool_init(p, size);
+    __atomic_store_n(&p->magic, SHARED_MAGIC, __ATOMIC_RELEASE);
+
+    return shared;
+}
+
+/**
+ * @brief Map a pool created by another process, wherever there is room in this one.
+ * @return Returns the pool, or NULL with errno set (EINVAL if the file holds no pool).
+ */
+struct bagnalloc_shared* bagnalloc_shared_attach(int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st))
+        return NULL;
+    if ((size_t)st.st_size < FIRST_BLOCK + SHARED_MIN_BLOCK + SHARED_HEADER)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct bagnalloc_shared *shared = pool_map(fd, st.st_size);
+    if (shared == NULL)
+        return NULL;
+    if (__atomic_load_n(&shared->pool->magic, __ATOMIC_ACQUIRE) != SHARED_MAGIC || shared->pool->size != (size_t)st.st_size)
+    {
+        munmap(shared->pool, st.st_size);
+        free(shared);
+        errno = EINVAL;
+        return NULL;
+    }
+    return shared;
+}
+
+/**
+ * @brief Unmap a pool from this process. The file descriptor is left open.
+ */
+void bagnalloc_shared_detach(struct bagnalloc_shared *shared)
+{
+    munmap(shared->pool, shared->pool->size);
+    free(shared);
+}
+
+/**
+ * @brief Get the file descriptor of a pool in this process.
+ */
+int bagnalloc_shared_fd(struct bagnalloc_shared *shared)
+{
+    return shared->fd;
+}
+
+/**
+ * @brief Allocate a block of a pool: the first block that fits on the request's own list, or
+ * else any block of the smallest larger non-empty list, split if what is left can be a block.
+ * @return Returns a pointer to the block, or NULL if \p size is 0 or no free block is large enough.
+ */
+void* bagnalloc_shared_alloc(struct bagnalloc_shared *shared, size_t size)
+{
+    shared_pool *p = shared->pool;
+    shared_block *block = NULL;
+
+    if (!size || size > p->size)
+        return NULL;
+    size = MAX(SHARED_MIN_BLOCK, (size + SHARED_HEADER + SHARED_ALIGN - 1) & ~(size_t)FLAGS);
+    size_t i = list_of(size);
+
+    if (pool_lock(p))
+        return NULL;
+
+    // the blocks on the request's own list may be too small, those of the next lists all fit
+    uint64_t offset;
+    for (offset = p->lists[i]; offset; offset = block_at(p, offset)->next)
+        if (block_size(block_at(p, offset)) >= size)
+        {
+            block = block_at(p, offset);
+            break;
+        }
+    if (block == NULL && i + 1 < SHARED_LISTS)
+    {
+        uint64_t lists = p->bitmap & (~(uint64_t)0 << (i + 1));
+        if (lists)
+            block = block_at(p, p->lists[__builtin_ctzll(lists)]);
+    }
+    if (block == NULL)
+    {
+        pthread_mutex_unlock(&p->lock);
+        return NULL;
+    }
+
+    list_remove(p, block);
+    size_t rest = block_size(block) - size;
+    if (rest >= SHARED_MIN_BLOCK)
+    {
+        block->head = size | IN_USE | (block->head & PREV_IN_USE);
+        shared_block *tail = next_phys(block);
+        tail->head = rest | PREV_IN_USE;
+        next_phys(tail)->prev_size = rest;
+        list_insert(p, tail);
+    }
+    else
+    {
+        block->head |= IN_USE;
+        next_phys(block)->head |= PREV_IN_USE;
+    }
+    p->used += block_size(block);
+
+    pthread_mutex_unlock(&p->lock);
+    return (char*)block + SHARED_HEADER;
+}
+
+/**
+ * @brief Free a block of a pool, merging it with its free neighbours.
+ */
+void bagnalloc_shared_free(struct bagnalloc_shared *shared, void *ptr)
+{
+    shared_pool *p = shared->pool;
+
+    if (ptr == NULL || pool_lock(p))
+        return;
+
+    shared_block *block = (shared_block*)((char*)ptr - SHARED_HEADER);
+    size_t size = block_size(block);
+    p->used -= size;
+
+    // merge with the free neighbours; the block before a free block is always in use
+    shared_block *next = next_phys(block);
+    if (!(next->head & IN_USE))
+    {
+        list_remove(p, next);
+        size += block_size(next);
+    }
+    if (!(block->head & PREV_IN_USE))
+    {
+        block = (shared_block*)((char*)block - block->prev_size);
+        list_remove(p, block);
+        size += block_size(block);
+    }
+
+    block->head = size | PREV_IN_USE;
+    next = next_phys(block);
+    next->prev_size = size;
+    next->head &= ~(size_t)PREV_IN_USE;
+    list_insert(p, block);
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * @brief Get the offset of a block from the start of a pool, the same in every process.
+ */
+size_t bagnalloc_shared_offset(struct bagnalloc_shared *shared, void *ptr)
+{
+    return (char*)ptr - (char*)shared->pool;
+}
+
+/**
+ * @brief Get the address of an offset of a pool in this process.
+ */
+void* bagnalloc_shared_pointer(struct bagnalloc_shared *shared, size_t offset)
+{
+    return (char*)shared->pool + offset;
+}
+
+/**
+ * @brief Take a snapshot of the counters of a pool.
+ */
+void bagnalloc_shared_get_stats(struct bagnalloc_shared *shared, struct bagnalloc_shared_stats *stats)
+{
+    shared_pool *p = shared->pool;
+
+    stats->size = p->size;
+    stats->used = stats->recoveries = 0;
+    if (pool_lock(p))
+        return;
+    stats->used = p->used;
+    stats->recoveries = p->recoveries;
+    pthread_mutex_unlock(&p->lock);
+}
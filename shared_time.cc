@@ -0,0 +1,246 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <chrono>
+
+#include "bagnalloc.h"
+
+// Ping-pong between two processes through a shared pool, against copying the messages through a
+// pipe. The parent creates the pool and forks; the child attaches to it again, so that the pool
+// is mapped at another address than in the parent. For each size, the parent allocates a block,
+// fills it and sends its offset; the child checks it (a byte of every page), frees it and answers.
+// The same messages are then sent by value through a pipe. Then, KILLS times over, a child churns
+// the pool until it is killed with SIGKILL, maybe while holding the pool's lock, and the parent
+// checks that its own blocks survived and the pool still works; at least one kill must have been
+// recovered from:
+//   make sharedtime && ./a.out
+// The program exits with status 1 on the first error.
+
+#define POOL_SIZE ((size_t)64 << 20)
+#define MIN_SIZE 64
+#define MAX_SIZE ((size_t)16 << 20)
+#define BYTES ((size_t)64 << 20) // # of bytes sent for each size (at least ROUNDS messages)
+#define ROUNDS 64
+#define KILLS 50
+#define STAMPED 256 // # of blocks the parent keeps while children are killed
+
+using namespace std;
+
+static int to_child[2], to_parent[2];
+
+static void send(int fd, size_t value)
+{
+    if (write(fd, &value, sizeof(value)) != sizeof(value))
+        exit(1);
+}
+
+static size_t receive(int fd)
+{
+    size_t value;
+    if (read(fd, &value, sizeof(value)) != sizeof(value))
+        exit(1);
+    return value;
+}
+
+static void send_all(int fd, const char *buf, size_t length)
+{
+    for (ssize_t n; length > 0; buf += n, length -= n)
+        if ((n = write(fd, buf, length)) <= 0)
+            exit(1);
+}
+
+static void receive_all(int fd, char *buf, size_t length)
+{
+    for (ssize_t n; length > 0; buf += n, length -= n)
+        if ((n = read(fd, buf, length)) <= 0)
+            exit(1);
+}
+
+static void fill(char *buf, size_t size, size_t round)
+{
+    memset(buf, (int)(round & 0xff), size);
+}
+
+static int check(const char *buf, size_t size, size_t round)
+{
+    for (size_t i = 0; i < size; i += 4096)
+        if (buf[i] != (char)(round & 0xff))
+            return 0;
+    return buf[size - 1] == (char)(round & 0xff);
+}
+
+static size_t rounds(size_t size)
+{
+    return BYTES / size > ROUNDS ? BYTES / size : ROUNDS;
+}
+
+// the child's side: answer every message, by offset and then by value; 0 is sent back on an error
+static void echo(int fd)
+{
+    struct bagnalloc_shared *pool = bagnalloc_shared_attach(fd);
+    char *buf = (char*)malloc(MAX_SIZE);
+    if (pool == NULL || buf == NULL)
+        _exit(1);
+
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4)
+    {
+        for (size_t r = 0; r < rounds(size); ++r)
+        {
+            char *ptr = (char*)bagnalloc_shared_pointer(pool, receive(to_child[0]));
+            int ok = check(ptr, size, r);
+            bagnalloc_shared_free(pool, ptr);
+            send(to_parent[1], ok);
+        }
+        for (size_t r = 0; r < rounds(size); ++r)
+        {
+            receive_all(to_child[0], buf, size);
+            send(to_parent[1], check(buf, size, r));
+        }
+    }
+    _exit(0);
+}
+
+// the killed child's side: allocate and free blocks of random sizes until killed
+static void churn(int fd, unsigned int seed)
+{
+    struct bagnalloc_shared *pool = bagnalloc_shared_attach(fd);
+    void *blocks[64] = { NULL };
+    if (pool == NULL)
+        _exit(1);
+
+    for (;;)
+    {
+        size_t i = rand_r(&seed) % 64;
+        bagnalloc_shared_free(pool, blocks[i]);
+        blocks[i] = bagnalloc_shared_alloc(pool, 16 + rand_r(&seed) % 4096);
+    }
+}
+
+static double since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    struct bagnalloc_shared_stats stats;
+    unsigned int seed = 1;
+
+    struct bagnalloc_shared *pool = bagnalloc_shared_create(-1, POOL_SIZE);
+    if (pool == NULL)
+    {
+        perror("FAILED: bagnalloc_shared_create");
+        return 1;
+    }
+    if (pipe(to_child) || pipe(to_parent))
+        return 1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+        echo(bagnalloc_shared_fd(pool));
+
+    char *buf = (char*)malloc(MAX_SIZE);
+    printf("%10s %16s %16s\n", "size", "shared (us)", "pipe (us)");
+    for (size_t size = MIN_SIZE; size <= MAX_SIZE; size *= 4)
+    {
+        auto start = chrono::steady_clock::now();
+        for (size_t r = 0; r < rounds(size); ++r)
+        {
+            char *ptr = (char*)bagnalloc_shared_alloc(pool, size);
+            if (ptr == NULL)
+            {
+                printf("FAILED: pool full at %zu bytes\n", size);
+                return 1;
+            }
+            fill(ptr, size, r);
+            send(to_child[1], bagnalloc_shared_offset(pool, ptr));
+            if (!receive(to_parent[0]))
+            {
+                printf("FAILED: message of %zu bytes corrupted in the pool\n", size);
+                return 1;
+            }
+        }
+        double shared = since(start) / rounds(size);
+
+        start = chrono::steady_clock::now();
+        for (size_t r = 0; r < rounds(size); ++r)
+        {
+            fill(buf, size, r);
+            send_all(to_child[1], buf, size);
+            if (!receive(to_parent[0]))
+            {
+                printf("FAILED: message of %zu bytes corrupted in the pipe\n", size);
+                return 1;
+            }
+        }
+        printf("%10zu %16.2f %16.2f\n", size, shared, since(start) / rounds(size));
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("FAILED: echoing child failed\n");
+        return 1;
+    }
+
+    // blocks of the parent's that must come through the kills untouched
+    char *stamped[STAMPED];
+    for (size_t i = 0; i < STAMPED; ++i)
+    {
+        if ((stamped[i] = (char*)bagnalloc_shared_alloc(pool, 64 + i)) == NULL)
+            return 1;
+        fill(stamped[i], 64 + i, i);
+    }
+
+    for (unsigned int kill_count = 0; kill_count < KILLS; ++kill_count)
+    {
+        pid = fork();
+        if (pid == 0)
+            churn(bagnalloc_shared_fd(pool), kill_count);
+        usleep(1000 + rand_r(&seed) % 20000);
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+
+        // churn some blocks of the parent's own through the recovered pool
+        void *blocks[256];
+        for (size_t i = 0; i < 256; ++i)
+            if ((blocks[i] = bagnalloc_shared_alloc(pool, 16 + rand_r(&seed) % 4096)) != NULL)
+                memset(blocks[i], 0xee, 16);
+        for (size_t i = 0; i < 256; ++i)
+            bagnalloc_shared_free(pool, blocks[i]);
+        for (size_t i = 0; i < STAMPED; ++i)
+            if (!check(stamped[i], 64 + i, i))
+            {
+                printf("FAILED: block %zu overwritten after kill %u\n", i, kill_count);
+                return 1;
+            }
+    }
+
+    bagnalloc_shared_get_stats(pool, &stats);
+    printf("%u kills, %zu recoveries, %zu of %zu bytes in use (blocks of killed children leak)\n",
+           KILLS, stats.recoveries, stats.used, stats.size);
+    if (stats.recoveries == 0)
+    {
+        printf("FAILED: no child died holding the lock\n");
+        return 1;
+    }
+
+    // every byte the children leaked aside, the pool must still hand out its largest blocks
+    for (size_t i = 0; i < STAMPED; ++i)
+        bagnalloc_shared_free(pool, stamped[i]);
+    void *big = bagnalloc_shared_alloc(pool, POOL_SIZE / 4);
+    if (big == NULL)
+    {
+        printf("FAILED: no room for a quarter of the pool after recovering\n");
+        return 1;
+    }
+    bagnalloc_shared_free(pool, big);
+
+    bagnalloc_shared_detach(pool);
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "bagnalloc.h"
+
+// Latency of the first requests after startup, with and without getting ready for them with
+// bagnalloc_reserve() and bagnalloc_reserve_cache(). Every configuration runs in a process of its
+// own, started fresh with fork() before the parent allocated anything: it gets ready (or not),
+// then times each of its first OPS requests, allocations of sizes from SIZES (two thirds of them)
+// and frees of blocks picked at random. The time spent getting ready, the time of the requests
+// and the 99th percentile and worst request are printed. Best run with the caches on:
+//   make startuptime && BAGNALLOC_CACHE=thread ./a.out
+// The program exits with status 1 if a configuration fails.
+
+#define OPS 300000
+#define RESERVE ((size_t)128 << 20) // # of bytes reserved, more than the requests keep at once
+#define CACHED 1024 // # of blocks of each size put through the caches
+
+using namespace std;
+
+static const size_t SIZES[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+#define NUM_SIZES (sizeof(SIZES) / sizeof(SIZES[0]))
+
+enum ready { NOTHING, RESERVE_ONLY, POPULATE, POPULATE_CACHES };
+static const char *names[] = { "nothing", "reserve", "reserve+populate", "reserve+populate+caches" };
+
+static double since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+}
+
+static void run(ready how)
+{
+    vector<float> latencies;
+    vector<char*> live;
+    unsigned int seed = 1;
+
+    // the vectors are ready before the clock starts
+    latencies.reserve(OPS);
+    live.reserve(OPS);
+
+    auto start = chrono::steady_clock::now();
+    if (how != NOTHING && bagnalloc_reserve(RESERVE, how == RESERVE_ONLY ? 0 : BAGNALLOC_RESERVE_POPULATE))
+        _exit(1);
+    if (how == POPULATE_CACHES)
+        for (size_t i = 0; i < NUM_SIZES; ++i)
+            bagnalloc_reserve_cache(SIZES[i], CACHED);
+    double ready_time = since(start);
+
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < OPS; ++i)
+    {
+        unsigned int r = rand_r(&seed);
+        auto op = chrono::steady_clock::now();
+        if (r % 3 || live.empty())
+        {
+            size_t size = SIZES[r / 3 % NUM_SIZES];
+            char *ptr = (char*)malloc(size);
+            if (ptr == NULL)
+                _exit(1);
+            memset(ptr, 1, size);
+            live.push_back(ptr);
+        }
+        else
+        {
+            size_t j = r / 3 % live.size();
+            free(live[j]);
+            live[j] = live.back();
+            live.pop_back();
+        }
+        latencies.push_back(since(op));
+    }
+    double total = since(start);
+
+    sort(latencies.begin(), latencies.end());
+    printf("%-24s %12.1f %12.1f %10.2f %10.1f\n", names[how], ready_time / 1000, total / 1000,
+           latencies[OPS * 99 / 100], latencies[OPS - 1]);
+    fflush(stdout);
+    _exit(0);
+}
+
+int main()
+{
+    printf("%-24s %12s %12s %10s %10s\n", "getting ready", "ready (ms)", "ops (ms)", "p99 (us)", "max (us)");
+    fflush(stdout);
+
+    for (int how = NOTHING; how <= POPULATE_CACHES; ++how)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+            run((ready)how);
+        int status;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            printf("FAILED: %s\n", names[how]);
+            return 1;
+        }
+    }
+    printf("passed\n");
+    return 0;
+}
@@ -0,0 +1,158 @@
+#ifndef STRESS_H
+#define STRESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "bagnalloc.h"
+
+// The harness shared by the *_stress.cc programs. Threads allocate objects, stamp them with a
+// value unique to the allocation and swap them through a shared array of slots, so most objects
+// are freed by a thread that didn't allocate them. An object handed out twice, or lost links in
+// a free list, shows up as a stamp that was overwritten by another allocation. Each program only
+// picks the sizes and adds the checks of its own feature through the hooks of stress_test.
+
+#define STAMP_DENSE 4096 // # of bytes at the start of an object stamped word by word, then at offsets doubling each time
+#define THREAD_CHECK_INTERVAL 4096 // # of allocations between calls of stress_test::thread_check
+
+struct object {
+    char *ptr;
+    size_t size;
+    uint64_t stamp;
+};
+
+struct stress_test {
+    unsigned int threads;
+    uint64_t ops; // # of allocations per thread
+    size_t slots; // # of objects in the shared array
+    size_t (*size)(unsigned int *seed); // the size of the next object
+    int (*fresh)(object *o); // extra check of a new object, or NULL; returns 0 on an error
+    size_t (*grow)(size_t size); // the size one in 16 objects is grown to with realloc() before being freed, or NULL
+    int (*thread_check)(unsigned int id); // called by each thread before its first and every THREAD_CHECK_INTERVAL allocations, or NULL; returns 0 on an error
+};
+
+static std::atomic<int> errors(0);
+
+// the stamp goes to every word of the first STAMP_DENSE bytes, then to words twice as far in each
+// time (large objects only have a few of their pages touched), and to the last whole word; bytes
+// past that (all of them in objects under 8 bytes) hold the stamp's low byte
+static inline void stamp_word(object *o, size_t offset)
+{
+    uint64_t value = o->stamp + offset / 8;
+    memcpy(o->ptr + offset, &value, 8);
+}
+
+static inline int word_ok(const object *o, size_t offset)
+{
+    uint64_t value = o->stamp + offset / 8;
+    return !memcmp(o->ptr + offset, &value, 8);
+}
+
+static inline size_t next_word(size_t offset)
+{
+    return offset < STAMP_DENSE ? offset + 8 : offset * 2;
+}
+
+static inline void stamp_object(object *o)
+{
+    size_t words = o->size / 8 * 8;
+
+    for (size_t offset = 0; offset < words; offset = next_word(offset))
+        stamp_word(o, offset);
+    if (words)
+        stamp_word(o, words - 8);
+    memset(o->ptr + words, (int)(o->stamp & 0xff), o->size - words);
+}
+
+static inline int stamp_ok(const object *o)
+{
+    size_t words = o->size / 8 * 8;
+
+    for (size_t offset = 0; offset < words; offset = next_word(offset))
+        if (!word_ok(o, offset))
+            return 0;
+    if (words && !word_ok(o, words - 8))
+        return 0;
+    for (size_t i = words; i < o->size; ++i)
+        if ((unsigned char)o->ptr[i] != (o->stamp & 0xff))
+            return 0;
+    return 1;
+}
+
+static inline void stress_work(const stress_test *t, std::atomic<object*> *slots, unsigned int id)
+{
+    unsigned int seed = id;
+
+    for (uint64_t i = 0; i < t->ops && !errors; ++i)
+    {
+        if (t->thread_check != NULL && i % THREAD_CHECK_INTERVAL == 0 && !t->thread_check(id))
+        {
+            errors++;
+            return;
+        }
+
+        object *o = new object;
+        o->size = t->size(&seed);
+        o->stamp = ((uint64_t)id << 56) | (i << 8) | (rand_r(&seed) & 0xff);
+        o->ptr = (char*)malloc(o->size);
+        if (o->ptr == NULL || (uintptr_t)o->ptr % 8 || malloc_usable_size(o->ptr) < o->size ||
+            (t->fresh != NULL && !t->fresh(o)))
+        {
+            errors++;
+            return;
+        }
+        stamp_object(o);
+
+        object *old = slots[rand_r(&seed) % t->slots].exchange(o);
+        if (old == NULL)
+            continue;
+        if (!stamp_ok(old))
+            errors++;
+
+        // grown objects must take their contents along
+        if (t->grow != NULL && rand_r(&seed) % 16 == 0)
+        {
+            old->ptr = (char*)realloc(old->ptr, t->grow(old->size));
+            if (old->ptr == NULL || !stamp_ok(old))
+                errors++;
+        }
+        free(old->ptr);
+        delete old;
+    }
+}
+
+// runs the threads, then checks and frees what is left in the slots and prints the allocator
+// statistics; returns the number of errors
+static inline int stress_run(const stress_test &t)
+{
+    std::atomic<object*> *slots = new std::atomic<object*>[t.slots]();
+    std::vector<std::thread> threads;
+
+    for (unsigned int i = 0; i < t.threads; ++i)
+        threads.push_back(std::thread(stress_work, &t, slots, i));
+    for (unsigned int i = 0; i < t.threads; ++i)
+        threads[i].join();
+
+    for (size_t i = 0; i < t.slots; ++i)
+    {
+        object *o = slots[i].exchange(NULL);
+        if (o == NULL)
+            continue;
+        if (!stamp_ok(o))
+            errors++;
+        free(o->ptr);
+        delete o;
+    }
+    delete[] slots;
+
+    bagnalloc_print_stats(stdout);
+    return errors;
+}
+
+#endif
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <omp.h>
+
+#include "bagnalloc.h"
+
+// Skewed variant of threads_time.cc: out of THREADS threads only HOT of them allocate heavily,
+// the rest barely touch the heap. The hot threads start out on the same arena and should
+// spread over new ones. Compare against a single arena with
+//   make skewtime && BAGNALLOC_ARENAS=1 ./a.out
+//   make skewtime && ./a.out
+// Prints the wall time per round and the arena assignment at the end.
+
+#define THREADS 16
+#define HOT 4 // # of threads doing most of the work
+#define ROUNDS 20
+#define HOT_OPS 100000 // # of malloc/free pairs per hot thread per round
+#define COLD_OPS 100 // # of malloc/free pairs per cold thread per round
+#define N 16 // # of live blocks per thread
+#define MIN_SIZE 512
+#define MAX_SIZE 8192
+
+int main()
+{
+    double total = 0;
+
+    for (int r = 0; r < ROUNDS; ++r)
+    {
+        double start = omp_get_wtime();
+
+        #pragma omp parallel for num_threads(THREADS) schedule(static, 1)
+        for (int t = 0; t < THREADS; ++t)
+        {
+            unsigned int seed = r * THREADS + t;
+            void *stuff[N] = { 0 };
+            size_t ops = t < HOT ? HOT_OPS : COLD_OPS;
+
+            for (size_t i = 0; i < ops; ++i)
+            {
+                size_t slot = i % N;
+                size_t n_bytes = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE);
+                free(stuff[slot]);
+                stuff[slot] = malloc(n_bytes);
+                memset(stuff[slot], 0, 64);
+            }
+
+            for (size_t i = 0; i < N; ++i)
+                free(stuff[i]);
+        }
+
+        double seconds = omp_get_wtime() - start;
+        total += seconds;
+        printf("round %d %f\n", r, seconds);
+    }
+
+    printf("total %f\n", total);
+    bagnalloc_print_stats(stdout);
+
+    return 0;
+}
@@ -0,0 +1,395 @@
+/**
+ * @file tiny.c
+ * @author Alexander Bagnall
+ * @brief Header-free slots for tiny allocations.
+ *
+ * Every block in the heap carries a block_meta header, so malloc(1) takes 8 bytes of data plus
+ * the header. Requests of up to TINY_MAX bytes are served here instead, from runs: TINY_RUN_SIZE
+ * byte pieces of an address range reserved for them, each cut into slots of one size (8 or 16
+ * bytes). A run starts with its own header, which covers its first few slots, and a bitmap with
+ * one bit per slot, so the only per-object overhead is that bit. free() knows a tiny object by
+ * its address falling in the reserved range, and finds its run by rounding the address down.
+ * With the page heap on (BAGNALLOC_PAGEHEAP), runs are slab spans of it instead, told apart by
+ * the page map (see pageheap.c), and a run left empty goes back to it unless it is the last run
+ * with free slots of its shard.
+ *
+ * A free slot is found by searching the bitmap for a clear bit with the kernel picked by bitmap.c.
+ * Runs with free slots are kept on a list per size class and shard; like the medium free lists
+ * (see medium.c) a thread uses the shard of the cpu it runs on, and each shard has its own lock.
+ * A freed slot goes back to the run it came from, under the lock of the shard that owns the run.
+ * A thread freeing a slot of another shard than its own doesn't wait for that lock: the slot is
+ * pushed to the shard's incoming slots, which the next holder of the lock puts back.
+ * Runs cut from the reserved range are never given back.
+ *
+ * Enabled with the BAGNALLOC_TINY environment variable.
+ */
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "bagnalloc.h"
+#include "bagnalloc_internal.h"
+#include "lock.h"
+
+#define TINY_CLASSES (TINY_MAX / 8) // one class per multiple of 8
+#define TINY_RUN_SIZE 4096 // # of bytes in a run; runs are aligned to it
+#define TINY_SLOTS (TINY_RUN_SIZE / 8) // # of slots in a run of the smallest class
+#define TINY_WORDS (TINY_SLOTS / 64) // # of words in the bitmap of a run
+#define TINY_REGION_SIZE ((size_t)1 << (sizeof(void*) == 8 ? 32 : 24)) // address range reserved for runs
+#define TINY_SHARDS 8 // # of lists of runs per size class
+
+/** @struct tiny_run
+ *  @brief The header at the start of every run.
+ *  @var tiny_run::bitmap
+ *  Bit i is set if slot i is taken. The slots covered by the header are always taken, and so
+ *  are the bits past the last slot of classes with fewer than TINY_SLOTS slots.
+ *  @var tiny_run::prev
+ *  The previous run on the list of runs with free slots of the run's shard.
+ *  @var tiny_run::next
+ *  The next run on the list of runs with free slots of the run's shard.
+ *  @var tiny_run::used
+ *  Number of slots handed out.
+ *  @var tiny_run::capacity
+ *  Number of slots that can be handed out.
+ *  @var tiny_run::size_class
+ *  The size class of the slots.
+ *  @var tiny_run::shard
+ *  The shard whose list the run belongs to.
+ *  @var tiny_run::listed
+ *  Whether the run is on the list of its shard (it isn't while it is full).
+ */
+typedef struct tiny_run {
+    uint64_t bitmap[TINY_WORDS];
+    struct tiny_run *prev;
+    struct tiny_run *next;
+    unsigned short used;
+    unsigned short capacity;
+    unsigned char size_class;
+    unsigned char shard;
+    unsigned char listed;
+} __attribute__((aligned(16))) tiny_run;
+
+/** @struct tiny_shard
+ *  @brief The runs of one size class used by the threads of some cpus. Aligned to a cache line
+ *  so shards don't share one.
+ *  @var tiny_shard::lock
+ *  Protects the list and the runs on it.
+ *  @var tiny_shard::runs
+ *  The runs with free slots, NULL if there are none.
+ *  @var tiny_shard::allocated
+ *  Number of runs held by the shard.
+ *  @var tiny_shard::live
+ *  Number of slots handed out by the runs of the shard.
+ *  @var tiny_shard::incoming
+ *  Slots freed by threads of other shards, linked through their first word. Pushed to without
+ *  the lock, and put back in their runs by the next holder of the lock (see shard_drain()).
+ */
+typedef struct tiny_shard {
+    malloc_lock lock;
+    void *incoming;
+    tiny_run *runs;
+    size_t allocated;
+    size_t live;
+} __attribute__((aligned(64))) tiny_shard;
+
+static tiny_shard tiny_shards[TINY_CLASSES][TINY_SHARDS];
+
+static char *tiny_base; // start of the range reserved for runs, NULL if the tiny slots are off or use the page heap
+static char *tiny_top; // start of the part of the range no run has been cut from yet
+static int tiny_paged; // whether runs are spans of the page heap
+
+/**
+ * @brief Pick the shard of the calling thread: the one of its current cpu or, if the cpu is
+ * unknown, one picked by hashing a thread local address.
+ */
+static inline size_t current_shard()
+{
+    static __thread char thread_marker;
+
+    int cpu = sched_getcpu();
+    if (cpu >= 0)
+        return cpu % TINY_SHARDS;
+    return ((uintptr_t)&thread_marker >> 12) % TINY_SHARDS;
+}
+
+/**
+ * @brief Find the run holding an address.
+ * @return Returns the run, or NULL if \p ptr isn't a tiny slot.
+ */
+static inline tiny_run* run_of(void *ptr)
+{
+    if (tiny_base != NULL ? (uintptr_t)((char*)ptr - tiny_base) >= TINY_REGION_SIZE
+                          : !tiny_paged || page_kind(ptr) != PAGE_SLAB)
+        return NULL;
+    return (tiny_run*)((uintptr_t)ptr & ~(uintptr_t)(TINY_RUN_SIZE - 1));
+}
+
+/**
+ * @brief Cut a new run from the reserved range, or take one from the page heap.
+ * @param c The size class of its slots.
+ * @param s The shard it belongs to.
+ * @return Returns the run, or NULL if the range or the page heap is used up.
+ */
+static tiny_run* run_create(size_t c, size_t s)
+{
+    char *start;
+    if (tiny_paged)
+    {
+        if ((start = page_alloc(TINY_RUN_SIZE / HEAP_PAGE_SIZE, PAGE_SLAB)) == NULL)
+            return NULL;
+    }
+    else
+    {
+        start = __atomic_fetch_add(&tiny_top, TINY_RUN_SIZE, __ATOMIC_RELAXED);
+        if (start + TINY_RUN_SIZE > tiny_base + TINY_REGION_SIZE)
+            return NULL;
+    }
+
+    tiny_run *run = (tiny_run*)start;
+    size_t size = (c + 1) * 8;
+    size_t header_slots = (sizeof(tiny_run) + size - 1) / size;
+    size_t slots = TINY_RUN_SIZE / size;
+    size_t i;
+
+    // spans of the page heap may have been used before
+    memset(run->bitmap, 0, sizeof(run->bitmap));
+    for (i = 0; i < header_slots; ++i)
+        run->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    for (i = slots; i < TINY_SLOTS; ++i)
+        run->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    run->used = 0;
+    run->capacity = slots - header_slots;
+    run->size_class = c;
+    run->shard = s;
+    run->listed = 0;
+    run->prev = run->next = NULL;
+    return run;
+}
+
+/**
+ * @brief Reserve the address range for the runs if the BAGNALLOC_TINY environment variable is
+ * set, unless they come from the page heap. Called once while the heap is initialized, after
+ * page_heap_init().
+ */
+void tiny_init()
+{
+    const char *tiny = getenv("BAGNALLOC_TINY");
+    if (tiny == NULL || !strcmp(tiny, "0"))
+        return;
+
+    if (page_heap_enabled())
+    {
+        tiny_paged = 1;
+        return;
+    }
+
+    // pages are only used once touched
+    char *region = mmap(NULL, TINY_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+        return;
+    tiny_top = region;
+    tiny_base = region;
+}
+
+/**
+ * @brief Put a slot back in its run. The caller must hold the lock of the shard owning the run.
+ */
+static void slot_free(tiny_shard *shard, tiny_run *run, void *ptr)
+{
+    size_t i = ((char*)ptr - (char*)run) / ((run->size_class + 1) * 8);
+
+    run->bitmap[i / 64] &= ~((uint64_t)1 << (i % 64));
+    run->used--;
+    shard->live--;
+    if (!run->listed)
+    {
+        run->prev = NULL;
+        if ((run->next = shard->runs) != NULL)
+            run->next->prev = run;
+        run->listed = 1;
+        shard->runs = run;
+    }
+
+    // an empty run goes back to the page heap, unless the shard would be left without runs
+    if (tiny_paged && run->used == 0 && (run->prev != NULL || run->next != NULL))
+    {
+        if (run->prev != NULL)
+            run->prev->next = run->next;
+        else
+            shard->runs = run->next;
+        if (run->next != NULL)
+            run->next->prev = run->prev;
+        shard->allocated--;
+        page_free(run);
+    }
+}
+
+/**
+ * @brief Put the slots other threads pushed to a shard back in their runs. The caller must hold
+ * the shard's lock.
+ */
+static void shard_drain(tiny_shard *shard)
+{
+    if (__atomic_load_n(&shard->incoming, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    void *ptr = __atomic_exchange_n(&shard->incoming, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL)
+    {
+        void *next = *(void**)ptr;
+        slot_free(shard, run_of(ptr), ptr);
+        ptr = next;
+    }
+}
+
+/**
+ * @brief Allocate a tiny slot.
+ * @param size The number of bytes to allocate (a nonzero multiple of 8 no larger than TINY_MAX).
+ * @return Returns a pointer to the slot, or NULL if the caller should use the heap.
+ */
+void* tiny_alloc(size_t size)
+{
+    if (tiny_base == NULL && !tiny_paged)
+        return NULL;
+
+    size_t c = size / 8 - 1;
+    size_t s = current_shard();
+    tiny_shard *shard = &tiny_shards[c][s];
+
+    lock_acquire(&shard->lock);
+    shard_drain(shard);
+
+    tiny_run *run = shard->runs;
+    if (run == NULL)
+    {
+        if ((run = run_create(c, s)) == NULL)
+        {
+            lock_release(&shard->lock);
+            return NULL;
+        }
+        run->listed = 1;
+        shard->runs = run;
+        shard->allocated++;
+    }
+
+    size_t i = bitmap_find_clear(run->bitmap, TINY_WORDS, 0);
+    run->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    shard->live++;
+
+    // a full run leaves the list until one of its slots is freed
+    if (++run->used == run->capacity)
+    {
+        if ((shard->runs = run->next) != NULL)
+            shard->runs->prev = NULL;
+        run->listed = 0;
+    }
+
+    lock_release(&shard->lock);
+
+    return (char*)run + i * size;
+}
+
+/**
+ * @brief Free a tiny slot.
+ * @param ptr A pointer to memory returned by malloc().
+ * @return Returns 1 if \p ptr was a tiny slot and has been freed, 0 if the caller should free it.
+ */
+int tiny_free(void *ptr)
+{
+    tiny_run *run = run_of(ptr);
+    if (run == NULL)
+        return 0;
+
+    tiny_shard *shard = &tiny_shards[run->size_class][run->shard];
+
+    // a slot of another shard is pushed to it, and only put back at once if its lock is free
+    if (run->shard != current_shard())
+    {
+        void *head = __atomic_load_n(&shard->incoming, __ATOMIC_RELAXED);
+        do
+            *(void**)ptr = head;
+        while (!__atomic_compare_exchange_n(&shard->incoming, &head, ptr, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+        if (!lock_try(&shard->lock))
+            return 1;
+    }
+    else
+    {
+        lock_acquire(&shard->lock);
+        slot_free(shard, run, ptr);
+    }
+
+    shard_drain(shard);
+    lock_release(&shard->lock);
+    return 1;
+}
+
+/**
+ * @brief Get the number of bytes that can be used in a tiny slot.
+ * @param ptr A pointer to memory returned by malloc().
+ * @return Returns the size of the slot, or 0 if \p ptr isn't a tiny slot.
+ */
+size_t tiny_length(void *ptr)
+{
+    tiny_run *run = run_of(ptr);
+    return run != NULL ? (run->size_class + 1) * 8 : 0;
+}
+
+/**
+ * @brief Fill in the tiny slot part of the allocator statistics.
+ * @param stats The structure to fill in.
+ */
+void tiny_stats(struct bagnalloc_stats *stats)
+{
+    size_t c, s;
+
+    stats->tiny_runs = stats->tiny_objects = 0;
+
+    for (c = 0; c < TINY_CLASSES; ++c)
+        for (s = 0; s < TINY_SHARDS; ++s)
+        {
+            tiny_shard *shard = &tiny_shards[c][s];
+            stats->tiny_runs += __atomic_load_n(&shard->allocated, __ATOMIC_RELAXED);
+            stats->tiny_objects += __atomic_load_n(&shard->live, __ATOMIC_RELAXED);
+        }
+}
+
+/**
+ * @brief Take the locks of the shards before fork() (see fork_prepare() in malloc.c).
+ */
+void tiny_fork_prepare()
+{
+    size_t c, s;
+
+    for (c = 0; c < TINY_CLASSES; ++c)
+        for (s = 0; s < TINY_SHARDS; ++s)
+            lock_acquire(&tiny_shards[c][s].lock);
+}
+
+/**
+ * @brief Release the locks taken by tiny_fork_prepare() in the parent after fork().
+ */
+void tiny_fork_parent()
+{
+    size_t c, s;
+
+    for (c = TINY_CLASSES; c-- > 0;)
+        for (s = TINY_SHARDS; s-- > 0;)
+            lock_release(&tiny_shards[c][s].lock);
+}
+
+/**
+ * @brief Reset the locks of the shards in the child after fork().
+ */
+void tiny_fork_child()
+{
+    malloc_lock unlocked = MALLOC_LOCK_INITIALIZER;
+    size_t c, s;
+
+    for (c = 0; c < TINY_CLASSES; ++c)
+        for (s = 0; s < TINY_SHARDS; ++s)
+            tiny_shards[c][s].lock = unlocked;
+}
@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stress.h"
+
+// Correctness stress test for the header-free tiny slots. Run it with
+//   BAGNALLOC_TINY=1 ./a.out
+// First measures the memory taken by DENSE live 1 byte allocations, then puts 1 to 16 byte
+// objects through the harness of stress.h. Objects are also grown with realloc() now and then,
+// leaving the tiny slots, which must keep their contents. The program exits with status 1 on the
+// first error.
+
+#define DENSE 1000000 // # of 1 byte objects live at once in the first part
+#define MAX_SIZE 16
+
+static size_t tiny_size(unsigned int *seed)
+{
+    return 1 + rand_r(seed) % MAX_SIZE;
+}
+
+static size_t grow(size_t size)
+{
+    return 64;
+}
+
+int main()
+{
+    struct bagnalloc_stats before, after;
+    bagnalloc_get_stats(&before);
+
+    // large enough to get a mapping of its own, outside the heap
+    void **dense = (void**)malloc(DENSE * sizeof(void*));
+    for (size_t i = 0; i < DENSE; ++i)
+        dense[i] = malloc(1);
+    bagnalloc_get_stats(&after);
+    size_t used = after.heap_size - before.heap_size + (after.tiny_runs - before.tiny_runs) * 4096;
+    printf("%d live 1 byte objects take %.2f bytes each\n", DENSE, (double)used / DENSE);
+    for (size_t i = 0; i < DENSE; ++i)
+        free(dense[i]);
+    free(dense);
+
+    stress_test t = { 16, 200000, 1024, tiny_size, NULL, grow, NULL };
+
+    int corrupted = stress_run(t);
+    if (corrupted)
+    {
+        printf("FAILED: %d corrupted objects\n", corrupted);
+        return 1;
+    }
+    printf("passed\n");
+    return 0;
+}
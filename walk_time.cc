@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <chrono>
+
+#include "bagnalloc.h"
+#include "counters.h"
+
+// Cost of walking long free lists: builds a heap with FREE_BLOCKS[i] small free blocks between
+// allocated ones, then times allocations that are larger than any of them, so that every search
+// walks the whole list. Compare the plain walk against the software pipelined one:
+//   make walktime && ./a.out
+//   make walktime && BAGNALLOC_PREFETCH=1 ./a.out
+// Each heap is built in a child process of its own. Each line gives the number of free blocks,
+// the wall time per block walked past and, per block, the cycles, instructions, last level
+// cache misses and L1 data cache read misses counted with perf_event_open() in user space
+// ("-" where the counter isn't available, as in most virtual machines).
+
+#define STEPS 50000000 // # of blocks walked past per heap size (at least MIN_WALKS walks)
+#define MIN_WALKS 5
+#define LARGE 4096 // # of bytes of the allocations that walk the list
+
+using namespace std;
+
+static const size_t FREE_BLOCKS[] = { 10000, 100000, 1000000 };
+
+static counter counters[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1 },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+    { "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1 },
+    { "l1d_misses", PERF_TYPE_HW_CACHE, CACHE_READ_MISSES(PERF_COUNT_HW_CACHE_L1D), -1 },
+};
+
+#define NUM_COUNTERS (sizeof(counters) / sizeof(counters[0]))
+
+static void run(size_t free_blocks)
+{
+    unsigned int seed = 1;
+
+    // allocated first, so it sits below the blocks it keeps track of (or in a mapping of its own)
+    void **blocks = (void**)malloc(2 * free_blocks * sizeof(void*));
+
+    // every other block is freed, from the top down so that each one becomes the new head of
+    // the free list instead of being looked up in it
+    for (size_t i = 0; i < 2 * free_blocks; ++i)
+        blocks[i] = malloc(i % 2 ? 8 + rand_r(&seed) % 248 : 8 + rand_r(&seed) % 120);
+    for (size_t i = 2 * free_blocks; i > 0; i -= 2)
+        free(blocks[i - 2]);
+
+    size_t walks = STEPS / free_blocks > MIN_WALKS ? STEPS / free_blocks : MIN_WALKS;
+
+    // one walk to grow the heap past the large block; volatile keeps the compiler from
+    // dropping the malloc()/free() pairs
+    void * volatile ptr = malloc(LARGE);
+    free(ptr);
+
+    start_counters(counters, NUM_COUNTERS);
+    auto start = chrono::steady_clock::now();
+
+    for (size_t i = 0; i < walks; ++i)
+    {
+        ptr = malloc(LARGE);
+        free(ptr);
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    stop_counters(counters, NUM_COUNTERS);
+
+    double steps = (double)walks * free_blocks;
+    printf("%zu %f", free_blocks, seconds / steps * 1e9);
+    print_counters(counters, NUM_COUNTERS, steps);
+    printf("\n");
+}
+
+int main()
+{
+    const char *prefetch = getenv("BAGNALLOC_PREFETCH");
+    printf("prefetch %s\n", prefetch != NULL ? prefetch : "0");
+    printf("free_blocks ns");
+    print_counter_names(counters, NUM_COUNTERS);
+    printf("\n");
+    fflush(stdout);
+
+    open_counters(counters, NUM_COUNTERS);
+
+    for (size_t i = 0; i < sizeof(FREE_BLOCKS) / sizeof(FREE_BLOCKS[0]); ++i)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            run(FREE_BLOCKS[i]);
+            fflush(stdout);
+            _exit(0);
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}